@@ -0,0 +1,285 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/batchjob.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <future>  // NOLINT
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/paths.h"
+#include "src/sftpasync.h"
+#include "src/sftpconnection.h"
+#include "src/string.h"
+
+using std::function;
+using std::future;
+using std::min;
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::string_view;
+using std::vector;
+
+#define BATCH_EXEC_PATHS 200  // Paths per command, to stay well below the limit on command line length.
+
+// Picks the line of a command's stderr that is about path, as rm, mv and chmod name the path in their messages.
+static string errorFor(const string &err_output, const string &path, const string &fallback) {
+    size_t start = 0;
+    while (start < err_output.size()) {
+        size_t end = err_output.find('\n', start);
+        if (end == string::npos) {
+            end = err_output.size();
+        }
+        string_view line(err_output.data() + start, end - start);
+        if (line.find(path) != string_view::npos) {
+            return string(line);
+        }
+        start = end + 1;
+    }
+    return fallback;
+}
+
+static string shellCommand(const BatchJob &job) {
+    switch (job.op) {
+        case BATCH_DELETE:
+            return "rm -fr --";
+        case BATCH_MOVE:
+            return "mv -n --";  // Never replaces what is already in the target, which then shows up as a failure.
+        case BATCH_CHMOD: {
+            char mode[16];
+            snprintf(mode, sizeof(mode), "%o", job.mode & 07777);
+            return string("chmod ") + mode + " --";
+        }
+        default:
+            return "";
+    }
+}
+
+// Moves the entries from begin to end over SFTP, with all of the renames sent at once rather than one round trip each.
+static void moveViaSftp(SftpConnection *conn, const BatchJob &job, size_t begin, size_t end, BatchResult *result) {
+    SftpAsync async(conn);
+    vector<future<void>> renames;
+    for (size_t i = begin ; i < end ; ++i) {
+        auto &name = job.names[i];
+        renames.push_back(async.Rename(normalize_path(job.dir + "/" + name), normalize_path(job.target + "/" + name)));
+    }
+    async.Run();
+
+    for (size_t i = begin ; i < end ; ++i) {
+        auto &name = job.names[i];
+        try {
+            renames[i - begin].get();
+            result->patch.removed.push_back(name);
+            result->succeeded++;
+        } catch (FailedPermission) {
+            result->failures.push_back(BatchFailure{name, "Permission denied"});
+        } catch (UploadFailed) {
+            result->failures.push_back(BatchFailure{name, "Failed"});
+        }
+    }
+}
+
+// Does the job for the names from begin to end over SFTP, one entry at a time.
+static void runViaSftp(SftpConnection *conn, const BatchJob &job, size_t begin, size_t end, BatchResult *result) {
+    if (job.op == BATCH_MOVE) {
+        moveViaSftp(conn, job, begin, end, result);
+        return;
+    }
+    for (size_t i = begin ; i < end ; ++i) {
+        auto &name = job.names[i];
+        auto path = normalize_path(job.dir + "/" + name);
+        try {
+            if (job.op == BATCH_DELETE) {
+                conn->Delete(path);
+                result->patch.removed.push_back(name);
+            } else if (job.op == BATCH_CHMOD) {
+                conn->Chmod(path, job.mode);
+                auto entry = conn->Lstat(path);
+                if (entry.has_value()) {
+                    entry->SetName(name);
+                    result->patch.updated.push_back(*entry);
+                }
+            }
+            result->succeeded++;
+        } catch (FailedPermission) {
+            result->failures.push_back(BatchFailure{name, "Permission denied"});
+        } catch (DeleteFailed e) {
+            result->failures.push_back(BatchFailure{name, e.err_});
+        } catch (UploadFailed) {
+            result->failures.push_back(BatchFailure{name, "Failed"});
+        } catch (FileNotFound) {
+            result->failures.push_back(BatchFailure{name, "Not found"});
+        }
+    }
+}
+
+// Does the job for the names from begin to end with a single command, and then finds out what it did from the entries
+// as they are afterwards, also if cancelled meanwhile. Returns false if the command is not available on the host.
+static bool runViaExec(
+        SftpConnection *conn,
+        const BatchJob &job,
+        size_t begin,
+        size_t end,
+        function<bool(void)> cancelled,
+        BatchResult *result) {
+    vector<string> paths;
+    string cmd = shellCommand(job);
+    for (size_t i = begin ; i < end ; ++i) {
+        paths.push_back(normalize_path(job.dir + "/" + job.names[i]));
+        cmd += " " + ShellQuote(paths.back());
+    }
+    if (job.op == BATCH_MOVE) {
+        cmd += " " + ShellQuote(job.target);
+    }
+
+    string err_output;
+    // Without the idle timeout, as rm or mv across file systems of a big tree can go quiet for a long time.
+    int status = conn->Exec(cmd, [](string_view) {}, &err_output, cancelled, true);
+    if (status == 126 || status == 127) {
+        return false;
+    }
+    for (auto &path : paths) {
+        conn->InvalidateStatCache(path);
+        if (job.op == BATCH_MOVE) {
+            conn->InvalidateStatCache(normalize_path(job.target + "/" + basename(path)));
+        }
+    }
+
+    vector<optional<DirEntry>> after;
+    try {
+        after = conn->LstatMany(paths);
+    } catch (FailedPermission) {
+        for (size_t i = begin ; i < end ; ++i) {
+            result->failures.push_back(BatchFailure{job.names[i], "Could not check the result. Permission denied"});
+        }
+        return true;
+    }
+
+    for (size_t i = 0 ; i < paths.size() ; ++i) {
+        auto &name = job.names[begin + i];
+        auto &entry = after[i];
+        bool ok;
+        string fallback;
+        if (job.op == BATCH_CHMOD) {
+            // The mode of a symlink itself is meaningless, and it is its target that was changed.
+            ok = entry.has_value()
+                 && (LIBSSH2_SFTP_S_ISLNK(entry->mode_) || (entry->mode_ & 07777) == (job.mode & 07777));
+            fallback = entry.has_value() ? "Permissions were not changed" : "Not found";
+            if (entry.has_value()) {
+                result->patch.updated.push_back(*entry);
+            }
+        } else {
+            ok = !entry.has_value();
+            fallback = job.op == BATCH_MOVE ? "Not moved. It may already exist in " + job.target : "Not deleted";
+            if (ok) {
+                result->patch.removed.push_back(name);
+            }
+        }
+
+        if (ok) {
+            result->succeeded++;
+        } else {
+            result->failures.push_back(BatchFailure{name, errorFor(err_output, paths[i], fallback)});
+        }
+    }
+    return true;
+}
+
+static bool runDownloads(
+        SftpConnection *conn,
+        const BatchJob &job,
+        function<bool(void)> cancelled,
+        function<void(const BatchProgress &)> progress,
+        BatchResult *result) {
+    vector<string> paths;
+    for (auto &name : job.names) {
+        paths.push_back(normalize_path(job.dir + "/" + name));
+    }
+    vector<optional<DirEntry>> entries(paths.size());
+    try {
+        entries = conn->LstatMany(paths);
+    } catch (FailedPermission) {
+        // Sizes are then unknown up front, and each download finds out for itself.
+        for (size_t i = 0 ; i < paths.size() ; ++i) {
+            entries[i] = DirEntry();
+        }
+    }
+
+    BatchProgress p{0, job.names.size(), 0, 0};
+    for (auto &entry : entries) {
+        if (entry.has_value() && !entry->is_dir_) {
+            p.bytes_total += entry->size_;
+        }
+    }
+
+    for (size_t i = 0 ; i < paths.size() ; ++i) {
+        auto &name = job.names[i];
+        progress(p);
+
+        if (!entries[i].has_value()) {
+            result->failures.push_back(BatchFailure{name, "Not found"});
+        } else if (entries[i]->is_dir_) {
+            result->failures.push_back(BatchFailure{name, "Directories can not be downloaded"});
+        } else {
+            uint64_t bytes_before = p.bytes_done;
+            try {
+                bool completed = conn->DownloadFile(
+                        paths[i],
+                        normalize_path(job.target + "/" + name),
+                        cancelled,
+                        [&](uint64_t bytes_done, uint64_t) {
+                            p.bytes_done = bytes_before + bytes_done;
+                            progress(p);
+                        });
+                if (!completed) {
+                    return false;
+                }
+                p.bytes_done = bytes_before + entries[i]->size_;
+                result->succeeded++;
+            } catch (DownloadFailedPermission) {
+                result->failures.push_back(BatchFailure{name, "Permission denied"});
+            } catch (DownloadFailed) {
+                result->failures.push_back(BatchFailure{name, "Download failed"});
+            }
+        }
+
+        p.items_done++;
+        if (cancelled()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RunBatchJob(
+        SftpConnection *conn,
+        const BatchJob &job,
+        function<bool(void)> cancelled,
+        function<void(const BatchProgress &)> progress,
+        BatchResult *result) {
+    if (job.op == BATCH_DOWNLOAD) {
+        return runDownloads(conn, job, cancelled, progress, result);
+    }
+
+    bool exec_supported = true;
+    for (size_t begin = 0 ; begin < job.names.size() ; begin += BATCH_EXEC_PATHS) {
+        size_t end = min(job.names.size(), begin + BATCH_EXEC_PATHS);
+        progress(BatchProgress{begin, job.names.size(), 0, 0});
+        if (exec_supported) {
+            exec_supported = runViaExec(conn, job, begin, end, cancelled, result);
+        }
+        if (!exec_supported) {
+            runViaSftp(conn, job, begin, end, result);
+        }
+        if (cancelled()) {
+            return false;
+        }
+    }
+    return true;
+}
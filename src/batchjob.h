@@ -0,0 +1,65 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_BATCHJOB_H_
+#define SRC_BATCHJOB_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "src/dirwatcher.h"
+#include "src/sftpconnection.h"
+
+using std::function;
+using std::string;
+using std::vector;
+
+#define BATCH_DELETE 1
+#define BATCH_DOWNLOAD 2
+#define BATCH_CHMOD 3
+#define BATCH_MOVE 4
+
+// One operation over several entries of the same remote directory.
+struct BatchJob {
+    int op;
+    string dir;
+    vector<string> names;
+    string target;  // Local directory to download into, or remote directory to move into.
+    uint32_t mode = 0;  // Permission bits to set, for BATCH_CHMOD.
+};
+
+struct BatchFailure {
+    string name;
+    string error;
+};
+
+struct BatchResult {
+    DirPatch patch;  // How the entries of the job's dir changed.
+    vector<BatchFailure> failures;
+    size_t succeeded = 0;
+};
+
+struct BatchProgress {
+    size_t items_done;
+    size_t items_total;
+    uint64_t bytes_done;  // Only counted for downloads.
+    uint64_t bytes_total;
+};
+
+// Runs job, carrying on past entries that fail. Deleting, moving and changing permissions are each done with a single
+// command over exec, followed by one batched stat to tell which entries it succeeded for, rather than with a round trip
+// per entry. Where that is not possible, entries are done one at a time over SFTP instead, other than moves, whose
+// renames are all sent at once. Downloads are done one file at a time, as libssh2 only has one SFTP request in flight
+// per session. Directories are not downloaded.
+//
+// Calls progress as often as for every chunk of a download, so it should be cheap.
+//
+// Returns false if cancelled, in which case result holds what was done until then.
+bool RunBatchJob(
+        SftpConnection *conn,
+        const BatchJob &job,
+        function<bool(void)> cancelled,
+        function<void(const BatchProgress &)> progress,
+        BatchResult *result);
+
+#endif  // SRC_BATCHJOB_H_
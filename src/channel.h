@@ -5,29 +5,52 @@
 
 #include <chrono>  // NOLINT
 #include <condition_variable>  // NOLINT
-#include <list>
 #include <mutex>  // NOLINT
 #include <optional>
+#include <utility>
+#include <vector>
 
 using std::chrono::milliseconds;
 using std::condition_variable;
-using std::list;
 using std::mutex;
 using std::nullopt;
 using std::optional;
 using std::unique_lock;
+using std::vector;
+
+#define CHANNEL_INITIAL_SLOTS 8
 
 // Inspired by https://st.xorian.net/blog/2012/08/go-style-channel-in-c/ .
+//
+// Items are kept in a ring buffer, which only allocates when it grows, and are moved rather than copied in and out.
+// Any number of threads can put and get concurrently. With a capacity, Put blocks while the channel is full, so a
+// producer can not run arbitrarily far ahead of its consumers.
 template<typename T>
 class Channel {
 private:
-    list<T> queue;
+    vector<optional<T>> slots_;
+    size_t head_ = 0;  // Index of the oldest item in slots_.
+    size_t size_ = 0;
+    size_t capacity_;  // 0 for unbounded.
     mutex m;
-    condition_variable cv;
+    condition_variable not_empty_;
+    condition_variable not_full_;
 
 public:
+    explicit Channel(size_t capacity = 0);
+
+    // Blocks while the channel is full.
     void Put(const T &i);
 
+    void Put(T &&i);
+
+    // Constructs the item in place. Blocks while the channel is full.
+    template<typename... Args>
+    void Emplace(Args &&... args);
+
+    // Does not block. Returns false if the channel is full.
+    bool TryPut(T &&i);
+
     // Blocks until available.
     T Get();
 
@@ -37,58 +60,126 @@ public:
     optional<T> TryGet();
 
     void Clear();
+
+private:
+    // Both of these expect the lock to be held.
+    void Push(unique_lock<mutex> *lock, optional<T> &&i);
+
+    T Pop(unique_lock<mutex> *lock);
 };
 
+template<typename T>
+Channel<T>::Channel(size_t capacity) : capacity_(capacity) {
+    this->slots_.resize(capacity > 0 ? capacity : CHANNEL_INITIAL_SLOTS);
+}
+
 template<typename T>
 void Channel<T>::Put(const T &i) {
+    this->Emplace(i);
+}
+
+template<typename T>
+void Channel<T>::Put(T &&i) {
+    this->Emplace(std::move(i));
+}
+
+template<typename T>
+template<typename... Args>
+void Channel<T>::Emplace(Args &&... args) {
     unique_lock<mutex> lock(m);
-    queue.push_back(i);
-    cv.notify_one();
+    if (this->capacity_ > 0) {
+        not_full_.wait(lock, [&]() {
+            return this->size_ < this->capacity_;
+        });
+    }
+    this->Push(&lock, optional<T>(std::in_place, std::forward<Args>(args)...));
+}
+
+template<typename T>
+bool Channel<T>::TryPut(T &&i) {
+    unique_lock<mutex> lock(m);
+    if (this->capacity_ > 0 && this->size_ >= this->capacity_) {
+        return false;
+    }
+    this->Push(&lock, optional<T>(std::move(i)));
+    return true;
 }
 
 // Blocks until available.
 template<typename T>
 T Channel<T>::Get() {
     unique_lock<mutex> lock(m);
-    cv.wait(lock, [&]() {
-        return !queue.empty();
+    not_empty_.wait(lock, [&]() {
+        return this->size_ > 0;
     });
-    T result = queue.front();
-    queue.pop_front();
-    return result;
+    return this->Pop(&lock);
 }
 
 // Blocks until available or timeout.
 template<typename T>
 optional<T> Channel<T>::Get(milliseconds timeout) {
     unique_lock<mutex> lock(m);
-    bool r = cv.wait_for(lock, timeout, [&]() {
-        return !queue.empty();
+    bool r = not_empty_.wait_for(lock, timeout, [&]() {
+        return this->size_ > 0;
     });
     if (!r) {
         // Timed out.
         return nullopt;
     }
-    T result = queue.front();
-    queue.pop_front();
-    return result;
+    return this->Pop(&lock);
 }
 
 // Does not block.
 template<typename T>
 optional<T> Channel<T>::TryGet() {
     unique_lock<mutex> lock(m);
-    if (queue.empty()) {
+    if (this->size_ == 0) {
         return nullopt;
     }
-    T result = queue.front();
-    queue.pop_front();
-    return result;
+    return this->Pop(&lock);
 }
 
 template<typename T>
 void Channel<T>::Clear() {
-    while (this->TryGet()) {}
+    unique_lock<mutex> lock(m);
+    for (auto &slot : this->slots_) {
+        slot.reset();
+    }
+    this->head_ = 0;
+    this->size_ = 0;
+    lock.unlock();
+    not_full_.notify_all();
+}
+
+template<typename T>
+void Channel<T>::Push(unique_lock<mutex> *lock, optional<T> &&i) {
+    if (this->size_ == this->slots_.size()) {
+        // Only when unbounded. Unwrap the ring into a buffer twice the size.
+        vector<optional<T>> grown(this->slots_.size() * 2);
+        for (size_t j = 0 ; j < this->size_ ; ++j) {
+            grown[j] = std::move(this->slots_[(this->head_ + j) % this->slots_.size()]);
+        }
+        this->slots_ = std::move(grown);
+        this->head_ = 0;
+    }
+    this->slots_[(this->head_ + this->size_) % this->slots_.size()] = std::move(i);
+    this->size_++;
+    lock->unlock();
+    not_empty_.notify_one();
+}
+
+template<typename T>
+T Channel<T>::Pop(unique_lock<mutex> *lock) {
+    auto &slot = this->slots_[this->head_];
+    T result = std::move(*slot);
+    slot.reset();
+    this->head_ = (this->head_ + 1) % this->slots_.size();
+    this->size_--;
+    lock->unlock();
+    if (this->capacity_ > 0) {
+        not_full_.notify_one();
+    }
+    return result;
 }
 
 #endif  // SRC_CHANNEL_H_
@@ -12,9 +12,12 @@
 #include "src/artprovider.h"
 #include "src/string.h"
 #include "src/hostdesc.h"
+#include "src/prewarm.h"
 
 using std::invalid_argument;
 
+#define PREWARM_TYPING_DELAY_MS 750  // Pause in typing before connecting to what was typed, to skip partial names.
+
 ConnectDialog::ConnectDialog(wxWindow *parent, wxConfigBase *config, string identity_file) : wxDialog(
         parent,
         wxID_ANY,
@@ -48,6 +51,12 @@ ConnectDialog::ConnectDialog(wxWindow *parent, wxConfigBase *config, string iden
 
     this->host_txt_ = new wxTextCtrl(this, wxID_ANY);
     sizer->Add(this->host_txt_, 0, wxEXPAND | wxALL, 5);
+    this->host_txt_->Bind(wxEVT_TEXT, [&](wxCommandEvent &evt) {
+        this->prewarm_timer_.StartOnce(PREWARM_TYPING_DELAY_MS);
+    });
+    this->prewarm_timer_.Bind(wxEVT_TIMER, [&](wxTimerEvent &event) {
+        this->Prewarm();
+    });
 
     auto favorite_label = new wxStaticText(this, wxID_ANY, "Favorite hosts:");
     sizer->Add(favorite_label, 0, wxALL, 5);
@@ -63,6 +72,9 @@ ConnectDialog::ConnectDialog(wxWindow *parent, wxConfigBase *config, string iden
     sizer->Add(this->favorites_, 1, wxEXPAND | wxALL, 5);
     this->favorites_->Bind(wxEVT_LISTBOX, [&](wxCommandEvent &evt) {
         this->host_txt_->SetValue(evt.GetString());
+        // A saved host was picked rather than typed, so no need to wait for more.
+        this->prewarm_timer_.Stop();
+        this->Prewarm();
     });
     this->favorites_->Bind(wxEVT_LISTBOX_DCLICK, [&](wxCommandEvent &evt) {
         this->host_txt_->SetValue(evt.GetString());
@@ -184,3 +196,21 @@ bool ConnectDialog::Connect() {
 
     return true;
 }
+
+void ConnectDialog::Prewarm() {
+    if (!this->config_->Read("/prewarm_connections", true)) {
+        return;
+    }
+
+    HostDesc host_desc;
+    try {
+        host_desc = HostDesc(this->host_txt_->GetValue().ToStdString(wxMBConvUTF8()), this->identity_file_);
+    } catch (invalid_argument) {
+        return;  // Not done typing, probably.
+    }
+    if (host_desc.host_.empty()) {
+        return;
+    }
+
+    PrewarmConnection(host_desc);
+}
@@ -15,6 +15,7 @@ class ConnectDialog : public wxDialog {
     wxTextCtrl *host_txt_;
     wxListBox *favorites_;
     wxButton *connect_btn_;
+    wxTimer prewarm_timer_;
 
 public:
     bool connect_ = false;
@@ -25,6 +26,9 @@ public:
 
 private:
     bool Connect();
+
+    // Starts connecting to the host entered, if it parses, so it is ready by the time the user connects to it.
+    void Prewarm();
 };
 
 #endif  // SRC_CONNECTDIALOG_H_
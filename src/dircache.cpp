@@ -0,0 +1,385 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/dircache.h"
+
+#include <wx/filefn.h>
+#include <wx/stdpaths.h>
+#include <wx/wx.h>
+
+#ifndef __WXMSW__
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifndef __WXOSX__
+
+#include <filesystem>
+
+#endif
+
+#include "src/direntry.h"
+#include "src/paths.h"
+#include "src/string.h"
+
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+#ifndef __WXOSX__
+using std::filesystem::create_directories;
+#else
+#include "src/filesystem.osx.polyfills.h"
+#endif
+
+#define DIR_CACHE_MAGIC "FRDC"
+#define DIR_CACHE_VERSION 1
+#define MAX_CACHED_DIRS 64
+#define MAX_CACHED_DIR_ENTRIES 200000  // Bigger listings are not worth the disk space and time to write.
+
+struct FileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dir_count;
+    uint32_t padding;
+};
+
+// Followed by the path, padded to 8 bytes, then entry_count EntryRecords, then strings_size bytes of strings.
+struct BlockHeader {
+    uint64_t saved_at;
+    uint32_t path_length;
+    uint32_t entry_count;
+    uint32_t strings_size;
+    uint32_t padding;
+};
+
+struct EntryRecord {
+    uint64_t size;
+    uint64_t modified;
+    uint32_t mode;
+    uint32_t name_offset;  // Offsets are into the strings of the block.
+    uint32_t owner_offset;
+    uint32_t group_offset;
+    uint16_t name_length;
+    uint8_t owner_length;
+    uint8_t group_length;
+    uint8_t is_dir;
+    uint8_t padding[3];
+};
+
+static_assert(sizeof(FileHeader) == 16, "FileHeader must have the same layout everywhere");
+static_assert(sizeof(BlockHeader) == 24, "BlockHeader must have the same layout everywhere");
+static_assert(sizeof(EntryRecord) == 40, "EntryRecord must have the same layout everywhere");
+
+static size_t padded(size_t n) {
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+static FILE *openFile(string path, bool write) {
+#ifdef __WXMSW__
+    return _wfopen(localPathUnicode(path).c_str(), write ? L"wb" : L"rb");
+#else
+    if (!write) {
+        return fopen(path.c_str(), "rb");
+    }
+    // Readable by the user only, as listings can be sensitive.
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return NULL;
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR);  // In case it was left behind by an earlier crash, with other permissions.
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+    }
+    return f;
+#endif
+}
+
+static string encodeBlock(const string &path, const vector<DirEntry> &entries, uint64_t saved_at) {
+    string strings;
+    unordered_map<const string *, uint32_t> interned_offsets;  // Owner and group names repeat, so store them once.
+    auto add_interned = [&](const string *s) -> uint32_t {
+        if (!s) {
+            return 0;
+        }
+        auto it = interned_offsets.find(s);
+        if (it != interned_offsets.end()) {
+            return it->second;
+        }
+        auto offset = static_cast<uint32_t>(strings.size());
+        strings.append(*s, 0, UINT8_MAX);
+        interned_offsets[s] = offset;
+        return offset;
+    };
+
+    vector<EntryRecord> records(entries.size());
+    for (size_t i = 0 ; i < entries.size() ; ++i) {
+        auto &e = entries[i];
+        auto &r = records[i];
+        memset(&r, 0, sizeof(r));
+        r.size = e.size_;
+        r.modified = e.modified_;
+        r.mode = e.mode_;
+        r.is_dir = e.is_dir_;
+        r.name_offset = static_cast<uint32_t>(strings.size());
+        r.name_length = static_cast<uint16_t>(std::min(e.name_.size(), static_cast<size_t>(UINT16_MAX)));
+        strings.append(e.name_, 0, r.name_length);
+        r.owner_offset = add_interned(e.owner_);
+        r.owner_length = static_cast<uint8_t>(e.Owner().size() < UINT8_MAX ? e.Owner().size() : UINT8_MAX);
+        r.group_offset = add_interned(e.group_);
+        r.group_length = static_cast<uint8_t>(e.Group().size() < UINT8_MAX ? e.Group().size() : UINT8_MAX);
+    }
+
+    BlockHeader header;
+    memset(&header, 0, sizeof(header));
+    header.saved_at = saved_at;
+    header.path_length = static_cast<uint32_t>(path.size());
+    header.entry_count = static_cast<uint32_t>(entries.size());
+    header.strings_size = static_cast<uint32_t>(strings.size());
+
+    size_t records_start = sizeof(header) + padded(path.size());
+    string block(records_start + records.size() * sizeof(EntryRecord) + padded(strings.size()), '\0');
+    memcpy(&block[0], &header, sizeof(header));
+    memcpy(&block[sizeof(header)], path.data(), path.size());
+    if (!records.empty()) {
+        memcpy(&block[records_start], records.data(), records.size() * sizeof(EntryRecord));
+    }
+    memcpy(&block[records_start + records.size() * sizeof(EntryRecord)], strings.data(), strings.size());
+    return block;
+}
+
+// Checks that a block is consistent with its own header, so decoding it can not read out of bounds.
+static bool validBlock(const string &block) {
+    if (block.size() < sizeof(BlockHeader)) {
+        return false;
+    }
+    BlockHeader header;
+    memcpy(&header, block.data(), sizeof(header));
+    size_t records_start = sizeof(header) + padded(header.path_length);
+    uint64_t needed = records_start + static_cast<uint64_t>(header.entry_count) * sizeof(EntryRecord);
+    needed += header.strings_size;
+    if (needed > block.size()) {
+        return false;
+    }
+
+    auto records = reinterpret_cast<const EntryRecord *>(block.data() + records_start);
+    for (uint32_t i = 0 ; i < header.entry_count ; ++i) {
+        EntryRecord r;
+        memcpy(&r, &records[i], sizeof(r));
+        if (static_cast<uint64_t>(r.name_offset) + r.name_length > header.strings_size
+            || static_cast<uint64_t>(r.owner_offset) + r.owner_length > header.strings_size
+            || static_cast<uint64_t>(r.group_offset) + r.group_length > header.strings_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static string blockPath(const string &block) {
+    BlockHeader header;
+    memcpy(&header, block.data(), sizeof(header));
+    return block.substr(sizeof(header), header.path_length);
+}
+
+DirCache::DirCache(string file_path) : file_path_(file_path) {}
+
+string DirCache::PathForHost(string host) {
+    auto dir = wxStandardPaths::Get().GetUserDir(wxStandardPaths::Dir_Cache).ToStdString(wxMBConvUTF8());
+    return normalize_path(dir + "/filesremote/" + sha256(host) + ".dircache");
+}
+
+bool DirCache::Read(const string &file_path, vector<Dir> *dirs) {
+    FILE *f = openFile(file_path, false);
+    if (!f) {
+        return false;
+    }
+
+    FileHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+              && memcmp(header.magic, DIR_CACHE_MAGIC, 4) == 0
+              && header.version == DIR_CACHE_VERSION;
+    for (uint32_t i = 0 ; ok && i < header.dir_count ; ++i) {
+        uint64_t block_size;
+        if (fread(&block_size, sizeof(block_size), 1, f) != 1 || block_size > UINT32_MAX) {
+            ok = false;
+            break;
+        }
+        string block(block_size, '\0');
+        if (block_size > 0 && fread(&block[0], block_size, 1, f) != 1) {
+            ok = false;
+            break;
+        }
+        if (!validBlock(block)) {
+            ok = false;
+            break;
+        }
+        BlockHeader block_header;
+        memcpy(&block_header, block.data(), sizeof(block_header));
+        dirs->push_back(Dir{blockPath(block), block_header.saved_at, std::move(block), {}});
+    }
+    fclose(f);
+    return ok;
+}
+
+void DirCache::Load() {
+    this->dirs_.clear();
+    this->dropped_.clear();
+    if (!Read(this->file_path_, &this->dirs_)) {
+        this->dirs_.clear();  // Rather start over than show partial or garbled listings.
+    }
+}
+
+void DirCache::Save() {
+    auto dir_path = this->file_path_.substr(0, this->file_path_.rfind('/'));
+    try {
+        create_directories(localPathUnicode(dir_path));
+    } catch (...) {
+        return;
+    }
+#ifndef __WXMSW__
+    chmod(dir_path.c_str(), S_IRWXU);  // Also if created before, by older versions, as listings can be sensitive.
+#endif
+
+    // Other windows on the host may have saved since this one loaded, so merge with theirs, with the most recently
+    // retrieved listing of each directory winning. Ties go to this window, which comes last and sorts stably.
+    vector<Dir> all;
+    if (!Read(this->file_path_, &all)) {
+        all.clear();
+    }
+    for (auto &dir : this->dirs_) {
+        if (dir.block.empty()) {
+            dir.block = encodeBlock(dir.path, dir.entries, dir.saved_at);
+            dir.entries = vector<DirEntry>();
+        }
+        all.push_back(std::move(dir));
+    }
+    std::stable_sort(all.begin(), all.end(), [](const Dir &a, const Dir &b) {
+        return a.saved_at < b.saved_at;
+    });
+    this->dirs_.clear();
+    unordered_set<string> seen;
+    for (auto it = all.rbegin() ; it != all.rend() && this->dirs_.size() < MAX_CACHED_DIRS ; ++it) {
+        auto dropped = this->dropped_.find(it->path);
+        if (dropped != this->dropped_.end() && it->saved_at <= dropped->second) {
+            continue;
+        }
+        if (seen.insert(it->path).second) {
+            this->dirs_.push_back(std::move(*it));
+        }
+    }
+    std::reverse(this->dirs_.begin(), this->dirs_.end());
+
+    // Write to a temporary file and move it in place, so a crash while writing does not leave a broken cache behind.
+    string tmp_path = this->file_path_ + ".tmp";
+    FILE *f = openFile(tmp_path, true);
+    if (!f) {
+        return;
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DIR_CACHE_MAGIC, 4);
+    header.version = DIR_CACHE_VERSION;
+    header.dir_count = static_cast<uint32_t>(this->dirs_.size());
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (auto &dir : this->dirs_) {
+        uint64_t block_size = dir.block.size();
+        ok = ok && fwrite(&block_size, sizeof(block_size), 1, f) == 1;
+        ok = ok && fwrite(dir.block.data(), block_size, 1, f) == 1;
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if (ok) {
+        wxRenameFile(wxString::FromUTF8(tmp_path), wxString::FromUTF8(this->file_path_), true);
+    } else {
+        wxRemoveFile(wxString::FromUTF8(tmp_path));
+    }
+}
+
+// Only keeps the listing as is, as this is called on the UI thread for every listing retrieved, and encoding a big
+// one takes a while. It is encoded when saved instead.
+void DirCache::Put(const string &path, vector<DirEntry> entries) {
+    for (auto it = this->dirs_.begin() ; it != this->dirs_.end() ; ++it) {
+        if (it->path == path) {
+            this->dirs_.erase(it);
+            break;
+        }
+    }
+
+    uint64_t now = time(NULL);
+    if (entries.size() > MAX_CACHED_DIR_ENTRIES) {
+        this->dropped_[path] = now;
+        return;
+    }
+
+    this->dirs_.push_back(Dir{path, now, string(), std::move(entries)});
+    if (this->dirs_.size() > MAX_CACHED_DIRS) {
+        this->dirs_.erase(this->dirs_.begin());
+    }
+}
+
+optional<CachedDir> DirCache::Get(const string &path) const {
+    for (auto &dir : this->dirs_) {
+        if (dir.path != path) {
+            continue;
+        }
+        if (dir.block.empty()) {
+            return CachedDir{dir.saved_at, dir.entries};
+        }
+
+        auto &block = dir.block;
+        BlockHeader header;
+        memcpy(&header, block.data(), sizeof(header));
+        size_t records_start = sizeof(header) + padded(header.path_length);
+        const char *strings = block.data() + records_start + header.entry_count * sizeof(EntryRecord);
+
+        CachedDir cached;
+        cached.saved_at = header.saved_at;
+        cached.entries.resize(header.entry_count);
+        for (uint32_t i = 0 ; i < header.entry_count ; ++i) {
+            EntryRecord r;
+            memcpy(&r, block.data() + records_start + i * sizeof(EntryRecord), sizeof(r));
+            auto &e = cached.entries[i];
+            e.SetName(string_view(strings + r.name_offset, r.name_length));
+            e.size_ = r.size;
+            e.modified_ = r.modified;
+            e.mode_ = r.mode;
+            e.is_dir_ = r.is_dir;
+            auto prev = i > 0 ? &cached.entries[i - 1] : nullptr;
+            if (r.owner_length > 0) {
+                string_view owner(strings + r.owner_offset, r.owner_length);
+                e.owner_ = InternString(owner, prev ? prev->owner_ : nullptr);
+            }
+            if (r.group_length > 0) {
+                string_view group(strings + r.group_offset, r.group_length);
+                e.group_ = InternString(group, prev ? prev->group_ : nullptr);
+            }
+        }
+        return cached;
+    }
+    return nullopt;
+}
+
+optional<string> DirCache::LastDir() const {
+    if (this->dirs_.empty()) {
+        return nullopt;
+    }
+    return this->dirs_.back().path;
+}
@@ -0,0 +1,68 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_DIRCACHE_H_
+#define SRC_DIRCACHE_H_
+
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/direntry.h"
+
+using std::map;
+using std::optional;
+using std::string;
+using std::vector;
+
+struct CachedDir {
+    uint64_t saved_at;  // Unix time of when the listing was retrieved from the host.
+    vector<DirEntry> entries;
+};
+
+// Recently retrieved directory listings of one host, persisted to disk so they can be shown right away on the next
+// start, while connecting, and browsed while the host is unreachable.
+//
+// The file is a header followed by one block per directory. Each block holds fixed size, 8 byte aligned entry records
+// followed by a table of the strings they point into by offset, so it can be read in place, for example when memory
+// mapped, rather than parsed. Listings read from the file are kept in memory in this encoded form too, and only decoded
+// when requested, while listings put in the cache are only encoded when saved.
+//
+// Several windows on the same host share the file, so saving merges with what the others saved meanwhile, keeping the
+// most recently retrieved listing of each directory.
+class DirCache {
+    struct Dir {
+        string path;
+        uint64_t saved_at;  // Unix time of when the listing was retrieved from the host.
+        string block;  // Encoded listing, if read from the file or saved. Otherwise empty, and entries holds it.
+        vector<DirEntry> entries;
+    };
+
+    string file_path_;
+    vector<Dir> dirs_;  // Least recently retrieved first.
+    map<string, uint64_t> dropped_;  // When listings got too big to cache, so saving does not bring back older ones.
+
+public:
+    explicit DirCache(string file_path);
+
+    // Returns the path of the cache file for the given host, in the user's cache dir.
+    static string PathForHost(string host);
+
+    // Reads the cache file. A missing, truncated or otherwise unreadable file just leaves the cache empty.
+    void Load();
+
+    // Writes the cache file, readable only by the user, as a best effort.
+    void Save();
+
+    void Put(const string &path, vector<DirEntry> entries);
+
+    optional<CachedDir> Get(const string &path) const;
+
+    // The directory that was retrieved most recently, which is what the user was last looking at.
+    optional<string> LastDir() const;
+
+private:
+    static bool Read(const string &file_path, vector<Dir> *dirs);
+};
+
+#endif  // SRC_DIRCACHE_H_
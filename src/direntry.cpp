@@ -6,12 +6,44 @@
 
 #include <libssh2_sftp.h>
 
+#include <functional>
+#include <mutex>  // NOLINT
+#include <set>
 #include <string>
+#include <string_view>
 
+#include "src/paths.h"
 #include "src/storageunits.h"
 
+using std::less;
+using std::lock_guard;
+using std::mutex;
+using std::set;
+using std::string_view;
 using std::to_string;
 
+static const string empty_string = "";
+
+const string *InternString(string_view s) {
+    // Nodes of a std::set never move, so pointers to the elements stay valid as the set grows.
+    static mutex m;
+    static set<string, less<>> pool;
+
+    lock_guard<mutex> lock(m);
+    auto it = pool.find(s);
+    if (it == pool.end()) {
+        it = pool.emplace(s).first;
+    }
+    return &*it;
+}
+
+const string *InternString(string_view s, const string *prev) {
+    if (prev && *prev == s) {
+        return prev;
+    }
+    return InternString(s);
+}
+
 DirEntry::DirEntry(LIBSSH2_SFTP_ATTRIBUTES attrs) {
     if (attrs.flags & LIBSSH2_SFTP_ATTR_SIZE) {
         this->size_ = attrs.filesize;
@@ -25,8 +57,44 @@ DirEntry::DirEntry(LIBSSH2_SFTP_ATTRIBUTES attrs) {
     }
 }
 
-string DirEntry::SizeFormatted(bool as_bytes) {
-    if (this->is_dir_) {
+void DirEntry::SetName(string_view name) {
+    this->name_.assign(name.data(), name.size());
+    this->kind_ = file_kind(name);
+}
+
+// Done in a single pass over the line, without building temporary strings for the fields.
+void DirEntry::ParseLongEntry(string_view line, const DirEntry *prev) {
+    int field_num = 0;
+    size_t i = 0;
+    while (i < line.size() && field_num < 4) {
+        if (line[i] == ' ') {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < line.size() && line[i] != ' ') {
+            i++;
+        }
+        auto field = line.substr(start, i - start);
+
+        if (field_num == 0) {
+            if (field.length() != 10) {
+                // Free text line was in an unexpected format.
+                return;
+            }
+        } else if (field_num == 2) {
+            this->owner_ = InternString(field, prev ? prev->owner_ : nullptr);
+        } else if (field_num == 3) {
+            this->group_ = InternString(field, prev ? prev->group_ : nullptr);
+        }
+
+        field_num++;
+    }
+}
+
+string DirEntry::SizeFormatted(bool as_bytes) const {
+    if (this->is_dir_ && !this->size_computed_) {
         return "";
     }
 
@@ -36,7 +104,7 @@ string DirEntry::SizeFormatted(bool as_bytes) {
     return size_string(this->size_);
 }
 
-string DirEntry::ModifiedFormatted() {
+string DirEntry::ModifiedFormatted() const {
     if (this->modified_ < 5) {
         return "";
     }
@@ -44,3 +112,54 @@ string DirEntry::ModifiedFormatted() {
     t.MakeUTC();
     return t.FormatISOCombined(' ').ToStdString(wxMBConvUTF8());
 }
+
+string DirEntry::ModeFormatted() const {
+    if (this->mode_ == 0) {
+        return "";
+    }
+
+    string s = "----------";
+    switch (this->mode_ & LIBSSH2_SFTP_S_IFMT) {
+        case LIBSSH2_SFTP_S_IFDIR: s[0] = 'd'; break;
+        case LIBSSH2_SFTP_S_IFLNK: s[0] = 'l'; break;
+        case LIBSSH2_SFTP_S_IFCHR: s[0] = 'c'; break;
+        case LIBSSH2_SFTP_S_IFBLK: s[0] = 'b'; break;
+        case LIBSSH2_SFTP_S_IFIFO: s[0] = 'p'; break;
+        case LIBSSH2_SFTP_S_IFSOCK: s[0] = 's'; break;
+    }
+
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0 ; i < 9 ; ++i) {
+        if (this->mode_ & (1 << (8 - i))) {
+            s[i + 1] = rwx[i];
+        }
+    }
+
+    // Set-user-ID, set-group-ID and sticky bits are shown in place of the execute bits.
+    if (this->mode_ & 04000) {
+        s[3] = s[3] == 'x' ? 's' : 'S';
+    }
+    if (this->mode_ & 02000) {
+        s[6] = s[6] == 'x' ? 's' : 'S';
+    }
+    if (this->mode_ & 01000) {
+        s[9] = s[9] == 'x' ? 't' : 'T';
+    }
+
+    return s;
+}
+
+const string &DirEntry::Owner() const {
+    return this->owner_ ? *this->owner_ : empty_string;
+}
+
+const string &DirEntry::Group() const {
+    return this->group_ ? *this->group_ : empty_string;
+}
+
+string DirEntry::DisplayName() const {
+    if (this->link_target_.empty()) {
+        return this->name_;
+    }
+    return this->name_ + " -> " + this->link_target_;
+}
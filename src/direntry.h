@@ -6,27 +6,57 @@
 #include <libssh2_sftp.h>
 
 #include <string>
+#include <string_view>
+
+#include "src/paths.h"
 
 using std::string;
+using std::string_view;
+
+// Returns a pointer to a process wide copy of s, which stays valid for the lifetime of the process. Used for values
+// that repeat across many entries, such as owner and group names, so each entry only needs to carry a pointer.
+const string *InternString(string_view s);
+
+// Like InternString, but returns prev if it is already s. Values such as owner names repeat across most entries of a
+// listing, so checking against the previous entry first mostly saves going to the shared pool.
+const string *InternString(string_view s, const string *prev);
 
 class DirEntry {
 public:
     string name_;
     uint64_t size_ = 0;
     uint64_t modified_ = 0;
-    uint64_t mode_;
-    string mode_str_;
-    string owner_;
-    string group_;
-    bool is_dir_;
+    const string *owner_ = nullptr;  // Interned. See InternString.
+    const string *group_ = nullptr;  // Interned. See InternString.
+    uint32_t mode_ = 0;
+    bool is_dir_ = false;  // For symlinks, whether they point to a directory, once resolved.
+    bool size_computed_ = false;  // For directories, whether size_ is the total size of everything under it.
+    string link_target_;  // What a symlink points to, as stored in the link. Empty if unknown.
+    FileKind kind_ = FILE_KIND_OTHER;  // Classified from the name once, by SetName.
 
     DirEntry() {}
 
     explicit DirEntry(LIBSSH2_SFTP_ATTRIBUTES attrs);
 
-    string SizeFormatted(bool as_bytes);
+    void SetName(string_view name);
+
+    // Sets owner and group from the free text long name SFTP gives along with each entry of a listing, which looks
+    // like "-rw-r--r--    1 user1    group1        12 Jan  1 00:00 file.txt". prev is the entry listed before, if any.
+    void ParseLongEntry(string_view line, const DirEntry *prev);
+
+    string SizeFormatted(bool as_bytes) const;
+
+    string ModifiedFormatted() const;
+
+    // Mode in the same format as ls -l, for example "drwxr-xr-x". Derived from mode_ rather than stored.
+    string ModeFormatted() const;
+
+    const string &Owner() const;
+
+    const string &Group() const;
 
-    string ModifiedFormatted();
+    // Name as shown in listings, with the target of symlinks appended like ls -l does.
+    string DisplayName() const;
 };
 
 #endif  // SRC_DIRENTRY_H_
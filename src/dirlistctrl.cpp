@@ -12,14 +12,15 @@
 #include <wx/listctrl.h>
 #include <wx/wx.h>
 
+#include <algorithm>
 #include <future>  // NOLINT
-#include <regex>  // NOLINT
 #include <vector>
 
 #include "src/direntry.h"
+#include "src/paths.h"
 
 using std::function;
-using std::regex;
+using std::sort;
 using std::vector;
 
 
@@ -27,7 +28,7 @@ typedef function<void(void)> OnItemActivatedCb;
 typedef function<void(int)> OnColumnHeaderClickCb;
 
 
-int DirListCtrl::IconIdx(DirEntry entry) {
+int DirListCtrl::IconIdx(const DirEntry &entry) const {
     // These numbers correspond to the order the icons in icons_image_list_ were added...
     int r = 0;
     if (entry.is_dir_) {
@@ -37,131 +38,186 @@ int DirListCtrl::IconIdx(DirEntry entry) {
     } else if (entry.mode_ & LIBSSH2_SFTP_S_IXUSR || entry.mode_ & LIBSSH2_SFTP_S_IXGRP
                || entry.mode_ & LIBSSH2_SFTP_S_IXOTH) {
         r = 2;
-    } else if (regex_search(entry.name_, regex(
-            "(\\.jpeg|\\.jpg|\\.png|\\.gif|\\.webp|\\.bmp|\\.psd|\\.ai|\\.svg|\\.psd|\\.eps|\\.tif|\\.tiff)$"))) {
+    } else if (entry.kind_ == FILE_KIND_IMAGE || entry.kind_ == FILE_KIND_PICTURE) {
         r = 4;
-    } else if (regex_search(entry.name_, regex("(\\.tar|\\.tgz|\\.gz|\\.bz2|\\.7z|\\.xz|\\.zip)$"))) {
+    } else if (entry.kind_ == FILE_KIND_ARCHIVE) {
         r = 5;
     }
     return r;
 }
 
-DvlcDirList::DvlcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list) : DirListCtrl(
-        icons_image_list) {
-    this->dvlc_ = new wxDataViewListCtrl(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize,
-                                         wxDV_ROW_LINES);
-    this->config_ = config;
+const DirEntry *DirListCtrl::EntryAtRow(size_t row) const {
+    if (!this->rows_ || row >= this->rows_->size()) {
+        return nullptr;
+    }
+    size_t i = (*this->rows_)[row];
+    if (i >= this->entries_->size()) {
+        return nullptr;
+    }
+    return &(*this->entries_)[i];
+}
 
-    // TODO(allan): wxDATAVIEW_CELL_EDITABLE for renaming files?
-    auto col = this->dvlc_->AppendIconTextColumn("  Name", wxDATAVIEW_CELL_INERT);
-    col->SetWidth(300);
+wxString DirListCtrl::ColumnText(const DirEntry &entry, int col) const {
+    switch (col) {
+        case 0: return wxString::FromUTF8(entry.DisplayName());
+        case 1: return entry.SizeFormatted(this->as_bytes_);
+        case 2: return entry.ModifiedFormatted();
+        case 3: return entry.ModeFormatted();
+        case 4: return entry.Owner();
+        case 5: return entry.Group();
+    }
+    return wxEmptyString;
+}
 
-    col = this->dvlc_->AppendTextColumn(" Size", wxDATAVIEW_CELL_INERT);
-    col->SetWidth(100);
+// Rows of a DvlcDirList, looked up as they are drawn.
+class DirListModel : public wxDataViewVirtualListModel {
+    DvlcDirList *list_;
+
+public:
+    explicit DirListModel(DvlcDirList *list) : wxDataViewVirtualListModel(0), list_(list) {}
+
+    unsigned int GetColumnCount() const override {
+        return 6;
+    }
 
-    col = this->dvlc_->AppendTextColumn(" Modified", wxDATAVIEW_CELL_INERT);
-    col->SetWidth(150);
+    wxString GetColumnType(unsigned int col) const override {
+        return col == 0 ? "wxDataViewIconText" : "string";
+    }
 
-    col = this->dvlc_->AppendTextColumn(" Mode", wxDATAVIEW_CELL_INERT);
-    col->SetWidth(100);
+    void GetValueByRow(wxVariant &variant, unsigned int row, unsigned int col) const override {
+        auto entry = this->list_->EntryAtRow(row);
+        if (!entry) {
+            variant = col == 0 ? wxVariant(wxDataViewIconText()) : wxVariant(wxEmptyString);
+            return;
+        }
+        if (col == 0) {
+            wxIcon icon = this->list_->icons_image_list_->GetIcon(this->list_->IconIdx(*entry));
+            variant << wxDataViewIconText(this->list_->ColumnText(*entry, 0), icon);
+            return;
+        }
+        variant = this->list_->ColumnText(*entry, col);
+    }
 
-    col = this->dvlc_->AppendTextColumn(" Owner", wxDATAVIEW_CELL_INERT, 100);
-    col->SetWidth(100);
+    bool SetValueByRow(const wxVariant &variant, unsigned int row, unsigned int col) override {
+        return false;  // Not editable.
+    }
+};
 
-    col = this->dvlc_->AppendTextColumn(" Group", wxDATAVIEW_CELL_INERT, 100);
-    col->SetWidth(100);
+DvlcDirList::DvlcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list) : DirListCtrl(
+        icons_image_list) {
+    this->dvc_ = new wxDataViewCtrl(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize,
+                                    wxDV_ROW_LINES | wxDV_MULTIPLE);
+    this->config_ = config;
+    this->model_ = new DirListModel(this);
+    this->dvc_->AssociateModel(this->model_.get());
 
-    this->dvlc_->Bind(wxEVT_DATAVIEW_ITEM_ACTIVATED, [&](wxDataViewEvent &evt) {
+    // TODO(allan): wxDATAVIEW_CELL_EDITABLE for renaming files?
+    this->dvc_->AppendIconTextColumn("  Name", 0, wxDATAVIEW_CELL_INERT, 300);
+    this->dvc_->AppendTextColumn(" Size", 1, wxDATAVIEW_CELL_INERT, 100);
+    this->dvc_->AppendTextColumn(" Modified", 2, wxDATAVIEW_CELL_INERT, 150);
+    this->dvc_->AppendTextColumn(" Mode", 3, wxDATAVIEW_CELL_INERT, 100);
+    this->dvc_->AppendTextColumn(" Owner", 4, wxDATAVIEW_CELL_INERT, 100);
+    this->dvc_->AppendTextColumn(" Group", 5, wxDATAVIEW_CELL_INERT, 100);
+
+    this->dvc_->Bind(wxEVT_DATAVIEW_ITEM_ACTIVATED, [&](wxDataViewEvent &evt) {
         if (!evt.GetItem()) {
             return;
         }
         this->on_item_activated_cb_();
     });
 
-    this->dvlc_->Bind(wxEVT_DATAVIEW_COLUMN_HEADER_CLICK, [&](wxDataViewEvent &evt) {
+    this->dvc_->Bind(wxEVT_DATAVIEW_COLUMN_HEADER_CLICK, [&](wxDataViewEvent &evt) {
         this->on_column_header_click_cb_(evt.GetColumn());
     });
 }
 
-void DvlcDirList::Refresh(vector<DirEntry> entries) {
-    bool as_bytes = false;
-    if (this->config_->Read("/size_units", "1") == "2") {
-        as_bytes = true;
-    }
-
-    this->dvlc_->DeleteAllItems();
-
-    for (int i = 0; i < entries.size(); i++) {
-        wxIcon icon = this->icons_image_list_->GetIcon(this->IconIdx(entries[i]));
-
-        wxVector<wxVariant> data;
-        data.push_back(wxVariant(wxDataViewIconText(wxString::FromUTF8(entries[i].name_), icon)));
-        data.push_back(wxVariant(entries[i].SizeFormatted(as_bytes)));
-        data.push_back(wxVariant(entries[i].ModifiedFormatted()));
-        data.push_back(wxVariant(entries[i].mode_str_));
-        data.push_back(wxVariant(entries[i].owner_));
-        data.push_back(wxVariant(entries[i].group_));
-        this->dvlc_->AppendItem(data, i);
-    }
+void DvlcDirList::Refresh(const vector<DirEntry> &entries, const vector<int> &rows) {
+    this->as_bytes_ = this->config_->Read("/size_units", "1") == "2";
+    this->entries_ = &entries;
+    this->rows_ = &rows;
+    this->model_->Reset(rows.size());  // Also clears the selection, like deleting all the rows did.
 }
 
 wxControl *DvlcDirList::GetCtrl() {
-    return this->dvlc_;
+    return this->dvc_;
 }
 
 void DvlcDirList::SetFocus() {
-    this->dvlc_->SetFocus();
+    this->dvc_->SetFocus();
 }
 
 void DvlcDirList::ActivateCurrent() {
-    if (this->dvlc_->GetCurrentItem()) {
+    if (this->dvc_->GetCurrentItem()) {
         this->on_item_activated_cb_();
     }
 }
 
 vector<int> DvlcDirList::GetSelected() {
+    wxDataViewItemArray a;
+    this->dvc_->GetSelections(a);
     vector<int> r;
-    for (int i = 0; i < this->dvlc_->GetItemCount(); ++i) {
-        if (this->dvlc_->IsRowSelected(i)) {
-            r.push_back(i);
-        }
+    for (auto &item : a) {
+        r.push_back(this->model_->GetRow(item));
     }
+    sort(r.begin(), r.end());  // In the order shown, like the other implementation.
     return r;
 }
 
 void DvlcDirList::SetSelected(vector<int> selected) {
     wxDataViewItemArray a;
     for (int i = 0; i < selected.size(); ++i) {
-        a.push_back(this->dvlc_->RowToItem(selected[i]));
+        if (selected[i] >= 0 && static_cast<unsigned int>(selected[i]) < this->model_->GetCount()) {
+            a.push_back(this->model_->GetItem(selected[i]));
+        }
     }
-    this->dvlc_->SetSelections(a);
+    this->dvc_->SetSelections(a);
 }
 
 int DvlcDirList::GetHighlighted() {
-    int i = this->dvlc_->ItemToRow(this->dvlc_->GetCurrentItem());
-    if (i < 0) {
+    auto item = this->dvc_->GetCurrentItem();
+    if (!item.IsOk()) {
         return 0;
     }
-    return i;
+    return this->model_->GetRow(item);
 }
 
 void DvlcDirList::SetHighlighted(int row) {
-    auto item = this->dvlc_->RowToItem(row);
-    if (item.IsOk()) {
-        this->dvlc_->SetCurrentItem(item);
-        this->dvlc_->EnsureVisible(item);
+    if (row < 0 || static_cast<unsigned int>(row) >= this->model_->GetCount()) {
+        return;
     }
+    auto item = this->model_->GetItem(row);
+    this->dvc_->SetCurrentItem(item);
+    this->dvc_->EnsureVisible(item);
 }
 
+// Rows of a LcDirList, looked up as they are drawn.
+class VirtualListCtrl : public wxListCtrl {
+    LcDirList *list_;
 
-LcDirList::LcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list) : DirListCtrl(
-        icons_image_list) {
-    this->list_ctrl_ = new wxListCtrl(
+public:
+    VirtualListCtrl(wxWindow *parent, LcDirList *list) : wxListCtrl(
             parent,
             wxID_ANY,
             wxDefaultPosition,
             wxDefaultSize,
-            wxLC_REPORT | wxLC_SINGLE_SEL);
+            wxLC_REPORT | wxLC_VIRTUAL), list_(list) {
+    }
+
+    wxString OnGetItemText(long item, long col) const override {  // NOLINT: wxWidgets legacy
+        auto entry = this->list_->EntryAtRow(item);
+        return entry ? this->list_->ColumnText(*entry, col) : wxString();
+    }
+
+    int OnGetItemImage(long item) const override {  // NOLINT: wxWidgets legacy
+        auto entry = this->list_->EntryAtRow(item);
+        return entry ? this->list_->IconIdx(*entry) : -1;
+    }
+};
+
+
+LcDirList::LcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list) : DirListCtrl(
+        icons_image_list) {
+    this->list_ctrl_ = new VirtualListCtrl(parent, this);
     this->config_ = config;
 
     this->list_ctrl_->AssignImageList(this->icons_image_list_, wxIMAGE_LIST_SMALL);
@@ -186,24 +242,15 @@ wxControl *LcDirList::GetCtrl() {
     return this->list_ctrl_;
 }
 
-void LcDirList::Refresh(vector<DirEntry> entries) {
-    bool as_bytes = false;
-    if (this->config_->Read("/size_units", "1") == "2") {
-        as_bytes = true;
-    }
+void LcDirList::Refresh(const vector<DirEntry> &entries, const vector<int> &rows) {
+    this->as_bytes_ = this->config_->Read("/size_units", "1") == "2";
+    this->entries_ = &entries;
+    this->rows_ = &rows;
 
-    this->list_ctrl_->DeleteAllItems();
-
-    for (int i = 0; i < entries.size(); i++) {
-        this->list_ctrl_->InsertItem(i, entries[i].name_, this->IconIdx(entries[i]));
-        this->list_ctrl_->SetItemData(i, i);
-        this->list_ctrl_->SetItem(i, 0, wxString::FromUTF8(entries[i].name_));
-        this->list_ctrl_->SetItem(i, 1, entries[i].SizeFormatted(as_bytes));
-        this->list_ctrl_->SetItem(i, 2, entries[i].ModifiedFormatted());
-        this->list_ctrl_->SetItem(i, 3, entries[i].mode_str_);
-        this->list_ctrl_->SetItem(i, 4, entries[i].owner_);
-        this->list_ctrl_->SetItem(i, 5, entries[i].group_);
-    }
+    // Selections are kept by row in virtual lists, so cleared like deleting all the rows did.
+    this->list_ctrl_->SetItemState(-1, 0, wxLIST_STATE_SELECTED | wxLIST_STATE_FOCUSED);
+    this->list_ctrl_->SetItemCount(rows.size());
+    this->list_ctrl_->wxListCtrl::Refresh();
 }
 
 void LcDirList::SetFocus() {
@@ -241,8 +288,7 @@ int LcDirList::GetHighlighted() {
     if (i < 0) {
         return 0;
     }
-    int j = this->list_ctrl_->GetItemData(i);
-    return j;
+    return i;
 }
 
 void LcDirList::SetHighlighted(int row) {
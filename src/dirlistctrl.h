@@ -23,20 +23,35 @@ using std::vector;
 typedef function<void(void)> OnItemActivatedCb;
 typedef function<void(int)> OnColumnHeaderClickCb;
 
-// A base class, because wxDataViewListCtrl looks best on MacOS, and wxListCtrl looks best on GTK and Windows.
+// A base class, because wxDataViewCtrl looks best on MacOS, and wxListCtrl looks best on GTK and Windows.
 class DirListCtrl {
 protected:
     OnItemActivatedCb on_item_activated_cb_;
     OnColumnHeaderClickCb on_column_header_click_cb_;
     wxImageList *icons_image_list_;
 
-    int IconIdx(DirEntry entry);
+    int IconIdx(const DirEntry &entry) const;
+
+    // As given to Refresh. The controls are virtual, and only look up the rows that are drawn, as they are drawn.
+    const vector<DirEntry> *entries_ = nullptr;
+    const vector<int> *rows_ = nullptr;
+    bool as_bytes_ = false;
+
+    // Entry shown at row, or nullptr if entries and rows have changed since the last Refresh and row is no longer
+    // there.
+    const DirEntry *EntryAtRow(size_t row) const;
+
+    // Text of the column col for entry, where col 0 is the name.
+    wxString ColumnText(const DirEntry &entry, int col) const;
 
 public:
     explicit DirListCtrl(wxImageList *icons_image_list) : icons_image_list_(icons_image_list) {
     }
 
-    virtual void Refresh(vector<DirEntry> entries) = 0;
+    // Shows the entries at the given indexes, in that order. Rows are numbered by their position in rows. Only keeps
+    // references to entries and rows, so they must stay in place until the next call. Only the number of rows is set
+    // up front, so it takes the same time whether there are ten entries or a million.
+    virtual void Refresh(const vector<DirEntry> &entries, const vector<int> &rows) = 0;
 
     virtual wxControl *GetCtrl() = 0;
 
@@ -61,14 +76,19 @@ public:
     }
 };
 
+class DirListModel;
+
 class DvlcDirList : public DirListCtrl {
-    wxDataViewListCtrl *dvlc_;
+    wxDataViewCtrl *dvc_;
+    wxObjectDataPtr<DirListModel> model_;
     wxConfigBase *config_;
 
+    friend class DirListModel;
+
 public:
     explicit DvlcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list);
 
-    void Refresh(vector<DirEntry> entries);
+    void Refresh(const vector<DirEntry> &entries, const vector<int> &rows);
 
     wxControl *GetCtrl();
 
@@ -85,14 +105,18 @@ public:
     void SetHighlighted(int);
 };
 
+class VirtualListCtrl;
+
 class LcDirList : public DirListCtrl {
-    wxListCtrl *list_ctrl_;
+    VirtualListCtrl *list_ctrl_;
     wxConfigBase *config_;
 
+    friend class VirtualListCtrl;
+
 public:
     explicit LcDirList(wxWindow *parent, wxConfigBase *config, wxImageList *icons_image_list);
 
-    void Refresh(vector<DirEntry> entries);
+    void Refresh(const vector<DirEntry> &entries, const vector<int> &rows);
 
     wxControl *GetCtrl();
 
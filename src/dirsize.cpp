@@ -0,0 +1,183 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/dirsize.h"
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <deque>
+#include <functional>
+#include <future>  // NOLINT
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/paths.h"
+#include "src/sftpasync.h"
+#include "src/sftpconnection.h"
+#include "src/string.h"
+
+using std::deque;
+using std::function;
+using std::future;
+using std::map;
+using std::max;
+using std::min;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+#define DU_BATCH_DIRS 200  // Subdirectories per du command, to stay well below the limit on command line length.
+#define DU_MIN_BATCH_DIRS 16  // Fewer are not worth a channel of their own.
+#define WALK_PROGRESS_INTERVAL_MS 250  // How often running totals are reported while walking over SFTP.
+#define WALK_DIRS_AT_ONCE 64  // Listings held in memory at a time while walking over SFTP.
+
+// Runs du on the subdirectories in batches, several batches at once. Returns false if du is missing or does not support
+// the options used, in which case supported is cleared and nothing has been reported.
+static bool computeViaDu(
+        SftpConnection *conn,
+        const string &dir,
+        const vector<string> &names,
+        function<bool(void)> cancelled,
+        DirSizeProgressCb progress,
+        bool *supported) {
+    // Small enough for each channel ExecMany runs at once to get a batch, as du walks one subdirectory at a time.
+    size_t per_channel = (names.size() + EXEC_MANY_CHANNELS - 1) / EXEC_MANY_CHANNELS;
+    size_t batch = max(static_cast<size_t>(DU_MIN_BATCH_DIRS), min(static_cast<size_t>(DU_BATCH_DIRS), per_channel));
+
+    // -l counts hard linked files in each subdirectory they are in, rather than only in the first one, so the totals
+    // do not depend on the order they were computed in. Each line is terminated by a null char, as paths can contain
+    // newlines.
+    vector<string> cmds;
+    map<string, const string *> by_path;
+    for (size_t begin = 0 ; begin < names.size() ; begin += batch) {
+        string cmd = "du -0 -s -b -l --";
+        for (size_t i = begin ; i < min(names.size(), begin + batch) ; ++i) {
+            auto path = normalize_path(dir + "/" + names[i]);
+            cmd += " " + ShellQuote(path);
+            by_path[path] = &names[i];
+        }
+        cmds.push_back(cmd);
+    }
+
+    vector<string> pending(cmds.size());
+    auto results = conn->ExecMany(cmds, [&](size_t cmd_index, string_view chunk) {
+        auto &p = pending[cmd_index];
+        p.append(chunk.data(), chunk.size());
+        size_t start = 0;
+        size_t record_end;
+        while ((record_end = p.find('\0', start)) != string::npos) {
+            string_view record(p.data() + start, record_end - start);
+            start = record_end + 1;
+
+            size_t tab = record.find('\t');
+            if (tab == string_view::npos) {
+                continue;
+            }
+            uint64_t bytes = 0;
+            bool ok = tab > 0;
+            for (char c : record.substr(0, tab)) {
+                ok = ok && c >= '0' && c <= '9';
+                bytes = bytes * 10 + (c - '0');
+            }
+            auto it = by_path.find(string(record.substr(tab + 1)));
+            if (ok && it != by_path.end()) {
+                progress(*it->second, bytes, true);
+            }
+        }
+        p.erase(0, start);
+    }, cancelled, true);  // du reports nothing until it is done with a subdirectory, however large.
+
+    if (!results.has_value()) {
+        return false;
+    }
+    for (auto &r : *results) {
+        bool bad_option = r.err_output.find("invalid option") != string::npos
+                          || r.err_output.find("illegal option") != string::npos
+                          || r.err_output.find("unrecognized option") != string::npos;
+        if (r.status == 127 || (r.status != 0 && bad_option)) {
+            // No du, or not GNU du, such as BSD or BusyBox du, which complain about unknown options.
+            *supported = false;
+            return false;
+        }
+        // Status 1 means some subdirectories could not be read, for example due to permissions. Their totals are
+        // then of what could be read.
+    }
+    return true;
+}
+
+// Walks each subdirectory over SFTP, listing as much of it at once as there is room for in the SFTP sessions of conn,
+// rather than one directory per round trip.
+static bool computeViaSftp(
+        SftpConnection *conn,
+        const string &dir,
+        const vector<string> &names,
+        function<bool(void)> cancelled,
+        DirSizeProgressCb progress) {
+    auto last_progress = steady_clock::now();
+    for (auto &name : names) {
+        uint64_t bytes = 0;
+        deque<string> queue{normalize_path(dir + "/" + name)};
+        while (!queue.empty()) {
+            if (cancelled()) {
+                return false;
+            }
+            SftpAsync async(conn);
+            vector<string> paths;
+            vector<future<vector<DirEntry>>> listings;
+            while (!queue.empty() && paths.size() < WALK_DIRS_AT_ONCE) {
+                paths.push_back(queue.front());
+                queue.pop_front();
+                listings.push_back(async.GetDir(paths.back(), false));  // Links are neither followed nor counted.
+            }
+            if (!async.Run(cancelled)) {
+                return false;
+            }
+
+            for (size_t i = 0 ; i < paths.size() ; ++i) {
+                vector<DirEntry> entries;
+                try {
+                    entries = listings[i].get();
+                } catch (DirListFailedPermission) {
+                    continue;
+                } catch (FileNotFound) {
+                    continue;
+                }
+
+                for (auto &e : entries) {
+                    if (e.name_ == "..") {
+                        continue;
+                    }
+                    bytes += e.size_;
+                    if (LIBSSH2_SFTP_S_ISDIR(e.mode_)) {  // Not is_dir_, which is also set for symlinks to directories.
+                        queue.push_back(normalize_path(paths[i] + "/" + e.name_));
+                    }
+                }
+            }
+
+            if (steady_clock::now() - last_progress > milliseconds(WALK_PROGRESS_INTERVAL_MS)) {
+                progress(name, bytes, false);
+                last_progress = steady_clock::now();
+            }
+        }
+        progress(name, bytes, true);
+    }
+    return true;
+}
+
+bool ComputeDirSizes(
+        SftpConnection *conn,
+        const string &dir,
+        const vector<string> &names,
+        function<bool(void)> cancelled,
+        DirSizeProgressCb progress) {
+    bool supported = true;
+    bool completed = computeViaDu(conn, dir, names, cancelled, progress, &supported);
+    if (!supported) {
+        completed = computeViaSftp(conn, dir, names, cancelled, progress);
+    }
+    return completed;
+}
@@ -0,0 +1,31 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_DIRSIZE_H_
+#define SRC_DIRSIZE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "src/sftpconnection.h"
+
+using std::function;
+using std::string;
+using std::vector;
+
+typedef function<void(const string &name, uint64_t bytes, bool complete)> DirSizeProgressCb;
+
+// Computes the total size of everything under each of names, which are subdirectories of dir, without following
+// symlinks. Uses du on the host where available, which reports each subdirectory once it is done with it. Otherwise
+// walks the subdirectories over SFTP, reporting running totals along the way. Either way progress is called with
+// complete set once the total of a subdirectory is final. Returns false if cancelled.
+//
+// Sizes are apparent sizes, the same as shown for files, rather than the disk space used.
+bool ComputeDirSizes(
+        SftpConnection *conn,
+        const string &dir,
+        const vector<string> &names,
+        function<bool(void)> cancelled,
+        DirSizeProgressCb progress);
+
+#endif  // SRC_DIRSIZE_H_
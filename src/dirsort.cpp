@@ -0,0 +1,252 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/dirsort.h"
+
+#include <algorithm>
+#include <future>  // NOLINT
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "src/direntry.h"
+
+using std::async;
+using std::future;
+using std::inplace_merge;
+using std::launch;
+using std::map;
+using std::sort;
+using std::upper_bound;
+using std::string;
+using std::string_view;
+using std::vector;
+
+// Below this many entries a plain single threaded sort is faster than the overhead of spreading it out.
+#define PARALLEL_SORT_THRESHOLD 50000
+#define PARALLEL_SORT_MAX_THREADS 8
+
+// Names are compared by their first 8 bytes packed into an integer first, and only fall back to comparing the full
+// strings when those are equal.
+struct NameKey {
+    uint64_t prefix;
+    string_view name;
+};
+
+static NameKey nameKey(const string &name) {
+    uint64_t prefix = 0;
+    for (size_t i = 0 ; i < 8 ; ++i) {
+        prefix = (prefix << 8) | (i < name.size() ? static_cast<unsigned char>(name[i]) : 0);
+    }
+    return NameKey{prefix, string_view(name)};
+}
+
+static inline int compareKeys(const NameKey &a, const NameKey &b) {
+    if (a.prefix != b.prefix) {
+        return a.prefix < b.prefix ? -1 : 1;
+    }
+    return a.name.compare(b.name);
+}
+
+template<typename T>
+static inline int compareKeys(T a, T b) {
+    return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+template<typename Key>
+struct SortRecord {
+    uint8_t group;  // Orders "..", directories and files, and dot-files before others when sorting by name.
+    Key key;
+    uint32_t index;  // Position in the original listing. Used as tie breaker, which keeps the sort deterministic.
+};
+
+template<typename Key, bool Desc>
+struct SortRecordLess {
+    bool operator()(const SortRecord<Key> &a, const SortRecord<Key> &b) const {
+        if (a.group != b.group) {
+            return a.group < b.group;
+        }
+        int c = compareKeys(a.key, b.key);
+        if (c != 0) {
+            return Desc ? c > 0 : c < 0;
+        }
+        return a.index < b.index;
+    }
+};
+
+// Sorts chunks of the range on separate threads and then merges them pairwise.
+template<typename It, typename Cmp>
+static void parallelSort(It begin, It end, Cmp cmp) {
+    size_t n = end - begin;
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), PARALLEL_SORT_MAX_THREADS);
+    if (n < PARALLEL_SORT_THRESHOLD || threads < 2) {
+        sort(begin, end, cmp);
+        return;
+    }
+
+    vector<It> bounds;
+    for (size_t i = 0 ; i < threads ; ++i) {
+        bounds.push_back(begin + n * i / threads);
+    }
+    bounds.push_back(end);
+
+    vector<future<void>> chunks;
+    for (size_t i = 0 ; i + 1 < bounds.size() ; ++i) {
+        chunks.push_back(async(launch::async, [=]() {
+            sort(bounds[i], bounds[i + 1], cmp);
+        }));
+    }
+    for (auto &c : chunks) {
+        c.get();
+    }
+
+    while (bounds.size() > 2) {
+        vector<It> merged{bounds[0]};
+        for (size_t i = 0 ; i + 2 < bounds.size() ; i += 2) {
+            inplace_merge(bounds[i], bounds[i + 1], bounds[i + 2], cmp);
+            merged.push_back(bounds[i + 2]);
+        }
+        if (bounds.size() % 2 == 0) {
+            // Odd number of chunks, so the last one had no partner in this round.
+            merged.push_back(bounds.back());
+        }
+        bounds = merged;
+    }
+}
+
+static uint8_t groupOf(const DirEntry &e, int column) {
+    if (e.name_ == "..") {
+        return 0;
+    }
+    uint8_t g = e.is_dir_ ? 2 : 4;
+    if (column == SORT_COLUMN_NAME && !e.name_.empty() && e.name_[0] != '.') {
+        g++;
+    }
+    return g;
+}
+
+// Packs the ls style mode string into an integer that sorts the same way as the string itself would.
+static uint64_t modeKey(const DirEntry &e) {
+    // All chars that can occur in a mode string, in ascending order.
+    static const string_view alphabet = "-STbcdlprstwx";
+    string s = e.ModeFormatted();
+    uint64_t key = 0;
+    for (char c : s) {
+        key = (key << 4) | (alphabet.find(c) + 1);
+    }
+    return key << (4 * (10 - s.size()));
+}
+
+// Maps each distinct interned string to its rank among all distinct values in the listing, so owner and group can be
+// compared as integers.
+static vector<uint32_t> internedRanks(const vector<DirEntry> &entries, const string *DirEntry::*field) {
+    map<string_view, uint32_t> distinct;
+    for (const auto &e : entries) {
+        distinct.emplace(e.*field ? string_view(*(e.*field)) : string_view(), 0);
+    }
+    uint32_t rank = 0;
+    for (auto &d : distinct) {
+        d.second = rank++;
+    }
+    vector<uint32_t> ranks;
+    ranks.reserve(entries.size());
+    for (const auto &e : entries) {
+        ranks.push_back(distinct[e.*field ? string_view(*(e.*field)) : string_view()]);
+    }
+    return ranks;
+}
+
+template<typename Key, typename KeyFunc>
+static void sortByKey(vector<DirEntry> *entries, int column, bool desc, KeyFunc key_func) {
+    auto &v = *entries;
+    vector<SortRecord<Key>> records;
+    records.reserve(v.size());
+    for (uint32_t i = 0 ; i < v.size() ; ++i) {
+        records.push_back(SortRecord<Key>{groupOf(v[i], column), key_func(i), i});
+    }
+
+    if (desc) {
+        parallelSort(records.begin(), records.end(), SortRecordLess<Key, true>());
+    } else {
+        parallelSort(records.begin(), records.end(), SortRecordLess<Key, false>());
+    }
+
+    vector<DirEntry> sorted;
+    sorted.reserve(v.size());
+    for (const auto &r : records) {
+        sorted.push_back(std::move(v[r.index]));
+    }
+    v.swap(sorted);
+}
+
+void SortDirEntries(vector<DirEntry> *entries, int column, bool desc) {
+    const auto &v = *entries;
+    switch (column) {
+        case SORT_COLUMN_SIZE:
+            sortByKey<uint64_t>(entries, column, desc, [&](uint32_t i) { return v[i].size_; });
+            break;
+        case SORT_COLUMN_MODIFIED:
+            sortByKey<uint64_t>(entries, column, desc, [&](uint32_t i) { return v[i].modified_; });
+            break;
+        case SORT_COLUMN_MODE:
+            sortByKey<uint64_t>(entries, column, desc, [&](uint32_t i) { return modeKey(v[i]); });
+            break;
+        case SORT_COLUMN_OWNER: {
+            auto ranks = internedRanks(v, &DirEntry::owner_);
+            sortByKey<uint32_t>(entries, column, desc, [&](uint32_t i) { return ranks[i]; });
+            break;
+        }
+        case SORT_COLUMN_GROUP: {
+            auto ranks = internedRanks(v, &DirEntry::group_);
+            sortByKey<uint32_t>(entries, column, desc, [&](uint32_t i) { return ranks[i]; });
+            break;
+        }
+        default:
+            // The names are only viewed while the records are sorted. Entries are not moved until afterwards.
+            sortByKey<NameKey>(entries, SORT_COLUMN_NAME, desc, [&](uint32_t i) { return nameKey(v[i].name_); });
+            break;
+    }
+}
+
+// Same order as SortDirEntries, apart from its tie breaker, for comparing single entries.
+static int compareEntries(const DirEntry &a, const DirEntry &b, int column, bool desc) {
+    uint8_t group_a = groupOf(a, column);
+    uint8_t group_b = groupOf(b, column);
+    if (group_a != group_b) {
+        return group_a < group_b ? -1 : 1;
+    }
+
+    int c;
+    switch (column) {
+        case SORT_COLUMN_SIZE:
+            c = compareKeys(a.size_, b.size_);
+            break;
+        case SORT_COLUMN_MODIFIED:
+            c = compareKeys(a.modified_, b.modified_);
+            break;
+        case SORT_COLUMN_MODE:
+            c = compareKeys(modeKey(a), modeKey(b));
+            break;
+        case SORT_COLUMN_OWNER:
+            c = string_view(a.Owner()).compare(string_view(b.Owner()));
+            break;
+        case SORT_COLUMN_GROUP:
+            c = string_view(a.Group()).compare(string_view(b.Group()));
+            break;
+        default:
+            c = compareKeys(nameKey(a.name_), nameKey(b.name_));
+            break;
+    }
+    return desc ? -c : c;
+}
+
+size_t DirEntryInsertPosition(const vector<DirEntry> &entries, const DirEntry &entry, int column, bool desc) {
+    if (column < SORT_COLUMN_NAME || column > SORT_COLUMN_GROUP) {
+        column = SORT_COLUMN_NAME;
+    }
+    auto it = upper_bound(entries.begin(), entries.end(), entry, [&](const DirEntry &a, const DirEntry &b) {
+        return compareEntries(a, b, column, desc) < 0;
+    });
+    return it - entries.begin();
+}
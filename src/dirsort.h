@@ -0,0 +1,29 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_DIRSORT_H_
+#define SRC_DIRSORT_H_
+
+#include <vector>
+
+#include "src/direntry.h"
+
+using std::vector;
+
+// Column numbers as shown in the directory list.
+#define SORT_COLUMN_NAME 0
+#define SORT_COLUMN_SIZE 1
+#define SORT_COLUMN_MODIFIED 2
+#define SORT_COLUMN_MODE 3
+#define SORT_COLUMN_OWNER 4
+#define SORT_COLUMN_GROUP 5
+
+// Sorts a directory listing the way it is shown: ".." first, then directories, then files, and within those by the
+// given column. Sort keys are computed once per entry up front rather than on every comparison.
+void SortDirEntries(vector<DirEntry> *entries, int column, bool desc);
+
+// Returns where entry belongs in entries, which must already be sorted by SortDirEntries with the same column and
+// order. Entries that compare equal to it stay ahead of it. For keeping a listing sorted as single entries change,
+// without sorting all of it again.
+size_t DirEntryInsertPosition(const vector<DirEntry> &entries, const DirEntry &entry, int column, bool desc);
+
+#endif  // SRC_DIRSORT_H_
@@ -0,0 +1,168 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/dirwatcher.h"
+
+#include <chrono>  // NOLINT
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/paths.h"
+#include "src/sftpconnection.h"
+#include "src/string.h"
+
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+#define WATCH_SETTLE_MS 200  // Quiet time after the latest change before a patch is sent.
+#define WATCH_MAX_DELAY_MS 1000  // Changes that keep coming, like a file being written, still show up this often.
+#define WATCH_POLL_INTERVAL_MS 2000  // How often the modification time is checked without inotifywait.
+#define WATCH_MAX_STATS 64  // More changed entries than this are cheaper to get by listing the directory again.
+
+DirWatcher::DirWatcher(SftpConnection *conn, string dir) : conn_(conn), dir_(dir) {
+    string err;
+    try {
+        int status = this->conn_->Exec("sh -c 'command -v inotifywait'", [](string_view) {}, &err);
+        if (status == 0) {
+            this->conn_->ExecBackgroundStart(
+                    "inotifywait -m -q"
+                    " -e create,delete,modify,attrib,moved_from,moved_to,delete_self,move_self"
+                    " --format '%e %f' " + ShellQuote(dir));
+            this->inotify_ = true;
+        }
+    } catch (ChannelRefused) {
+        // No channel to spare for it, such as with several windows on the host, so poll instead.
+    }
+    if (!this->inotify_) {
+        auto entry = this->conn_->Stat(dir);
+        this->dir_modified_ = entry.has_value() ? entry->modified_ : 0;
+    }
+    this->last_poll_ = steady_clock::now();
+}
+
+DirWatcher::~DirWatcher() {
+    if (this->inotify_) {
+        this->conn_->ExecBackgroundStop();
+    }
+}
+
+const string &DirWatcher::Dir() const {
+    return this->dir_;
+}
+
+optional<DirPatch> DirWatcher::Poll() {
+    auto now = steady_clock::now();
+
+    if (this->inotify_) {
+        auto output = this->conn_->ExecBackgroundPoll();
+        if (output.has_value()) {
+            this->ParseEvents(*output);
+        } else {
+            // inotifywait exited, for example because the directory itself was removed, or the host ran out of
+            // watches. Carry on by polling, starting from an unknown modification time so anything missed in
+            // between is picked up by listing again.
+            this->inotify_ = false;
+            this->dir_modified_ = 0;
+            this->last_poll_ = steady_clock::time_point();
+        }
+    }
+
+    if (!this->inotify_ && now - this->last_poll_ >= milliseconds(WATCH_POLL_INTERVAL_MS)) {
+        this->last_poll_ = now;
+        auto entry = this->conn_->Stat(this->dir_);
+        if (entry.has_value() && entry->modified_ != this->dir_modified_) {
+            this->dir_modified_ = entry->modified_;
+            this->Changed(true, "");
+        }
+    }
+
+    if (!this->relist_ && this->changed_.empty()) {
+        return nullopt;
+    }
+    if (now - this->last_change_ < milliseconds(WATCH_SETTLE_MS)
+        && now - this->first_change_ < milliseconds(WATCH_MAX_DELAY_MS)) {
+        return nullopt;
+    }
+
+    DirPatch patch;
+    if (!this->relist_ && this->changed_.size() <= WATCH_MAX_STATS) {
+        vector<string> paths;
+        for (auto &name : this->changed_) {
+            paths.push_back(normalize_path(this->dir_ + "/" + name));
+        }
+        try {
+            auto entries = this->conn_->LstatMany(paths);
+            size_t i = 0;
+            for (auto &name : this->changed_) {
+                if (entries[i].has_value()) {
+                    patch.updated.push_back(*entries[i]);
+                } else {
+                    patch.removed.push_back(name);
+                }
+                ++i;
+            }
+        } catch (FailedPermission) {
+            this->relist_ = true;  // The listing itself may still be allowed.
+        }
+    }
+    bool relist = this->relist_ || this->changed_.size() > WATCH_MAX_STATS;
+    this->changed_.clear();
+    this->relist_ = false;
+
+    if (relist) {
+        patch = DirPatch();
+        try {
+            patch.updated = this->conn_->GetDir(this->dir_);
+        } catch (FileNotFound) {
+            return nullopt;  // Nothing left to show. The user finds out on navigating.
+        } catch (DirListFailedPermission) {
+            return nullopt;
+        }
+        patch.full = true;
+    }
+    return patch;
+}
+
+// Each line is the comma separated events, a space, and the name of the entry they are about, or an empty name for
+// events about the directory itself.
+void DirWatcher::ParseEvents(const string &output) {
+    this->partial_line_ += output;
+    size_t start = 0;
+    size_t end;
+    while ((end = this->partial_line_.find('\n', start)) != string::npos) {
+        string_view line(this->partial_line_.data() + start, end - start);
+        start = end + 1;
+
+        auto space = line.find(' ');
+        if (space == string_view::npos) {
+            continue;
+        }
+        auto events = line.substr(0, space);
+        auto name = line.substr(space + 1);
+        if (events.find("_SELF") != string_view::npos) {
+            continue;  // inotifywait exits once the directory is gone, which Poll handles.
+        }
+        if (!name.empty()) {
+            this->Changed(false, string(name));
+        }
+    }
+    this->partial_line_.erase(0, start);
+}
+
+void DirWatcher::Changed(bool relist, const string &name) {
+    auto now = steady_clock::now();
+    if (!this->relist_ && this->changed_.empty()) {
+        this->first_change_ = now;
+    }
+    this->last_change_ = now;
+    if (relist) {
+        this->relist_ = true;
+    } else {
+        this->changed_.insert(name);
+    }
+}
@@ -0,0 +1,66 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_DIRWATCHER_H_
+#define SRC_DIRWATCHER_H_
+
+#include <chrono>  // NOLINT
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/sftpconnection.h"
+
+using std::optional;
+using std::set;
+using std::string;
+using std::vector;
+using std::chrono::steady_clock;
+
+struct DirPatch {
+    vector<DirEntry> updated;  // New and changed entries, or the complete listing if full is set.
+    vector<string> removed;  // Names of entries that are gone.
+    bool full = false;
+};
+
+// Follows the changes to the entries of one remote directory, so its listing can be kept current without listing the
+// whole directory over and over. Uses inotifywait on the host where available, and then only the entries named in its
+// events are looked at again. Otherwise falls back to polling the modification time of the directory, and listing it
+// again once that changes.
+//
+// Polled from the sftp thread in between commands, so it never blocks waiting for changes.
+class DirWatcher {
+    SftpConnection *conn_;
+    string dir_;
+    bool inotify_ = false;
+    string partial_line_;  // Trailing output of inotifywait, not yet ended by a newline.
+    uint64_t dir_modified_ = 0;
+    set<string> changed_;
+    bool relist_ = false;
+    steady_clock::time_point first_change_;
+    steady_clock::time_point last_change_;
+    steady_clock::time_point last_poll_;
+
+public:
+    DirWatcher(SftpConnection *conn, string dir);
+
+    ~DirWatcher();
+
+    DirWatcher(const DirWatcher &) = delete;
+
+    DirWatcher &operator=(const DirWatcher &) = delete;
+
+    const string &Dir() const;
+
+    // Checks for changes without waiting for any. Changes are coalesced until they have settled for a moment, so a
+    // burst of events, such as from extracting an archive, turns into a single patch.
+    optional<DirPatch> Poll();
+
+private:
+    void ParseEvents(const string &output);
+
+    void Changed(bool relist, const string &name);
+};
+
+#endif  // SRC_DIRWATCHER_H_
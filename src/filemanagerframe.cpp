@@ -15,6 +15,7 @@
 #include <future>  // NOLINT
 #include <map>
 #include <memory>
+#include <optional>
 #include <regex>  // NOLINT
 #include <stack>
 #include <string>
@@ -30,26 +31,39 @@
 #include "./version.h"
 #include "src/artprovider.h"
 #include "src/channel.h"
+#include "src/connectdialog.h"
+#include "src/dircache.h"
 #include "src/direntry.h"
 #include "src/dirlistctrl.h"
+#include "src/dirsort.h"
 #include "src/hostdesc.h"
 #include "src/ids.h"
 #include "src/licensestrings.h"
 #include "src/passworddialog.h"
 #include "src/paths.h"
 #include "src/preferencespanel.h"
+#include "src/prewarm.h"
+#include "src/remoteindex.h"
+#include "src/sessionhandoff.h"
 #include "src/sftpthread.h"
 #include "src/string.h"
 #include "src/storageunits.h"
 
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::find_if;
 using std::future;
 using std::launch;
+using std::make_pair;
 using std::make_shared;
 using std::make_unique;
 using std::map;
+using std::nullopt;
 using std::regex;
 using std::regex_search;
+using std::remove_if;
 using std::shared_ptr;
 using std::stack;
 using std::string;
@@ -80,6 +94,14 @@ public:
     }
 };
 
+// Opens another window on host_desc, which opens onto the session of the windows already on it, so connects right away.
+static void openWindow(wxConfigBase *config, HostDesc host_desc, wxSecretValue passwd_param, string local_tmp) {
+    auto frame = new FileManagerFrame(config);
+    frame->SetPosition(frame->GetPosition() + wxPoint(30, 30));  // Rather than exactly on top of the previous one.
+    frame->Show();
+    frame->Connect(host_desc, passwd_param, local_tmp);
+}
+
 FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         NULL,
         wxID_ANY,
@@ -132,20 +154,62 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         this->OnItemActivated();
     }, wxID_OPEN);
 
-    file_menu->Append(ID_DOWNLOAD, "&Download\tCtrl+S", "Download selected file");
+    file_menu->Append(ID_DOWNLOAD, "&Download\tCtrl+S", "Download selected files");
     this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
         if (this->busy_cursor_) {
             return;
         }
 
-        int item = this->dir_list_ctrl_->GetHighlighted();
-        auto entry = this->current_dir_list_[item];
-        if (entry.is_dir_) {
+        auto local_dir = wxStandardPaths::Get().GetUserDir(wxStandardPaths::Dir_Downloads);
+        local_dir = this->config_->Read("/last_dir", local_dir);
+
+        auto names = this->SelectedNames();
+        if (names.size() > 1) {
+            wxDirDialog dir_dialog(this, "Download " + to_string(names.size()) + " files into", local_dir);
+            if (dir_dialog.ShowModal() != wxID_OK) {
+                return;
+            }
+            local_dir = dir_dialog.GetPath().ToStdString(wxMBConvUTF8());
+            this->config_->Write("/last_dir", wxString::FromUTF8(local_dir));
+
+            // Asking once for all of them, like the file dialog does for a single download.
+            vector<string> new_names;
+            for (auto &name : names) {
+                if (!exists(localPathUnicode(normalize_path(local_dir + "/" + name)))) {
+                    new_names.push_back(name);
+                }
+            }
+            if (new_names.size() < names.size()) {
+                auto existing = names.size() - new_names.size();
+                wxMessageDialog dialog(
+                        this,
+                        wxString::FromUTF8(to_string(existing) + " of the files already exist in " + local_dir
+                                           + ". Overwrite them?"),
+                        "Confirm overwrite",
+                        wxYES_NO | wxCANCEL | wxICON_QUESTION | wxCENTER);
+                dialog.SetYesNoCancelLabels("Overwrite", "Skip", "Cancel");
+                auto answer = dialog.ShowModal();
+                if (answer == wxID_CANCEL) {
+                    return;
+                }
+                if (answer == wxID_NO) {
+                    names = new_names;
+                }
+                if (names.empty()) {
+                    this->SetStatusText("All of the files already exist. Nothing to download.");
+                    return;
+                }
+            }
+
+            this->StartBatchJob(BatchJob{BATCH_DOWNLOAD, this->current_dir_, names, local_dir});
             return;
         }
 
-        auto local_dir = wxStandardPaths::Get().GetUserDir(wxStandardPaths::Dir_Downloads);
-        local_dir = this->config_->Read("/last_dir", local_dir);
+        auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+        if (!highlighted || highlighted->is_dir_) {
+            return;
+        }
+        auto entry = *highlighted;
 
         wxFileDialog dialog(this,
                             "Download file",
@@ -194,17 +258,44 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
 
     file_menu->Append(ID_CANCEL, "&Cancel current transfer\tESC", "Cancel the current upload or download");
     this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
-        this->cancellation_channel_->Put(true);
+        for (auto &job : this->jobs_) {
+            job.second->Cancel();
+        }
     }, ID_CANCEL);
 
+    file_menu->Append(ID_JOBS, "&Transfers...", "List transfers and other jobs in progress, to cancel one of them");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
+        if (this->jobs_.empty()) {
+            wxMessageDialog dialog(this, "Nothing in progress.", "Transfers", wxOK | wxCENTER);
+            dialog.ShowModal();
+            return;
+        }
+
+        vector<shared_ptr<JobHandle>> handles;
+        wxArrayString descriptions;
+        for (auto &job : this->jobs_) {
+            handles.push_back(job.second);
+            descriptions.Add(wxString::FromUTF8(
+                    job.second->description_ + (job.second->Cancelled() ? " (cancelling)" : "")));
+        }
+        wxSingleChoiceDialog dialog(this, "Select a job to cancel:", "Transfers", descriptions);
+        dialog.SetOKCancelLabels("Cancel job", "Close");
+        if (dialog.ShowModal() == wxID_OK) {
+            handles[dialog.GetSelection()]->Cancel();
+        }
+    }, ID_JOBS);
+
     file_menu->Append(ID_RENAME, "&Rename\tF2", "Rename currently selected file or directory");
     this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
         if (this->busy_cursor_) {
             return;
         }
 
-        int item = this->dir_list_ctrl_->GetHighlighted();
-        auto entry = this->current_dir_list_[item];
+        auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+        if (!highlighted) {
+            return;
+        }
+        auto entry = *highlighted;
 
         wxTextEntryDialog dialog(
                 this,
@@ -229,6 +320,83 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         this->busy_cursor_ = make_unique<wxBusyCursor>();
     }, ID_RENAME);
 
+    file_menu->Append(ID_MOVE, "&Move to...\tCtrl+M", "Move selected files and directories to another directory");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
+        if (this->busy_cursor_) {
+            return;
+        }
+
+        auto names = this->SelectedNames();
+        if (names.empty()) {
+            return;
+        }
+
+        string what = names.size() == 1 ? names[0] : to_string(names.size()) + " entries";
+        wxTextEntryDialog dialog(
+                this,
+                wxString::FromUTF8("Move " + what + " to directory:"),
+                "Move",
+                wxString::FromUTF8(this->current_dir_),
+                wxOK | wxCANCEL);
+        if (dialog.ShowModal() != wxID_OK) {
+            return;
+        }
+
+        auto target = normalize_path(dialog.GetValue().ToStdString(wxMBConvUTF8()));
+        if (target == this->current_dir_) {
+            return;
+        }
+        this->StartBatchJob(BatchJob{BATCH_MOVE, this->current_dir_, names, target});
+    }, ID_MOVE);
+
+    file_menu->Append(ID_CHMOD, "Change &permissions...\tCtrl+P",
+                      "Change permissions of selected files and directories");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
+        if (this->busy_cursor_) {
+            return;
+        }
+
+        auto names = this->SelectedNames();
+        if (names.empty()) {
+            return;
+        }
+
+        char current[16] = "644";
+        auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+        if (highlighted && highlighted->mode_ != 0) {
+            snprintf(current, sizeof(current), "%o", highlighted->mode_ & 07777);
+        }
+
+        string what = names.size() == 1 ? names[0] : to_string(names.size()) + " entries";
+        wxTextEntryDialog dialog(
+                this,
+                wxString::FromUTF8("New permissions of " + what + ", in octal, for example 755:"),
+                "Change permissions",
+                current,
+                wxOK | wxCANCEL);
+        if (dialog.ShowModal() != wxID_OK) {
+            return;
+        }
+
+        string value = dialog.GetValue().ToStdString(wxMBConvUTF8());
+        uint32_t mode = 0;
+        bool valid = !value.empty() && value.size() <= 4;
+        for (char ch : value) {
+            valid = valid && ch >= '0' && ch <= '7';
+            mode = mode * 8 + (ch - '0');
+        }
+        if (!valid) {
+            wxMessageDialog error(this, "Permissions must be given as 3 or 4 octal digits, for example 755.", "Error",
+                                  wxOK | wxICON_ERROR | wxCENTER);
+            error.ShowModal();
+            return;
+        }
+
+        BatchJob job{BATCH_CHMOD, this->current_dir_, names};
+        job.mode = mode;
+        this->StartBatchJob(job);
+    }, ID_CHMOD);
+
 #ifdef __WXOSX__
     file_menu->Append(wxID_DELETE, "&Delete\tCtrl+Backspace", "Delete currently selected file or directory");
 #else
@@ -239,8 +407,22 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
             return;
         }
 
-        int item = this->dir_list_ctrl_->GetHighlighted();
-        auto entry = this->current_dir_list_[item];
+        auto names = this->SelectedNames();
+        if (names.size() > 1) {
+            auto s = wxString::FromUTF8("Permanently delete " + to_string(names.size()) + " selected entries?");
+            wxMessageDialog dialog(this, s, "Confirm deletion", wxYES_NO | wxICON_ERROR | wxCENTER);
+            dialog.SetYesNoLabels("Delete", "Cancel");
+            if (dialog.ShowModal() == wxID_YES) {
+                this->StartBatchJob(BatchJob{BATCH_DELETE, this->current_dir_, names});
+            }
+            return;
+        }
+
+        auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+        if (!highlighted) {
+            return;
+        }
+        auto entry = *highlighted;
 
         auto s = wxString::FromUTF8("Permanently delete " + entry.name_ + "?");
         wxMessageDialog dialog(this, s, "Confirm deletion", wxYES_NO | wxICON_ERROR | wxCENTER);
@@ -327,6 +509,34 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         this->SetStatusText(wxString::FromUTF8("Elevating to root via sudo ..."));
     }, ID_SUDO);
 
+    file_menu->Append(ID_NEW_WINDOW, "New &window\tCtrl+Shift+I", "Open another window on this host");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
+        if (!this->connected_) {
+            return;
+        }
+        openWindow(this->config_, this->host_desc_, this->passwd_param_, this->local_tmp_root_);
+    }, ID_NEW_WINDOW);
+
+    file_menu->Append(ID_CONNECT_OTHER_HOST, "Connect to another &host...\tCtrl+Shift+O",
+                      "Open a window on another host, in this instance");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
+        auto connect_dialog = new ConnectDialog(this, this->config_, "");
+        connect_dialog->ShowModal();
+        connect_dialog->Destroy();
+        if (!connect_dialog->connect_) {
+            DiscardPrewarmedConnection();
+            return;
+        }
+        auto host_desc = connect_dialog->host_desc_;
+
+        // An instance already connected to the host opens a window on it instead, over the session it has.
+        if (RequestWindowFromOwner(host_desc)) {
+            DiscardPrewarmedConnection();
+            return;
+        }
+        openWindow(this->config_, host_desc, wxSecretValue(), this->local_tmp_root_);
+    }, ID_CONNECT_OTHER_HOST);
+
     file_menu->AppendSeparator();
 
     file_menu->Append(wxID_PREFERENCES);
@@ -351,7 +561,7 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
     go_menu->Append(wxID_REFRESH, "Refresh\tCtrl+R");
     this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
         this->latest_interesting_status_ = "";
-        this->RefreshDir(this->current_dir_, true);
+        this->RefreshDir(this->current_dir_, true, true);
     }, wxID_REFRESH);
 
     go_menu->Append(ID_SET_DIR, "Change directory\tCtrl+L");
@@ -360,6 +570,54 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         this->path_text_ctrl_->SelectAll();
     }, ID_SET_DIR);
 
+    go_menu->Append(ID_FILTER, "Filter listing\tCtrl+F");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &) {
+        this->filter_text_ctrl_->SetFocus();
+        this->filter_text_ctrl_->SelectAll();
+    }, ID_FILTER);
+
+    go_menu->Append(ID_INDEX, "Index remote tree...");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &) {
+        if (this->busy_cursor_) {
+            return;
+        }
+
+        this->LoadRemoteIndex();
+        int max_depth = this->config_->Read("/index_max_depth", 8);
+        string root = this->remote_index_ ? this->remote_index_->Root() : this->current_dir_;
+        wxTextEntryDialog dialog(
+                this,
+                wxString::FromUTF8("Directory to index, down to a depth of " + to_string(max_depth) + ":"),
+                "Index remote tree",
+                wxString::FromUTF8(root));
+        if (dialog.ShowModal() != wxID_OK) {
+            return;
+        }
+        root = normalize_path(dialog.GetValue().ToStdString(wxMBConvUTF8()));
+
+        this->sftp_thread_channel_->Put(SftpThreadCmdIndex{
+                root, max_depth, this->remote_index_, this->NewJob("Indexing " + root)});
+        // Not busy, as it runs in the background, while browsing carries on.
+        this->SetStatusText(wxString::FromUTF8("Indexing " + root + " ... Press Esc to cancel."));
+    }, ID_INDEX);
+
+    go_menu->Append(ID_SEARCH_INDEX, "Search index...\tCtrl+Shift+F");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &) {
+        if (this->busy_cursor_ && this->connected_) {
+            return;
+        }
+        this->SearchRemoteIndex();
+    }, ID_SEARCH_INDEX);
+
+    go_menu->Append(ID_COMPUTE_SIZE, "Compute directory sizes\tCtrl+Shift+S",
+                    "Compute the total size of each directory here, including everything under it");
+    this->Bind(wxEVT_MENU, [&](wxCommandEvent &) {
+        if (this->busy_cursor_ || !this->connected_) {
+            return;
+        }
+        this->RequestDirSizes();
+    }, ID_COMPUTE_SIZE);
+
 #ifdef __WXOSX__
     go_menu->Append(ID_PARENT_DIR, "Parent directory\tCtrl+Up", wxEmptyString, wxITEM_NORMAL);
 #else
@@ -376,7 +634,7 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
     go_menu->Append(wxID_BACKWARD, "Back\tAlt+Left", wxEmptyString, wxITEM_NORMAL);
 #endif
     this->Bind(wxEVT_MENU, [&](wxCommandEvent &event) {
-        if (this->busy_cursor_ || this->prev_dirs_.empty()) {
+        if ((this->busy_cursor_ && this->connected_) || this->prev_dirs_.empty()) {
             return;
         }
 
@@ -396,7 +654,7 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
     go_menu->Append(wxID_FORWARD, "Forward\tAlt+Right", wxEmptyString, wxITEM_NORMAL);
 #endif
     this->Bind(wxEVT_TOOL, [&](wxCommandEvent &event) {
-        if (this->busy_cursor_ || this->fwd_dirs_.empty()) {
+        if ((this->busy_cursor_ && this->connected_) || this->fwd_dirs_.empty()) {
             return;
         }
 
@@ -465,6 +723,9 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
             wxAcceleratorEntry(wxACCEL_NORMAL, WXK_F5, wxID_REFRESH),
             wxAcceleratorEntry(wxACCEL_CTRL, 'R', wxID_REFRESH),
             wxAcceleratorEntry(wxACCEL_CTRL, 'L', ID_SET_DIR),
+            wxAcceleratorEntry(wxACCEL_CTRL, 'F', ID_FILTER),
+            wxAcceleratorEntry(wxACCEL_CTRL | wxACCEL_SHIFT, 'F', ID_SEARCH_INDEX),
+            wxAcceleratorEntry(wxACCEL_CTRL | wxACCEL_SHIFT, 'S', ID_COMPUTE_SIZE),
             wxAcceleratorEntry(wxACCEL_ALT, WXK_UP, ID_PARENT_DIR),
             wxAcceleratorEntry(wxACCEL_ALT, WXK_LEFT, wxID_BACKWARD),
             wxAcceleratorEntry(wxACCEL_ALT, WXK_RIGHT, wxID_FORWARD),
@@ -474,6 +735,8 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
             wxAcceleratorEntry(wxACCEL_NORMAL, WXK_F2, ID_RENAME),
             wxAcceleratorEntry(wxACCEL_NORMAL, WXK_DELETE, wxID_DELETE),
             wxAcceleratorEntry(wxACCEL_CTRL | wxACCEL_SHIFT, 'N', ID_MKDIR),
+            wxAcceleratorEntry(wxACCEL_CTRL, 'M', ID_MOVE),
+            wxAcceleratorEntry(wxACCEL_CTRL, 'P', ID_CHMOD),
     };
     wxAcceleratorTable accel(entries.size(), &entries[0]);
     this->SetAcceleratorTable(accel);
@@ -622,6 +885,39 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         evt.Skip();
     });
 
+    // Create filter text field. Filters the current listing on every keystroke.
+    this->filter_text_ctrl_ = new wxTextCtrl(
+            panel,
+            wxID_ANY,
+            wxEmptyString,
+            wxDefaultPosition,
+            this->FromDIP(wxSize(200, -1)),
+            wxTE_PROCESS_ENTER);
+    this->filter_text_ctrl_->SetHint("Filter (text, *.glob or ~fuzzy)");
+    sizer_inner_top->Add(this->filter_text_ctrl_, 0, wxEXPAND | wxALL, 4);
+
+    this->filter_text_ctrl_->Bind(wxEVT_TEXT, [&](wxCommandEvent &event) {
+        this->RememberSelected();
+        this->PopulateDir();
+        this->RecallSelected();
+        this->SetIdleStatusText();
+    });
+
+    this->filter_text_ctrl_->Bind(wxEVT_TEXT_ENTER, [&](wxCommandEvent &event) {
+        this->dir_list_ctrl_->SetFocus();
+    });
+
+    // Handle when pressing ESC while focused on the filter text field.
+    this->filter_text_ctrl_->Bind(wxEVT_CHAR_HOOK, [&](wxKeyEvent &evt) {
+        if (evt.GetModifiers() == 0 && evt.GetKeyCode() == WXK_ESCAPE && this->filter_text_ctrl_->HasFocus()) {
+            this->filter_text_ctrl_->SetValue("");  // Triggers wxEVT_TEXT, which shows all entries again.
+            this->dir_list_ctrl_->SetFocus();
+            return;
+        }
+
+        evt.Skip();
+    });
+
     auto icon_size = this->FromDIP(wxSize(16, 16));
     auto icons_image_list = new wxImageList(icon_size.GetWidth(), icon_size.GetHeight(), false, 1);
     icons_image_list->Add(this->GetBitmap(wxART_NORMAL_FILE, wxART_LIST, icon_size));
@@ -681,7 +977,9 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
 
         if (this->sftp_thread_channel_) {
             this->sftp_thread_channel_->Put(SftpThreadCmdShutdown{});
-            this->cancellation_channel_->Put(true);
+            for (auto &job : this->jobs_) {
+                job.second->Cancel();
+            }
 
             // Unless we never even connected, wait up to 2 seconds.
             if (!this->home_dir_.empty()) {
@@ -691,6 +989,10 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
             this->sftp_thread_.release();
         }
 
+        if (this->dir_cache_) {
+            this->dir_cache_->Save();
+        }
+
         // Save frame position.
         int x, y, w, h;
         this->GetClientSize(&w, &h);
@@ -718,6 +1020,11 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
         this->SetStatusText(wxString::FromUTF8(this->reconnect_timer_error_ + " Reconnecting..."));
     });
 
+    // Timer used to show the progress of jobs, which the sftp thread stores for us to sample rather than sending it.
+    this->progress_timer_.Bind(wxEVT_TIMER, [&](wxTimerEvent &event) {
+        this->ShowJobProgress();
+    });
+
     // Drag and drop for uploading.
     this->SetDropTarget(new DnDFile([&](const wxArrayString &filenames) {
         if (filenames.size() > 1) {
@@ -752,12 +1059,22 @@ FileManagerFrame::FileManagerFrame(wxConfigBase *config) : wxFrame(
 void FileManagerFrame::Connect(HostDesc host_desc, wxSecretValue passwd_param, string local_tmp) {
     this->host_desc_ = host_desc;
     this->passwd_param_ = passwd_param;
+    this->local_tmp_root_ = local_tmp;
 
     // Use a sub tmp directory with the name of this connection.
     this->local_tmp_ = normalize_path(local_tmp + "/" + this->host_desc_.ToStringNoCol());
 
     this->RefreshTitle();
 
+    // Show where we left off last time right away, from the listing cache, while connecting.
+    this->dir_cache_ = make_unique<DirCache>(DirCache::PathForHost(this->host_desc_.ToString()));
+    this->dir_cache_->Load();
+    auto last_dir = this->dir_cache_->LastDir();
+    if (last_dir.has_value()) {
+        this->current_dir_ = *last_dir;
+        this->ShowCachedDir(this->current_dir_);
+    }
+
     // Start the sftp thread. We will be communicating with it only through message passing.
     this->SetupSftpThreadCallbacks();
     this->sftp_thread_ = make_unique<future<void>>(
@@ -765,8 +1082,7 @@ void FileManagerFrame::Connect(HostDesc host_desc, wxSecretValue passwd_param, s
                     launch::async,
                     sftpThreadFunc,
                     this,
-                    this->sftp_thread_channel_,
-                    this->cancellation_channel_));
+                    this->sftp_thread_channel_));
     this->sftp_thread_channel_->Put(SftpThreadCmdConnect{this->host_desc_});
     this->busy_cursor_ = make_unique<wxBusyCursor>();
     this->SetStatusText("Connecting...");
@@ -777,6 +1093,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = nullptr;
         auto r = event.GetPayload<SftpThreadResponseConnected>();
+        this->connected_ = true;
 
         // Was this a reconnect after a dropped connection?
         if (!this->home_dir_.empty()) {
@@ -788,12 +1105,26 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
             if (this->sudo_) {
                 this->sftp_thread_channel_->Put(SftpThreadCmdSudo{});
                 this->SetStatusText(wxString::FromUTF8("Elevating to root via sudo ..."));
+            } else if (this->listing_cached_at_) {
+                this->RefreshDir(this->current_dir_, true);  // Was browsing cached listings while disconnected.
             } else {
                 this->SetIdleStatusText();
             }
         } else {
             this->home_dir_ = r.home_dir;
-            this->current_dir_ = r.home_dir;
+
+            // Instances started for the same host afterwards open a window here instead, over the same session.
+            auto config = this->config_;
+            auto host_desc = this->host_desc_;
+            auto passwd_param = this->passwd_param_;
+            auto local_tmp_root = this->local_tmp_root_;
+            ServeWindowRequests(this->host_desc_, [config, host_desc, passwd_param, local_tmp_root]() {
+                openWindow(config, host_desc, passwd_param, local_tmp_root);
+            });
+
+            if (this->current_dir_.empty()) {  // Otherwise stay in the cached dir that is already shown.
+                this->current_dir_ = r.home_dir;
+            }
             this->SetStatusText("Connected. Getting directory list...");
             this->RefreshDir(this->current_dir_, false);
         }
@@ -870,6 +1201,10 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         }
 
         this->current_dir_list_ = r.dir_list;
+        this->listing_cached_at_ = 0;
+        this->listed_dir_ = r.dir;
+        this->listed_dir_entry_ = r.dir_entry.modified_ ? optional<DirEntry>(r.dir_entry) : nullopt;
+        this->dir_cache_->Put(r.dir, std::move(r.dir_list));
         this->path_text_ctrl_->SetValue(wxString::FromUTF8(r.dir));
         this->SortAndPopulateDir();
         this->RecallSelected();
@@ -880,6 +1215,40 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         this->SetIdleStatusText();
     }, ID_SFTP_THREAD_RESPONSE_GET_DIR);
 
+    // Sftp thread will trigger this callback when entries of the watched directory changed on the host.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        auto r = event.GetPayload<SftpThreadResponseDirPatch>();
+        if (this->current_dir_ != r.dir || this->listing_cached_at_) {
+            return;
+        }
+
+        if (r.patch.full) {
+            this->RememberSelected();
+            this->current_dir_list_ = r.patch.updated;
+            this->dir_cache_->Put(r.dir, this->current_dir_list_);
+            this->SortAndPopulateDir();
+            this->RecallSelected();
+        } else {
+            this->PatchListing(r.patch.updated, r.patch.removed);
+        }
+        this->listed_dir_entry_ = nullopt;  // Changed along with the entries.
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_DIR_PATCH);
+
+    // Sftp thread will trigger this callback when a dir did not change since the listing that is already shown.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->busy_cursor_ = nullptr;
+        auto r = event.GetPayload<SftpThreadResponseDirUnchanged>();
+
+        // Requested dir changed meanwhile.
+        if (this->current_dir_ != r.dir) {
+            this->RefreshDir(this->current_dir_, false);
+            return;
+        }
+
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_DIR_UNCHANGED);
+
     // Sftp thread will trigger this callback after successfully downloading a file.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = nullptr;
@@ -950,7 +1319,13 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
 
         string d = string(wxDateTime::Now().FormatISOCombined(' '));
         this->latest_interesting_status_ = "Uploaded " + r.remote_path + " at " + d + ".";
-        this->RefreshDir(this->current_dir_, true);
+        if (r.entry.has_value() && normalize_path(r.remote_path + "/..") == this->listed_dir_
+            && this->current_dir_ == this->listed_dir_) {
+            this->PatchListing({*r.entry}, {});
+            this->SetIdleStatusText();
+        } else {
+            this->RefreshDir(this->current_dir_, true);
+        }
 
         if (this->opened_files_local_.find(r.remote_path) != this->opened_files_local_.end()) {
             // TODO(allan): catch if a file gets written again after the upload starts but before it completes
@@ -960,6 +1335,18 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         }
     }, ID_SFTP_THREAD_RESPONSE_UPLOAD);
 
+    // Sftp thread will trigger this callback when it is done with a job, whether it succeeded, failed or was cancelled.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->jobs_.erase(event.GetPayload<SftpThreadResponseJobDone>().job_id);
+        if (this->jobs_.empty()) {
+            this->progress_timer_.Stop();
+            if (this->GetStatusBar()->GetStatusText() == wxString::FromUTF8(this->progress_status_)) {
+                this->SetIdleStatusText();  // Nothing else has told how the job ended.
+            }
+            this->progress_status_ = "";
+        }
+    }, ID_SFTP_THREAD_RESPONSE_JOB_DONE);
+
     // Sftp thread will trigger this callback when a transfer was successfully cancelled by the user.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = nullptr;
@@ -968,23 +1355,105 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         this->RefreshDir(this->current_dir_, true);
     }, ID_SFTP_THREAD_RESPONSE_CANCELLED);
 
-    // Sftp thread will trigger this callback to indicate progress while uploading a file.
+    // Sftp thread will trigger this callback after successfully indexing a remote tree.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
-        auto r = event.GetPayload<SftpThreadResponseProgress>();
+        auto r = event.GetPayload<SftpThreadResponseIndex>();
 
-        this->SetStatusText(wxString::FromUTF8(
-                "Uploading " + r.remote_path + ", " + size_string(r.bytes_done) + " of "
-                + size_string(r.bytes_total) + ", " + size_string(r.bytes_per_sec) + "/sec ... Press Esc to cancel."));
-    }, ID_SFTP_THREAD_RESPONSE_UPLOAD_PROGRESS);
+        this->remote_index_ = r.index;
+        this->remote_index_loaded_ = true;
+        this->remote_index_->Save(RemoteIndex::PathForHost(this->host_desc_.ToString()));
 
-    // Sftp thread will trigger this callback to indicate progress while downloading a file.
+        this->latest_interesting_status_ = "Indexed " + to_string(r.index->Size()) + " entries under "
+                                           + r.index->Root() + ". Press Ctrl+Shift+F to search";
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_INDEX);
+
+    // Sftp thread will trigger this callback when indexing in the background failed.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
-        auto r = event.GetPayload<SftpThreadResponseProgress>();
+        auto r = event.GetPayload<SftpThreadResponseError>();
+        this->latest_interesting_status_ = "Indexing failed: " + PrettifySentence(r.error);
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_INDEX_FAILED);
 
+    // Sftp thread will trigger this callback with the size of a dir, as it is being computed and once it is final.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        auto r = event.GetPayload<SftpThreadResponseDirSize>();
+        if (r.dir != this->current_dir_) {
+            return;
+        }
+
+        auto path = normalize_path(r.dir + "/" + r.name);
+        for (auto &entry : this->current_dir_list_) {
+            if (entry.name_ != r.name || !entry.is_dir_) {
+                continue;
+            }
+            entry.size_ = r.bytes;
+            entry.size_computed_ = true;
+            if (r.complete) {
+                this->dir_sizes_[path] = make_pair(entry.modified_, r.bytes);
+            }
+        }
+
+        this->RememberSelected();
+        if (this->sort_column_ == SORT_COLUMN_SIZE) {
+            this->SortAndPopulateDir();
+        } else {
+            this->PopulateDir();
+        }
+        this->RecallSelected();
         this->SetStatusText(wxString::FromUTF8(
-                "Downloading " + r.remote_path + ", " + size_string(r.bytes_done) + " of "
-                + size_string(r.bytes_total) + ", " + size_string(r.bytes_per_sec) + "/sec ... Press Esc to cancel."));
-    }, ID_SFTP_THREAD_RESPONSE_DOWNLOAD_PROGRESS);
+                "Computing size of " + path + ", " + size_string(r.bytes) + " so far ... Press Esc to cancel."));
+    }, ID_SFTP_THREAD_RESPONSE_DIR_SIZE);
+
+    // Sftp thread will trigger this callback once the sizes of all dirs asked for are computed.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->busy_cursor_ = nullptr;
+        auto r = event.GetPayload<SftpThreadResponseDirSizes>();
+
+        uint64_t total = 0;
+        for (auto &entry : this->current_dir_list_) {
+            if (entry.size_computed_) {
+                total += entry.size_;
+            }
+        }
+        this->latest_interesting_status_ = "Computed directory sizes in " + r.dir + ", " + size_string(total)
+                                           + " in total";
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_DIR_SIZES);
+
+    // Sftp thread will trigger this callback once a job over several entries is done, also if it failed for some.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->busy_cursor_ = nullptr;
+        auto r = event.GetPayload<SftpThreadResponseBatch>();
+
+        if (r.job.dir == this->current_dir_) {
+            this->PatchListing(r.result.patch.updated, r.result.patch.removed);
+        }
+
+        string verb;
+        switch (r.job.op) {
+            case BATCH_DELETE: verb = "Deleted"; break;
+            case BATCH_DOWNLOAD: verb = "Downloaded"; break;
+            case BATCH_CHMOD: verb = "Changed permissions of"; break;
+            case BATCH_MOVE: verb = "Moved"; break;
+        }
+        this->latest_interesting_status_ = verb + " " + to_string(r.result.succeeded) + " of "
+                                           + to_string(r.job.names.size()) + " entries";
+        this->SetIdleStatusText();
+
+        if (!r.result.failures.empty()) {
+            string s = "Failed for " + to_string(r.result.failures.size()) + " of " + to_string(r.job.names.size())
+                       + " entries:\n";
+            for (size_t i = 0 ; i < r.result.failures.size() && i < 20 ; ++i) {
+                s += "\n" + r.result.failures[i].name + ": " + r.result.failures[i].error;
+            }
+            if (r.result.failures.size() > 20) {
+                s += "\n...";
+            }
+            wxMessageDialog dialog(this, wxString::FromUTF8(s), "Error", wxOK | wxICON_ERROR | wxCENTER);
+            dialog.ShowModal();
+        }
+    }, ID_SFTP_THREAD_RESPONSE_BATCH);
 
     // Sftp thread will trigger this callback when we need to follow a directory symlink.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
@@ -1014,6 +1483,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
         dialog.SetYesNoLabels("Retry", "Ignore");
         if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
             this->sftp_thread_channel_->Put(r.cmd);
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         } else {
@@ -1030,6 +1500,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
         dialog.SetYesNoLabels("Retry", "Ignore");
         if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
             this->sftp_thread_channel_->Put(r.cmd);
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         } else {
@@ -1046,6 +1517,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
         dialog.SetYesNoLabels("Retry", "Ignore");
         if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
             this->sftp_thread_channel_->Put(r.cmd);
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         } else {
@@ -1067,6 +1539,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
         dialog.SetYesNoLabels("Retry", "Ignore");
         if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
             this->sftp_thread_channel_->Put(r.cmd);
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         } else {
@@ -1088,6 +1561,7 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
         dialog.SetYesNoLabels("Retry", "Ignore");
         if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
             this->sftp_thread_channel_->Put(r.cmd);
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         } else {
@@ -1109,7 +1583,8 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_QUESTION | wxCENTER);
         dialog.SetYesNoLabels("Replace", "Cancel");
         if (dialog.ShowModal() == wxID_YES) {
-            this->sftp_thread_channel_->Put(SftpThreadCmdUploadOverwrite{r.local_path, r.remote_path});
+            this->sftp_thread_channel_->Put(SftpThreadCmdUploadOverwrite{
+                    r.local_path, r.remote_path, this->NewJob("Uploading " + r.remote_path)});
             this->busy_cursor_ = make_unique<wxBusyCursor>();
         }
     }, ID_SFTP_THREAD_RESPONSE_CONFIRM_OVERWRITE);
@@ -1124,7 +1599,8 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
             DirEntry parent_dir_entry;
             parent_dir_entry.name_ = "..";
             parent_dir_entry.is_dir_ = true;
-            this->dir_list_ctrl_->Refresh(vector<DirEntry>{parent_dir_entry});
+            this->current_dir_list_.push_back(parent_dir_entry);
+            this->SortAndPopulateDir();
         }
 
         auto s = wxString::FromUTF8("Permission denied while listing directory " + r.remote_path);
@@ -1141,13 +1617,13 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
 
         // Set highligted to be either after or before the deleted item.
         int highlighted = this->dir_list_ctrl_->GetHighlighted();
-        if (highlighted + 1 < this->current_dir_list_.size()) {
+        if (highlighted + 1 < this->view_.size()) {
             this->dir_list_ctrl_->SetHighlighted(highlighted + 1);
         } else {
             this->dir_list_ctrl_->SetHighlighted(highlighted - 1);
         }
 
-        this->RefreshDir(this->current_dir_, true);
+        this->ApplyChange(event.GetPayload<SftpThreadResponseChanged>());
     }, ID_SFTP_THREAD_RESPONSE_DELETE_SUCCEEDED);
 
     // Sftp thread will trigger this callback when deletion failed.
@@ -1161,6 +1637,23 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
         this->SetStatusText(s);
     }, ID_SFTP_THREAD_RESPONSE_DELETE_FAILED);
 
+    // Sftp thread will trigger this callback when the connection failed in the middle of a command, after reconnecting.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->busy_cursor_ = nullptr;
+        auto r = event.GetPayload<SftpThreadResponseInterrupted>();
+        auto s = wxString::FromUTF8(PrettifySentence(r.error)
+                                    + " The connection was restored, but the operation may not have completed.");
+        wxMessageDialog dialog(this, s, "Error", wxYES_NO | wxICON_ERROR | wxCENTER);
+        dialog.SetYesNoLabels("Retry", "Ignore");
+        if (dialog.ShowModal() == wxID_YES) {
+            this->TrackJob(r.cmd);
+            this->sftp_thread_channel_->Put(r.cmd);
+            this->busy_cursor_ = make_unique<wxBusyCursor>();
+        } else {
+            this->RefreshDir(this->current_dir_, true);  // To show what did take effect.
+        }
+    }, ID_SFTP_THREAD_RESPONSE_INTERRUPTED);
+
     // Sftp thread will trigger this callback when a file or directory was not found.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = nullptr;
@@ -1171,7 +1664,8 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
             DirEntry parent_dir_entry;
             parent_dir_entry.name_ = "..";
             parent_dir_entry.is_dir_ = true;
-            this->dir_list_ctrl_->Refresh(vector<DirEntry>{parent_dir_entry});
+            this->current_dir_list_.push_back(parent_dir_entry);
+            this->SortAndPopulateDir();
         }
 
         auto s = wxString::FromUTF8("File or directory not found: " + r.remote_path);
@@ -1251,13 +1745,27 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = nullptr;
         this->latest_interesting_status_ = "";
+        this->ApplyChange(event.GetPayload<SftpThreadResponseChanged>());
         this->SetIdleStatusText();
-        this->RefreshDir(this->current_dir_, true);
     }, ID_SFTP_THREAD_RESPONSE_SUCCESS);
 
+    // Sftp thread will trigger this callback when the host refused a channel for a command, on a connection that is
+    // otherwise fine.
+    this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
+        this->busy_cursor_ = nullptr;
+        auto r = event.GetPayload<SftpThreadResponseError>();
+        auto s = wxString::FromUTF8(PrettifySentence(r.error)
+                                    + " The host allows no more channels on the connection, which other windows on"
+                                      " the host share. Close some of them, and try again.");
+        wxMessageDialog dialog(this, s, "Error", wxOK | wxICON_ERROR | wxCENTER);
+        dialog.ShowModal();
+        this->SetIdleStatusText();
+    }, ID_SFTP_THREAD_RESPONSE_CHANNEL_REFUSED);
+
     // Sftp thread will trigger this callback on an error that requires us to reconnect.
     this->Bind(wxEVT_THREAD, [&](wxThreadEvent &event) {
         this->busy_cursor_ = make_unique<wxBusyCursor>();
+        this->connected_ = false;
         this->RequestUserAttention(wxUSER_ATTENTION_ERROR);
         auto r = event.GetPayload<SftpThreadResponseError>();
         auto error = PrettifySentence(r.error);
@@ -1283,16 +1791,20 @@ void FileManagerFrame::SetupSftpThreadCallbacks() {
 }
 
 void FileManagerFrame::OnItemActivated() {
-    if (this->busy_cursor_) {
+    // While not connected, directories can still be browsed from the listing cache.
+    if (this->busy_cursor_ && this->connected_) {
         return;
     }
 
-    int item = this->dir_list_ctrl_->GetHighlighted();
-    auto entry = this->current_dir_list_[item];
+    auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+    if (!highlighted) {
+        return;
+    }
+    auto entry = *highlighted;
     auto path = normalize_path(this->current_dir_ + "/" + entry.name_);
     if (entry.is_dir_) {
         this->ChangeDir(path);
-    } else {
+    } else if (this->connected_) {
         this->DownloadFileForEdit(path);
     }
 }
@@ -1308,16 +1820,25 @@ void FileManagerFrame::ChangeDir(string path) {
 
     this->current_dir_ = path;
     this->path_text_ctrl_->SetValue(wxString::FromUTF8(path));
+    this->filter_text_ctrl_->ChangeValue("");
     this->current_dir_list_.clear();
-    this->dir_list_ctrl_->Refresh(vector<DirEntry>{});
+    this->listed_dir_ = "";
+    this->SortAndPopulateDir();
     this->RefreshDir(path, false);
 }
 
 void FileManagerFrame::SetIdleStatusText() {
     string s = to_string(this->current_dir_list_.size()) + " items";
+    if (this->view_.size() != this->current_dir_list_.size()) {
+        s = to_string(this->view_.size()) + " of " + s + " shown";
+    }
     if (!this->latest_interesting_status_.empty()) {
         s += ". " + this->latest_interesting_status_;
     }
+    if (this->listing_cached_at_) {
+        auto d = wxDateTime(static_cast<time_t>(this->listing_cached_at_)).FormatISOCombined(' ');
+        s += ". Cached listing from " + d.ToStdString(wxMBConvUTF8()) + ", may be out of date";
+    }
     this->SetStatusText(wxString::FromUTF8(s));
 }
 
@@ -1333,7 +1854,8 @@ void FileManagerFrame::RefreshTitle() {
 
 void FileManagerFrame::UploadWatchedFile(string remote_path) {
     OpenedFile f = this->opened_files_local_[remote_path];
-    this->sftp_thread_channel_->Put(SftpThreadCmdUploadOverwrite{f.local_path, f.remote_path});
+    this->sftp_thread_channel_->Put(SftpThreadCmdUploadOverwrite{
+            f.local_path, f.remote_path, this->NewJob("Uploading " + f.remote_path)});
     this->opened_files_local_[f.remote_path].upload_requested = true;
     this->SetStatusText(wxString::FromUTF8("Uploading " + f.remote_path + " ... Press Esc to cancel."));
     this->busy_cursor_ = make_unique<wxBusyCursor>();
@@ -1342,7 +1864,8 @@ void FileManagerFrame::UploadWatchedFile(string remote_path) {
 void FileManagerFrame::UploadFile(string local_path) {
     string name = basename(local_path);
     string remote_path = normalize_path(this->current_dir_ + "/" + name);
-    this->sftp_thread_channel_->Put(SftpThreadCmdUpload{local_path, remote_path});
+    this->sftp_thread_channel_->Put(SftpThreadCmdUpload{
+            local_path, remote_path, this->NewJob("Uploading " + remote_path)});
     this->SetStatusText(wxString::FromUTF8("Uploading " + remote_path) + " ... Press Esc to cancel.");
     this->busy_cursor_ = make_unique<wxBusyCursor>();
 }
@@ -1365,22 +1888,27 @@ void FileManagerFrame::OnFileWatcherTimer(const wxTimerEvent &event) {
 }
 
 void FileManagerFrame::RememberSelected() {
-    this->stored_highlighted_ = this->current_dir_list_[this->dir_list_ctrl_->GetHighlighted()].name_;
+    auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+    this->stored_highlighted_ = highlighted ? highlighted->name_ : "";
     this->stored_selected_.clear();
     auto r = this->dir_list_ctrl_->GetSelected();
     for (int i = 0 ; i < r.size() ; ++i) {
-        this->stored_selected_.insert(this->current_dir_list_[r[i]].name_);
+        auto entry = this->EntryAtRow(r[i]);
+        if (entry) {
+            this->stored_selected_.insert(entry->name_);
+        }
     }
 }
 
 void FileManagerFrame::RecallSelected() {
     int highlighted = 0;
     vector<int> selected;
-    for (int i = 0 ; i < this->current_dir_list_.size() ; ++i) {
-        if (this->stored_selected_.find(this->current_dir_list_[i].name_) != this->stored_selected_.end()) {
+    for (int i = 0 ; i < this->view_.size() ; ++i) {
+        const auto &name = this->current_dir_list_[this->view_[i]].name_;
+        if (this->stored_selected_.find(name) != this->stored_selected_.end()) {
             selected.push_back(i);
         }
-        if (this->current_dir_list_[i].name_ == this->stored_highlighted_) {
+        if (name == this->stored_highlighted_) {
             highlighted = i;
         }
     }
@@ -1388,7 +1916,12 @@ void FileManagerFrame::RecallSelected() {
     this->dir_list_ctrl_->SetSelected(selected);
 }
 
-void FileManagerFrame::RefreshDir(string remote_path, bool preserve_selection) {
+void FileManagerFrame::RefreshDir(string remote_path, bool preserve_selection, bool force) {
+    if (!this->connected_) {
+        this->ShowCachedDir(remote_path);
+        return;
+    }
+
     if (this->busy_cursor_) {
         return;
     } else {
@@ -1404,60 +1937,321 @@ void FileManagerFrame::RefreshDir(string remote_path, bool preserve_selection) {
         this->stored_highlighted_ = "";
     }
 
-    this->current_dir_list_.clear();
+    // The entries shown stay up while checking whether they are still current.
+    optional<DirEntry> shown;
+    if (!force && remote_path == this->listed_dir_ && this->listing_cached_at_ == 0) {
+        shown = this->listed_dir_entry_;
+    }
+    if (!shown.has_value()) {
+        this->current_dir_list_.clear();
+        this->SortAndPopulateDir();
+    }
+
+    bool watch = this->config_->Read("/watch_dir", false);
+    this->sftp_thread_channel_->Put(SftpThreadCmdGetDir{remote_path, watch, shown});
+}
+
+void FileManagerFrame::ApplyChange(const SftpThreadResponseChanged &change) {
+    if (change.dir.empty() || change.dir != this->current_dir_ || change.dir != this->listed_dir_) {
+        this->RefreshDir(this->current_dir_, true);
+        return;
+    }
+    this->PatchListing(change.patch.updated, change.patch.removed);
+}
+
+void FileManagerFrame::PatchListing(const vector<DirEntry> &updated, const vector<string> &removed) {
+    this->RememberSelected();
+    if (removed.size() == 1 && updated.size() == 1 && this->stored_highlighted_ == removed[0]) {
+        this->stored_highlighted_ = updated[0].name_;  // Follow a renamed entry.
+    }
+
+    // The listing is already sorted, so only the touched entries are taken out and put back in their place.
+    auto &list = this->current_dir_list_;
+    auto find = [&](const string &name) {
+        return find_if(list.begin(), list.end(), [&](const DirEntry &e) { return e.name_ == name; });
+    };
+    // A rename keeps the owner and group, which the new entry may not come with.
+    const string *renamed_owner = nullptr;
+    const string *renamed_group = nullptr;
+    if (removed.size() == 1 && updated.size() == 1) {
+        auto it = find(removed[0]);
+        if (it != list.end()) {
+            renamed_owner = it->owner_;
+            renamed_group = it->group_;
+        }
+    }
+    for (auto &name : removed) {
+        auto it = find(name);
+        if (it != list.end()) {
+            list.erase(it);
+        }
+    }
+    for (auto entry : updated) {
+        auto it = find(entry.name_);
+        if (it != list.end()) {
+            if (!entry.owner_) {
+                entry.owner_ = it->owner_;  // Not known from an SFTP stat, and rarely what changed.
+                entry.group_ = it->group_;
+            }
+            list.erase(it);
+        } else if (!entry.owner_) {
+            entry.owner_ = renamed_owner;
+            entry.group_ = renamed_group;
+        }
+        this->ApplyDirSize(&entry);
+        auto pos = DirEntryInsertPosition(list, entry, this->sort_column_, this->sort_desc_);
+        list.insert(list.begin() + pos, entry);
+    }
+
+    if (this->listing_cached_at_ == 0) {
+        this->dir_cache_->Put(this->current_dir_, list);
+    }
+    this->name_filter_stale_ = true;
+    this->PopulateDir();
+    this->RecallSelected();
+}
+
+void FileManagerFrame::ShowCachedDir(string remote_path) {
+    auto cached = this->dir_cache_ ? this->dir_cache_->Get(remote_path) : nullopt;
+    if (cached.has_value()) {
+        this->current_dir_list_ = std::move(cached->entries);
+        this->listing_cached_at_ = cached->saved_at;
+        this->listed_dir_ = remote_path;
+    } else {
+        // Make a dummy parent dir entry to make it easy to get back to the parent dir.
+        DirEntry parent_dir_entry;
+        parent_dir_entry.name_ = "..";
+        parent_dir_entry.is_dir_ = true;
+        this->current_dir_list_ = vector<DirEntry>{parent_dir_entry};
+        this->listing_cached_at_ = 0;
+        this->listed_dir_ = "";
+    }
+
+    this->listed_dir_entry_ = nullopt;
+    this->path_text_ctrl_->SetValue(wxString::FromUTF8(remote_path));
     this->SortAndPopulateDir();
+    this->dir_list_ctrl_->SetHighlighted(0);
+    if (cached.has_value()) {
+        this->SetIdleStatusText();
+    } else {
+        this->SetStatusText(wxString::FromUTF8("Not connected, and no cached listing of " + remote_path + "."));
+    }
+}
+
+void FileManagerFrame::LoadRemoteIndex() {
+    if (this->remote_index_loaded_) {
+        return;
+    }
+    this->remote_index_loaded_ = true;
 
-    this->sftp_thread_channel_->Put(SftpThreadCmdGetDir{remote_path});
+    auto index = make_shared<RemoteIndex>();
+    if (index->Load(RemoteIndex::PathForHost(this->host_desc_.ToString()))) {
+        this->remote_index_ = index;
+    }
+}
+
+void FileManagerFrame::SearchRemoteIndex() {
+    this->LoadRemoteIndex();
+    if (!this->remote_index_) {
+        wxMessageBox("There is no index of this host yet. Create one with Go > Index remote tree.",
+                     "Search index", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+
+    auto root = this->remote_index_->Root();
+    wxTextEntryDialog dialog(
+            this,
+            "Search for (text, *.glob or ~fuzzy):",
+            wxString::FromUTF8("Search index of " + root));
+    if (dialog.ShowModal() != wxID_OK) {
+        return;
+    }
+    string query = dialog.GetValue().ToStdString(wxMBConvUTF8());
+
+    auto start = steady_clock::now();
+    auto hits = this->remote_index_->Search(query, 1000);
+    auto took = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    if (hits.empty()) {
+        wxMessageBox(wxString::FromUTF8("No matches for " + query + " under " + root + "."),
+                     "Search index", wxOK | wxICON_INFORMATION, this);
+        return;
+    }
+
+    wxArrayString choices;
+    for (auto &hit : hits) {
+        choices.Add(wxString::FromUTF8(hit.is_dir ? hit.path + "/" : hit.path));
+    }
+    auto indexed_at = wxDateTime(static_cast<time_t>(this->remote_index_->BuiltAt())).FormatISOCombined(' ');
+    string msg = to_string(hits.size()) + (hits.size() == 1000 ? "+" : "") + " matches in " + to_string(took) + " ms";
+    msg += ", from index of " + root + " made at " + indexed_at.ToStdString(wxMBConvUTF8()) + ":";
+    wxSingleChoiceDialog results(this, wxString::FromUTF8(msg), "Search results", choices);
+    results.SetSize(this->FromDIP(wxSize(700, 500)));
+    if (results.ShowModal() != wxID_OK) {
+        return;
+    }
+
+    auto &hit = hits[results.GetSelection()];
+    if (hit.is_dir) {
+        this->ChangeDir(hit.path);
+    } else {
+        this->ChangeDir(normalize_path(hit.path + "/.."));
+        this->stored_highlighted_ = basename(hit.path);
+    }
+}
+
+void FileManagerFrame::ApplyDirSize(DirEntry *entry) {
+    if (!entry->is_dir_ || entry->size_computed_ || this->dir_sizes_.empty()) {
+        return;
+    }
+    auto it = this->dir_sizes_.find(normalize_path(this->current_dir_ + "/" + entry->name_));
+    if (it != this->dir_sizes_.end() && it->second.first == entry->modified_) {
+        entry->size_ = it->second.second;
+        entry->size_computed_ = true;
+    }
+}
+
+// Computes all of them again, also those with a total from before, as changes deeper down do not show in the
+// modification times that dir_sizes_ goes by.
+void FileManagerFrame::RequestDirSizes() {
+    vector<string> names;
+    for (auto &entry : this->current_dir_list_) {
+        // Symlinked dirs are left out, as their contents are counted wherever they really are.
+        if (entry.is_dir_ && entry.name_ != ".." && !LIBSSH2_SFTP_S_ISLNK(entry.mode_)) {
+            names.push_back(entry.name_);
+        }
+    }
+
+    if (names.empty()) {
+        this->latest_interesting_status_ = "No directories in " + this->current_dir_ + " to compute the sizes of";
+        this->SetIdleStatusText();
+        return;
+    }
+
+    this->sftp_thread_channel_->Put(SftpThreadCmdDirSizes{
+            this->current_dir_, names, this->NewJob("Computing directory sizes in " + this->current_dir_)});
+    this->SetStatusText(wxString::FromUTF8("Computing directory sizes in " + this->current_dir_
+                                           + " ... Press Esc to cancel."));
+    this->busy_cursor_ = make_unique<wxBusyCursor>();
 }
 
 void FileManagerFrame::SortAndPopulateDir() {
-    auto cmp = [&](const DirEntry &a, const DirEntry &b) {
-        if (a.name_ == "..") { return true; }
-        if (b.name_ == "..") { return false; }
-        if (a.is_dir_ && !b.is_dir_) { return true; }
-        if (!a.is_dir_ && b.is_dir_) { return false; }
-
-        string a_val, b_val;
-        if (this->sort_column_ == 1) {
-            if (this->sort_desc_) {
-                return a.size_ > b.size_;
-            }
-            return a.size_ < b.size_;
-        } else if (this->sort_column_ == 2) {
-            if (this->sort_desc_) {
-                return a.modified_ > b.modified_;
-            }
-            return a.modified_ < b.modified_;
-        } else if (this->sort_column_ == 3) {
-            if (this->sort_desc_) {
-                return a.mode_str_ > b.mode_str_;
-            }
-            return a.mode_str_ < b.mode_str_;
-        } else if (this->sort_column_ == 4) {
-            if (this->sort_desc_) {
-                return a.owner_ > b.owner_;
-            }
-            return a.owner_ < b.owner_;
-        } else if (this->sort_column_ == 5) {
-            if (this->sort_desc_) {
-                return a.group_ > b.group_;
-            }
-            return a.group_ < b.group_;
+    for (auto &entry : this->current_dir_list_) {
+        this->ApplyDirSize(&entry);
+    }
+    SortDirEntries(&this->current_dir_list_, this->sort_column_, this->sort_desc_);
+    this->name_filter_stale_ = true;
+    this->PopulateDir();
+}
+
+// Shows the entries of current_dir_list_ that match the filter text, without copying the entries themselves.
+void FileManagerFrame::PopulateDir() {
+    string query = this->filter_text_ctrl_->GetValue().ToStdString(wxMBConvUTF8());
+    if (query.empty()) {
+        this->view_.resize(this->current_dir_list_.size());
+        for (int i = 0 ; i < this->view_.size() ; ++i) {
+            this->view_[i] = i;
+        }
+    } else {
+        if (this->name_filter_stale_) {
+            this->name_filter_.Build(this->current_dir_list_);
+            this->name_filter_stale_ = false;
         }
+        this->view_ = this->name_filter_.Filter(query);
+    }
+
+    this->dir_list_ctrl_->Refresh(this->current_dir_list_, this->view_);
+}
+
+DirEntry *FileManagerFrame::EntryAtRow(int row) {
+    if (row < 0 || row >= this->view_.size()) {
+        return nullptr;
+    }
+    return &this->current_dir_list_[this->view_[row]];
+}
 
-        // Assume sort_column == 0.
-        if (a.name_.length() > 0 && b.name_.length() > 0 && a.name_[0] == '.' &&
-            b.name_[0] != '.') { return true; }
-        if (a.name_.length() > 0 && b.name_.length() > 0 && a.name_[0] != '.' &&
-            b.name_[0] == '.') { return false; }
-        if (this->sort_desc_) {
-            return a.name_ > b.name_;
+vector<string> FileManagerFrame::SelectedNames() {
+    vector<string> names;
+    for (int row : this->dir_list_ctrl_->GetSelected()) {
+        auto entry = this->EntryAtRow(row);
+        if (entry && entry->name_ != "..") {
+            names.push_back(entry->name_);
         }
-        return a.name_ < b.name_;
-    };
-    sort(this->current_dir_list_.begin(), this->current_dir_list_.end(), cmp);
+    }
+    if (names.empty()) {
+        auto highlighted = this->EntryAtRow(this->dir_list_ctrl_->GetHighlighted());
+        if (highlighted && highlighted->name_ != "..") {
+            names.push_back(highlighted->name_);
+        }
+    }
+    return names;
+}
+
+void FileManagerFrame::StartBatchJob(BatchJob job) {
+    string verb;
+    switch (job.op) {
+        case BATCH_DELETE: verb = "Deleting "; break;
+        case BATCH_DOWNLOAD: verb = "Downloading "; break;
+        case BATCH_CHMOD: verb = "Changing permissions of "; break;
+        case BATCH_MOVE: verb = "Moving "; break;
+    }
+    auto description = verb + to_string(job.names.size()) + " entries in " + job.dir;
+    this->sftp_thread_channel_->Put(SftpThreadCmdBatch{job, this->NewJob(description)});
+    this->SetStatusText(wxString::FromUTF8(
+            "Working on " + to_string(job.names.size()) + " entries ... Press Esc to cancel."));
+    this->busy_cursor_ = make_unique<wxBusyCursor>();
+}
 
-    this->dir_list_ctrl_->Refresh(this->current_dir_list_);
+shared_ptr<JobHandle> FileManagerFrame::NewJob(string description) {
+    auto job = make_shared<JobHandle>(this->next_job_id_++, description);
+    this->jobs_[job->id_] = job;
+    if (!this->progress_timer_.IsRunning()) {
+        this->progress_timer_.Start(500);
+    }
+    return job;
+}
+
+void FileManagerFrame::TrackJob(const threadFuncVariant &cmd) {
+    auto job = JobOf(cmd);
+    if (job) {
+        this->jobs_[job->id_] = job;
+        if (!this->progress_timer_.IsRunning()) {
+            this->progress_timer_.Start(500);
+        }
+    }
+}
+
+void FileManagerFrame::ShowJobProgress() {
+    if (this->jobs_.empty()) {
+        return;
+    }
+    // The sftp thread does jobs in the order they were sent, so the one with the lowest id is the one in progress.
+    auto &job = this->jobs_.begin()->second;
+    auto p = job->Sample(steady_clock::now());
+
+    string s = job->description_;
+    if (p.items_total > 0) {
+        s += ", " + to_string(p.items_done) + " of " + to_string(p.items_total) + " entries";
+    } else if (p.items_done > 0) {
+        s += ", " + to_string(p.items_done) + " entries so far";
+    }
+    if (p.bytes_total > 0) {
+        s += ", " + size_string(p.bytes_done) + " of " + size_string(p.bytes_total);
+    }
+    if (p.bytes_per_sec > 0) {
+        s += ", " + size_string(p.bytes_per_sec) + "/sec";
+    }
+    if (p.eta_secs >= 60) {
+        s += ", about " + to_string((p.eta_secs + 30) / 60) + " min left";
+    } else if (p.eta_secs >= 0) {
+        s += ", about " + to_string(p.eta_secs) + " sec left";
+    }
+    if (this->jobs_.size() > 1) {
+        s += ", " + to_string(this->jobs_.size() - 1) + " more waiting";
+    }
+    s += job->Cancelled() ? " ... Cancelling." : " ... Press Esc to cancel.";
+
+    this->progress_status_ = s;
+    this->SetStatusText(wxString::FromUTF8(s));
 }
 
 void FileManagerFrame::DownloadFileForEdit(string remote_path) {
@@ -1474,14 +2268,16 @@ void FileManagerFrame::DownloadFileForEdit(string remote_path) {
     // TODO(allan): handle local file creation error separately from a connection errors
     create_directories(localPathUnicode(local_dir));
 
-    this->sftp_thread_channel_->Put(SftpThreadCmdDownload{local_path, remote_path, true});
+    this->sftp_thread_channel_->Put(SftpThreadCmdDownload{
+            local_path, remote_path, true, this->NewJob("Downloading " + remote_path)});
     this->SetStatusText(wxString::FromUTF8("Downloading " + remote_path) + " ... Press Esc to cancel.");
     this->busy_cursor_ = make_unique<wxBusyCursor>();
 }
 
 void FileManagerFrame::DownloadFile(string remote_path, string local_path) {
     remote_path = normalize_path(remote_path);
-    this->sftp_thread_channel_->Put(SftpThreadCmdDownload{local_path, remote_path, false});
+    this->sftp_thread_channel_->Put(SftpThreadCmdDownload{
+            local_path, remote_path, false, this->NewJob("Downloading " + remote_path)});
     this->SetStatusText(wxString::FromUTF8("Downloading " + remote_path) + " ... Press Esc to cancel.");
     this->busy_cursor_ = make_unique<wxBusyCursor>();
 }
@@ -17,10 +17,12 @@
 #include <future>  // NOLINT
 #include <map>
 #include <memory>
+#include <optional>
 #include <regex>  // NOLINT
 #include <stack>
 #include <string>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #ifndef __WXOSX__
@@ -30,14 +32,20 @@
 #endif
 
 #include "src/channel.h"
+#include "src/dircache.h"
 #include "src/direntry.h"
 #include "src/dirlistctrl.h"
 #include "src/hostdesc.h"
+#include "src/jobhandle.h"
+#include "src/namefilter.h"
+#include "src/remoteindex.h"
 #include "src/sftpthread.h"
 
 using std::future;
 using std::make_shared;
 using std::map;
+using std::optional;
+using std::pair;
 using std::regex;
 using std::regex_search;
 using std::shared_ptr;
@@ -64,17 +72,33 @@ class FileManagerFrame : public wxFrame {
     HostDesc host_desc_;
     wxSecretValue passwd_param_;
     string local_tmp_;
+    string local_tmp_root_;  // As given to Connect, without the sub dir for the host.
     wxConfigBase *config_;
     wxToolBarBase *tool_bar_;
     wxToolBarToolBase *sudo_btn_;
     DirListCtrl *dir_list_ctrl_;
     wxTextCtrl *path_text_ctrl_;
+    wxTextCtrl *filter_text_ctrl_;
     wxTimer file_watcher_timer_;
     string home_dir_;
     string current_dir_;
     stack<string> prev_dirs_;
     stack<string> fwd_dirs_;
     vector<DirEntry> current_dir_list_;
+    NameFilter name_filter_;
+    bool name_filter_stale_ = true;
+    vector<int> view_;  // Indexes into current_dir_list_ of the rows currently shown, after filtering.
+    unique_ptr<DirCache> dir_cache_;
+    uint64_t listing_cached_at_ = 0;  // When the shown listing was retrieved, if it came from dir_cache_. Otherwise 0.
+    string listed_dir_;  // The dir current_dir_list_ was last retrieved for.
+    optional<DirEntry> listed_dir_entry_;  // Attributes of listed_dir_ itself as of that listing, if known.
+    bool connected_ = false;
+    shared_ptr<RemoteIndex> remote_index_;  // Loaded from disk on first use. See LoadRemoteIndex.
+    bool remote_index_loaded_ = false;
+    // Computed total sizes of dirs by path, each with the modification time the dir had when it was computed. Changes
+    // deeper down do not change that time, so these are only for showing again when coming back to a dir, and can be
+    // out of date until computed again.
+    map<string, pair<uint64_t, uint64_t>> dir_sizes_;
     int sort_column_ = 0;
     bool sort_desc_ = false;
     map<string, OpenedFile> opened_files_local_;
@@ -82,7 +106,10 @@ class FileManagerFrame : public wxFrame {
     unordered_set<string> stored_selected_;
     unique_ptr<future<void>> sftp_thread_;
     shared_ptr<Channel<threadFuncVariant>> sftp_thread_channel_ = make_shared<Channel<threadFuncVariant>>();
-    shared_ptr<Channel<bool>> cancellation_channel_ = make_shared<Channel<bool>>();
+    map<uint64_t, shared_ptr<JobHandle>> jobs_;  // Jobs sent to the sftp thread that can still be cancelled.
+    uint64_t next_job_id_ = 1;
+    wxTimer progress_timer_;  // Samples the progress of jobs_ while there are any.
+    string progress_status_;  // Status text last shown for that, to tell if anything has replaced it since.
     wxTimer reconnect_timer_;
     int reconnect_timer_countdown_;
     string reconnect_timer_error_ = "";
@@ -104,6 +131,9 @@ private:
 
     void SetIdleStatusText();
 
+    // Shows how the job at the front of jobs_ is getting on, and how many are waiting behind it.
+    void ShowJobProgress();
+
     void RefreshTitle();
 
     void UploadWatchedFile(string remote_path);
@@ -116,10 +146,44 @@ private:
 
     void RecallSelected();
 
-    void RefreshDir(string remote_path, bool preserve_selection);
+    // Unless forced, the listing is only retrieved again if the attributes of the dir changed since it was shown.
+    void RefreshDir(string remote_path, bool preserve_selection, bool force = false);
+
+    // Updates current_dir_list_ in place, with entries keyed by name, keeping it sorted.
+    void PatchListing(const vector<DirEntry> &updated, const vector<string> &removed);
+
+    // Patches the listing with a change we made ourselves, or retrieves it again if the change can not be applied.
+    void ApplyChange(const SftpThreadResponseChanged &change);
+
+    void ShowCachedDir(string remote_path);
+
+    void LoadRemoteIndex();
+
+    void SearchRemoteIndex();
+
+    // Sets the size of entry, a dir in the current dir, to its computed total size if that is known for its current
+    // modification time.
+    void ApplyDirSize(DirEntry *entry);
+
+    void RequestDirSizes();
 
     void SortAndPopulateDir();
 
+    void PopulateDir();
+
+    DirEntry *EntryAtRow(int row);
+
+    // Names of the selected entries, or of the highlighted one if none are selected. Never includes "..".
+    vector<string> SelectedNames();
+
+    void StartBatchJob(BatchJob job);
+
+    // Creates the handle for a new job, and lists it among the jobs that can be cancelled.
+    shared_ptr<JobHandle> NewJob(string description);
+
+    // Lists the job of cmd again, when it is sent again, for example to retry it.
+    void TrackJob(const threadFuncVariant &cmd);
+
     void DownloadFileForEdit(string remote_path);
 
     void DownloadFile(string remote_path, string local_path);
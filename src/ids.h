@@ -14,6 +14,15 @@
 #define ID_MKDIR 90
 #define ID_SUDO 100
 #define ID_START_NEW_INSTANCE 110
+#define ID_FILTER 120
+#define ID_INDEX 130
+#define ID_SEARCH_INDEX 140
+#define ID_COMPUTE_SIZE 150
+#define ID_MOVE 160
+#define ID_CHMOD 170
+#define ID_JOBS 180
+#define ID_NEW_WINDOW 190
+#define ID_CONNECT_OTHER_HOST 200
 
 #define ID_SFTP_THREAD_RESPONSE_CONNECTED 510
 #define ID_SFTP_THREAD_RESPONSE_GET_DIR 520
@@ -42,8 +51,16 @@
 #define ID_SFTP_THREAD_RESPONSE_SUDO_SUCCEEDED 750
 #define ID_SFTP_THREAD_RESPONSE_SUDO_FAILED 760
 #define ID_SFTP_THREAD_RESPONSE_SUDO_EXIT_SUCCEEDED 770
-#define ID_SFTP_THREAD_RESPONSE_UPLOAD_PROGRESS 780
-#define ID_SFTP_THREAD_RESPONSE_DOWNLOAD_PROGRESS 790
+#define ID_SFTP_THREAD_RESPONSE_INDEX 800
+#define ID_SFTP_THREAD_RESPONSE_DIR_PATCH 820
+#define ID_SFTP_THREAD_RESPONSE_DIR_UNCHANGED 830
+#define ID_SFTP_THREAD_RESPONSE_DIR_SIZE 840
+#define ID_SFTP_THREAD_RESPONSE_DIR_SIZES 850
+#define ID_SFTP_THREAD_RESPONSE_BATCH 870
+#define ID_SFTP_THREAD_RESPONSE_JOB_DONE 880
+#define ID_SFTP_THREAD_RESPONSE_INTERRUPTED 890
+#define ID_SFTP_THREAD_RESPONSE_INDEX_FAILED 900
+#define ID_SFTP_THREAD_RESPONSE_CHANNEL_REFUSED 910
 
 
 #endif  // SRC_IDS_H_
@@ -0,0 +1,97 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_JOBHANDLE_H_
+#define SRC_JOBHANDLE_H_
+
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <string>
+
+using std::atomic;
+using std::chrono::steady_clock;
+using std::string;
+
+#define JOB_RATE_SMOOTHING 0.3  // Weight of the latest sample in the smoothed rate. Lower is smoother but slower.
+
+struct JobProgress {
+    uint64_t bytes_done;
+    uint64_t bytes_total;  // 0 if the job does not count bytes.
+    uint64_t items_done;
+    uint64_t items_total;  // 0 if not known up front.
+    uint64_t bytes_per_sec;
+    int64_t eta_secs;  // -1 if not known.
+};
+
+// Handle for one job of the sftp thread, shared between the UI thread and the sftp thread.
+//
+// The UI thread cancels the job through it, and the sftp thread checks that in its transfer loops. The sftp thread
+// stores the job's progress in it as it goes, and the UI thread samples that on a timer, rather than the sftp thread
+// queuing an event for every chunk. Both are single relaxed atomic operations, so they can be done for every chunk.
+class JobHandle {
+    atomic<bool> cancelled_{false};
+    atomic<uint64_t> bytes_done_{0};
+    atomic<uint64_t> bytes_total_{0};
+    atomic<uint64_t> items_done_{0};
+    atomic<uint64_t> items_total_{0};
+
+    // Only touched by Sample, on the UI thread.
+    steady_clock::time_point sampled_at_;
+    uint64_t sampled_bytes_ = 0;
+    double bytes_per_sec_ = 0;
+
+public:
+    const uint64_t id_;
+    const string description_;  // For showing the job in a list, for example "Downloading /etc/hosts".
+
+    JobHandle(uint64_t id, string description) : id_(id), description_(description) {}
+
+    void Cancel() {
+        this->cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool Cancelled() const {
+        return this->cancelled_.load(std::memory_order_relaxed);
+    }
+
+    void SetBytes(uint64_t done, uint64_t total) {
+        this->bytes_done_.store(done, std::memory_order_relaxed);
+        this->bytes_total_.store(total, std::memory_order_relaxed);
+    }
+
+    void SetItems(uint64_t done, uint64_t total) {
+        this->items_done_.store(done, std::memory_order_relaxed);
+        this->items_total_.store(total, std::memory_order_relaxed);
+    }
+
+    // Reads the progress so far, and updates the rate with the bytes done since the previous call. The rate is an
+    // exponentially weighted moving average, so it does not jump around with every hiccup of the connection.
+    JobProgress Sample(steady_clock::time_point now) {
+        JobProgress p{
+                this->bytes_done_.load(std::memory_order_relaxed),
+                this->bytes_total_.load(std::memory_order_relaxed),
+                this->items_done_.load(std::memory_order_relaxed),
+                this->items_total_.load(std::memory_order_relaxed),
+                0,
+                -1};
+
+        if (this->sampled_at_ != steady_clock::time_point() && p.bytes_done >= this->sampled_bytes_) {
+            double secs = std::chrono::duration<double>(now - this->sampled_at_).count();
+            if (secs > 0) {
+                double rate = static_cast<double>(p.bytes_done - this->sampled_bytes_) / secs;
+                this->bytes_per_sec_ = this->bytes_per_sec_ == 0
+                                       ? rate
+                                       : JOB_RATE_SMOOTHING * rate + (1 - JOB_RATE_SMOOTHING) * this->bytes_per_sec_;
+            }
+        }
+        this->sampled_at_ = now;
+        this->sampled_bytes_ = p.bytes_done;
+
+        p.bytes_per_sec = static_cast<uint64_t>(this->bytes_per_sec_);
+        if (p.bytes_per_sec > 0 && p.bytes_total >= p.bytes_done) {
+            p.eta_secs = static_cast<int64_t>((p.bytes_total - p.bytes_done) / p.bytes_per_sec);
+        }
+        return p;
+    }
+};
+
+#endif  // SRC_JOBHANDLE_H_
@@ -19,6 +19,7 @@
 #include <winsock2.h>  // Several header files include windows.h, but winsock2.h needs to come first.
 #endif
 
+#include <libssh2.h>
 #include <wx/artprov.h>
 #include <wx/cmdline.h>
 #include <wx/fileconf.h>
@@ -35,7 +36,10 @@
 #include "src/filemanagerframe.h"
 #include "src/hostdesc.h"
 #include "src/paths.h"
+#include "src/prewarm.h"
+#include "src/sessionhandoff.h"
 #include "src/string.h"
+#include "src/transferscheduler.h"
 
 using std::cerr;
 using std::endl;
@@ -57,6 +61,8 @@ using std::filesystem::remove_all;
 #include "src/filesystem.osx.polyfills.h"
 #endif
 
+#define EXIT_PREWARM_WAIT_MS 3000  // Longest to wait on exit for background connections to finish. See StopPrewarming.
+
 static void showException() {
     wxString error;
     try {
@@ -109,6 +115,19 @@ public:
             if (!wxApp::OnInit())
                 return false;
 
+            // Once for the process, rather than per connection, as connections are made and destroyed on several
+            // threads at once, and these are not thread safe.
+#ifdef __WXMSW__
+            WSADATA wsadata;
+            int wsa_rc = WSAStartup(MAKEWORD(2, 0), &wsadata);
+            if (wsa_rc != 0) {
+                throw runtime_error("WSAStartup failed (" + to_string(wsa_rc) + ")");
+            }
+#endif
+            if (libssh2_init(-1) != 0) {
+                throw runtime_error("libssh2_init failed");
+            }
+
             wxInitAllImageHandlers();
 #ifdef __WXOSX__
             // The built-in art providers on wxMac don't have enough scaled versions and are therefore ugly...
@@ -128,6 +147,10 @@ public:
             config->SetRecordDefaults();
             wxConfigBase::Set(config);
 
+            // For all windows, whichever host they are on.
+            SetTransferLimits(config->Read("/max_concurrent_transfers", MAX_CONCURRENT_TRANSFERS_DEFAULT),
+                              static_cast<uint64_t>(config->Read("/max_transfer_rate_kib", 0)) * 1024);
+
             // Note: wxWdigets takes care of deleting this at shutdown.
             auto frame = new FileManagerFrame(config);
             frame->Show();
@@ -137,12 +160,20 @@ public:
                 connect_dialog->ShowModal();
                 connect_dialog->Destroy();
                 if (!connect_dialog->connect_) {
+                    DiscardPrewarmedConnection();  // Rather than wait for it on exit.
                     frame->Close(true);
                     return true;  // Exit button or ESC was pressed. Not an error.
                 }
                 this->host_desc_ = connect_dialog->host_desc_;
             }
 
+            // An instance already connected to the host opens a window on it instead, over the session it has.
+            if (RequestWindowFromOwner(this->host_desc_)) {
+                DiscardPrewarmedConnection();
+                frame->Close(true);
+                return true;
+            }
+
             frame->Connect(this->host_desc_, this->passwd_param_, local_tmp);
         } catch (...) {
             showException();
@@ -153,6 +184,16 @@ public:
     }
 
     int OnExit() {
+        StopServingWindowRequests();
+        // Connections the connect dialog started in the background may still be connecting or disconnecting. If so
+        // for long, the process is left to end without shutting down libssh2 under them.
+        if (StopPrewarming(EXIT_PREWARM_WAIT_MS)) {
+            libssh2_exit();
+#ifdef __WXMSW__
+            WSACleanup();
+#endif
+        }
+
         // Clean up our tmp directory.
         auto local_tmp = string(wxStandardPaths::Get().GetTempDir());
         local_tmp = normalize_path(local_tmp + "/filesremote_" + to_string(wxGetProcessId()));
@@ -0,0 +1,158 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/namefilter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/direntry.h"
+
+using std::boyer_moore_horspool_searcher;
+using std::search;
+using std::string;
+using std::string_view;
+using std::upper_bound;
+using std::vector;
+
+static inline char foldCase(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static string foldCase(string s) {
+    for (auto &c : s) {
+        c = foldCase(c);
+    }
+    return s;
+}
+
+// Iterative wildcard matching with single backtracking point, which is linear for typical patterns.
+static bool globMatch(string_view pattern, string_view s) {
+    size_t p = 0, i = 0;
+    size_t star = string_view::npos, star_i = 0;
+    while (i < s.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == s[i])) {
+            p++;
+            i++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            star_i = i;
+        } else if (star != string_view::npos) {
+            p = star + 1;
+            i = ++star_i;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+static bool subsequenceMatch(string_view needle, string_view s) {
+    const char *cur = s.data();
+    const char *end = s.data() + s.size();
+    for (char c : needle) {
+        cur = static_cast<const char *>(memchr(cur, c, end - cur));
+        if (!cur) {
+            return false;
+        }
+        cur++;
+    }
+    return true;
+}
+
+void NameFilter::Build(const vector<DirEntry> &entries) {
+    this->Clear();
+    this->starts_.reserve(entries.size());
+    for (const auto &e : entries) {
+        this->Add(e.name_);
+    }
+}
+
+void NameFilter::Clear() {
+    this->names_.clear();
+    this->starts_.clear();
+}
+
+void NameFilter::Add(string_view name) {
+    this->starts_.push_back(this->names_.size());
+    for (char c : name) {
+        this->names_.push_back(foldCase(c));
+    }
+    this->names_.push_back('\0');
+}
+
+size_t NameFilter::Size() const {
+    return this->starts_.size();
+}
+
+string_view NameFilter::Name(size_t i) const {
+    size_t start = this->starts_[i];
+    size_t end = i + 1 < this->starts_.size() ? this->starts_[i + 1] : this->names_.size();
+    return string_view(this->names_.data() + start, end - start - 1);  // Minus the null terminator.
+}
+
+vector<int> NameFilter::Filter(const string &query) const {
+    vector<int> r;
+    if (query.empty()) {
+        r.reserve(this->starts_.size());
+        for (size_t i = 0 ; i < this->starts_.size() ; ++i) {
+            r.push_back(i);
+        }
+        return r;
+    }
+
+    string q = foldCase(query);
+    if (q.find_first_of("*?") != string::npos) {
+        for (size_t i = 0 ; i < this->starts_.size() ; ++i) {
+            if (globMatch(q, this->Name(i))) {
+                r.push_back(i);
+            }
+        }
+        return r;
+    }
+
+    if (q[0] == '~') {
+        string_view needle = string_view(q).substr(1);
+        for (size_t i = 0 ; i < this->starts_.size() ; ++i) {
+            if (subsequenceMatch(needle, this->Name(i))) {
+                r.push_back(i);
+            }
+        }
+        return r;
+    }
+
+    return this->FilterSubstring(q);
+}
+
+// Searches all names at once rather than name by name. The null terminators between names can never be part of a
+// match, so every hit lies within a single name.
+vector<int> NameFilter::FilterSubstring(const string &needle) const {
+    vector<int> r;
+    boyer_moore_horspool_searcher searcher(needle.begin(), needle.end());
+    auto begin = this->names_.begin();
+    auto end = this->names_.end();
+    auto it = begin;
+    while (true) {
+        it = search(it, end, searcher);
+        if (it == end) {
+            break;
+        }
+
+        size_t pos = it - begin;
+        size_t i = upper_bound(this->starts_.begin(), this->starts_.end(), pos) - this->starts_.begin() - 1;
+        r.push_back(i);
+
+        // Continue from the next name, as this one already matched.
+        if (i + 1 >= this->starts_.size()) {
+            break;
+        }
+        it = begin + this->starts_[i + 1];
+    }
+    return r;
+}
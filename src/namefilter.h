@@ -0,0 +1,42 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_NAMEFILTER_H_
+#define SRC_NAMEFILTER_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/direntry.h"
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+// Filters the names of a directory listing, case insensitively for ASCII. A query containing * or ? is a glob that
+// must match the whole name, a query starting with ~ matches names containing the rest of the query as a
+// subsequence, and anything else matches names containing the query as a substring.
+class NameFilter {
+    string names_;  // All names lowercased, each terminated by a null char, so they can be searched in one pass.
+    vector<size_t> starts_;  // Offset into names_ of each entry's name.
+
+public:
+    void Build(const vector<DirEntry> &entries);
+
+    void Clear();
+
+    // Appends a name, which gets the next index.
+    void Add(string_view name);
+
+    size_t Size() const;
+
+    // Returns the indexes of the matching entries, in listing order.
+    vector<int> Filter(const string &query) const;
+
+private:
+    vector<int> FilterSubstring(const string &needle) const;
+
+    string_view Name(size_t i) const;
+};
+
+#endif  // SRC_NAMEFILTER_H_
@@ -3,17 +3,49 @@
 #include "src/paths.h"
 
 #include <algorithm>
+#include <array>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+using std::array;
+using std::lower_bound;
+using std::pair;
 using std::replace;
 using std::string;
+using std::string_view;
 using std::stringstream;
 using std::vector;
 
-const vector<string> image_extensions = {".jpg", ".jpeg", ".png", ".gif", ".bmp", ".svg"};
-const vector<string> video_extensions = {".mp4", ".mkv", ".avi", ".mov", ".webm"};
+// Lowercase extensions without the dot. Must be kept sorted, as it is binary searched.
+static constexpr array<pair<string_view, FileKind>, 24> file_kinds = {{
+        {"7z", FILE_KIND_ARCHIVE},
+        {"ai", FILE_KIND_PICTURE},
+        {"avi", FILE_KIND_VIDEO},
+        {"bmp", FILE_KIND_IMAGE},
+        {"bz2", FILE_KIND_ARCHIVE},
+        {"eps", FILE_KIND_PICTURE},
+        {"gif", FILE_KIND_IMAGE},
+        {"gz", FILE_KIND_ARCHIVE},
+        {"jpeg", FILE_KIND_IMAGE},
+        {"jpg", FILE_KIND_IMAGE},
+        {"mkv", FILE_KIND_VIDEO},
+        {"mov", FILE_KIND_VIDEO},
+        {"mp4", FILE_KIND_VIDEO},
+        {"png", FILE_KIND_IMAGE},
+        {"psd", FILE_KIND_PICTURE},
+        {"svg", FILE_KIND_IMAGE},
+        {"tar", FILE_KIND_ARCHIVE},
+        {"tgz", FILE_KIND_ARCHIVE},
+        {"tif", FILE_KIND_PICTURE},
+        {"tiff", FILE_KIND_PICTURE},
+        {"webm", FILE_KIND_VIDEO},
+        {"webp", FILE_KIND_PICTURE},
+        {"xz", FILE_KIND_ARCHIVE},
+        {"zip", FILE_KIND_ARCHIVE},
+}};
 
 string normalize_path(string path) {
     replace(path.begin(), path.end(), '\\', '/');
@@ -63,29 +95,33 @@ string basename(string path) {
 }
 
 
-string string_to_lower(string str) {
-    std::transform(str.begin(), str.end(), str.begin(), ::tolower);
-    return str;
-}
+FileKind file_kind(string_view path) {
+    size_t i = path.rfind('.');
+    if (i == string_view::npos || path.size() - i - 1 > 4) {
+        return FILE_KIND_OTHER;  // No extension, or longer than any in the table.
+    }
 
-string get_file_extension(string str) {
-   size_t i = str.rfind('.', str.length());
-   if (i != string::npos) {
-      return str.substr(i);
-   }
-   return "";
-}
+    char buf[4];
+    size_t n = path.size() - i - 1;
+    for (size_t j = 0 ; j < n ; ++j) {
+        char c = path[i + 1 + j];
+        buf[j] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    string_view ext(buf, n);
 
-bool is_path_extension_in_vector(string path, const vector<string> extension_list) {
-    string extension = string_to_lower(get_file_extension(path));
-    auto it = std::find(extension_list.begin(), extension_list.end(), extension);
-    return it != std::end(extension_list);
+    auto it = lower_bound(file_kinds.begin(), file_kinds.end(), ext, [](const auto &a, string_view b) {
+        return a.first < b;
+    });
+    if (it != file_kinds.end() && it->first == ext) {
+        return it->second;
+    }
+    return FILE_KIND_OTHER;
 }
 
 bool is_image(string path) {
-    return is_path_extension_in_vector(path, image_extensions);
+    return file_kind(path) == FILE_KIND_IMAGE;
 }
 
 bool is_video(string path) {
-    return is_path_extension_in_vector(path, video_extensions);
+    return file_kind(path) == FILE_KIND_VIDEO;
 }
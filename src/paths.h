@@ -4,16 +4,24 @@
 #define SRC_PATHS_H_
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 using std::string;
+using std::string_view;
 using std::vector;
 
-extern const vector<string> image_extensions;
-extern const vector<string> video_extensions;
+enum FileKind : uint8_t {
+    FILE_KIND_OTHER,
+    FILE_KIND_IMAGE,  // Pictures we open in the configured image viewer.
+    FILE_KIND_PICTURE,  // Other picture formats. Only shown with the picture icon.
+    FILE_KIND_VIDEO,
+    FILE_KIND_ARCHIVE,
+};
 
 string normalize_path(string path);
 string basename(string path);
+FileKind file_kind(string_view path);
 bool is_image(string path);
 bool is_video(string path);
 
@@ -12,8 +12,11 @@
 
 #include <wx/config.h>
 #include <wx/preferences.h>
+#include <wx/spinctrl.h>
 #include <wx/wx.h>
 
+#include "src/transferscheduler.h"
+
 using std::string;
 
 #ifdef __WXOSX__
@@ -166,6 +169,45 @@ PreferencesPageGeneralPanel::PreferencesPageGeneralPanel(wxWindow *parent, wxCon
     this->size_units_->Append("Bytes");
     item_sizer_size_unit->Add(this->size_units_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
 
+    auto item_sizer_index_depth = new wxBoxSizer(wxHORIZONTAL);
+    sizer->Add(item_sizer_index_depth, 0, wxGROW | wxALL, 5);
+    auto label_index_depth = new wxStaticText(this, wxID_ANY, "Remote index depth:");
+    item_sizer_index_depth->Add(label_index_depth, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+    item_sizer_index_depth->Add(5, 5, 1, wxALL, 0);
+    this->index_max_depth_ = new wxSpinCtrl(this, wxID_ANY, wxEmptyString, wxDefaultPosition, wxSize(300, -1));
+    this->index_max_depth_->SetRange(1, 64);
+    item_sizer_index_depth->Add(this->index_max_depth_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+
+    auto item_sizer_watch_dir = new wxBoxSizer(wxHORIZONTAL);
+    sizer->Add(item_sizer_watch_dir, 0, wxGROW | wxALL, 5);
+    this->watch_dir_ = new wxCheckBox(this, wxID_ANY, "Show changes made on the host to the current directory live");
+    item_sizer_watch_dir->Add(this->watch_dir_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+
+    auto item_sizer_prewarm = new wxBoxSizer(wxHORIZONTAL);
+    sizer->Add(item_sizer_prewarm, 0, wxGROW | wxALL, 5);
+    this->prewarm_connections_ = new wxCheckBox(
+            this, wxID_ANY, "Start connecting to hosts as they are entered or selected in the connect dialog");
+    item_sizer_prewarm->Add(this->prewarm_connections_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+
+    auto item_sizer_concurrent = new wxBoxSizer(wxHORIZONTAL);
+    sizer->Add(item_sizer_concurrent, 0, wxGROW | wxALL, 5);
+    auto label_concurrent = new wxStaticText(this, wxID_ANY, "Transfers at once, across all windows:");
+    item_sizer_concurrent->Add(label_concurrent, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+    item_sizer_concurrent->Add(5, 5, 1, wxALL, 0);
+    this->max_concurrent_transfers_ = new wxSpinCtrl(
+            this, wxID_ANY, wxEmptyString, wxDefaultPosition, wxSize(300, -1));
+    this->max_concurrent_transfers_->SetRange(1, 64);
+    item_sizer_concurrent->Add(this->max_concurrent_transfers_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+
+    auto item_sizer_rate = new wxBoxSizer(wxHORIZONTAL);
+    sizer->Add(item_sizer_rate, 0, wxGROW | wxALL, 5);
+    auto label_rate = new wxStaticText(this, wxID_ANY, "Transfer rate limit in KiB/s (0 for none):");
+    item_sizer_rate->Add(label_rate, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+    item_sizer_rate->Add(5, 5, 1, wxALL, 0);
+    this->max_transfer_rate_ = new wxSpinCtrl(this, wxID_ANY, wxEmptyString, wxDefaultPosition, wxSize(300, -1));
+    this->max_transfer_rate_->SetRange(0, 10 * 1024 * 1024);
+    item_sizer_rate->Add(this->max_transfer_rate_, 0, wxALL | wxALIGN_CENTER_VERTICAL, 5);
+
     this->SetSizerAndFit(sizer);
 }
 
@@ -181,6 +223,13 @@ bool PreferencesPageGeneralPanel::TransferDataToWindow() {
         this->size_units_->SetSelection(0);
     }
 
+    this->index_max_depth_->SetValue(this->config_->Read("/index_max_depth", 8));
+    this->watch_dir_->SetValue(this->config_->Read("/watch_dir", false));
+    this->prewarm_connections_->SetValue(this->config_->Read("/prewarm_connections", true));
+    this->max_concurrent_transfers_->SetValue(
+            this->config_->Read("/max_concurrent_transfers", MAX_CONCURRENT_TRANSFERS_DEFAULT));
+    this->max_transfer_rate_->SetValue(this->config_->Read("/max_transfer_rate_kib", 0));
+
     // Setting up the on-change binds here, so we only start monitoring for change after values have been loaded.
     this->editor_path_->Bind(wxEVT_TEXT, [&](wxCommandEvent &) {
         if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
@@ -202,6 +251,31 @@ bool PreferencesPageGeneralPanel::TransferDataToWindow() {
             this->TransferDataFromWindow();
         }
     });
+    this->index_max_depth_->Bind(wxEVT_SPINCTRL, [&](wxCommandEvent &) {
+        if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
+            this->TransferDataFromWindow();
+        }
+    });
+    this->watch_dir_->Bind(wxEVT_CHECKBOX, [&](wxCommandEvent &) {
+        if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
+            this->TransferDataFromWindow();
+        }
+    });
+    this->prewarm_connections_->Bind(wxEVT_CHECKBOX, [&](wxCommandEvent &) {
+        if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
+            this->TransferDataFromWindow();
+        }
+    });
+    this->max_concurrent_transfers_->Bind(wxEVT_SPINCTRL, [&](wxCommandEvent &) {
+        if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
+            this->TransferDataFromWindow();
+        }
+    });
+    this->max_transfer_rate_->Bind(wxEVT_SPINCTRL, [&](wxCommandEvent &) {
+        if (wxPreferencesEditor::ShouldApplyChangesImmediately()) {
+            this->TransferDataFromWindow();
+        }
+    });
 
     return true;
 }
@@ -217,6 +291,14 @@ bool PreferencesPageGeneralPanel::TransferDataFromWindow() {
         this->config_->Write("/size_units", "1");
     }
 
+    this->config_->Write("/index_max_depth", this->index_max_depth_->GetValue());
+    this->config_->Write("/watch_dir", this->watch_dir_->GetValue());
+    this->config_->Write("/prewarm_connections", this->prewarm_connections_->GetValue());
+    this->config_->Write("/max_concurrent_transfers", this->max_concurrent_transfers_->GetValue());
+    this->config_->Write("/max_transfer_rate_kib", this->max_transfer_rate_->GetValue());
+    SetTransferLimits(this->max_concurrent_transfers_->GetValue(),
+                      static_cast<uint64_t>(this->max_transfer_rate_->GetValue()) * 1024);
+
     this->config_->Flush();
     return true;
 }
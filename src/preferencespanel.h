@@ -5,6 +5,7 @@
 
 #include <wx/config.h>
 #include <wx/preferences.h>
+#include <wx/spinctrl.h>
 #include <wx/wx.h>
 
 #include <string>
@@ -21,6 +22,11 @@ class PreferencesPageGeneralPanel : public wxPanel {
     wxTextCtrl *image_viewer_path_;
     wxTextCtrl *video_viewer_path_;
     wxChoice *size_units_;
+    wxSpinCtrl *index_max_depth_;
+    wxCheckBox *watch_dir_;
+    wxCheckBox *prewarm_connections_;
+    wxSpinCtrl *max_concurrent_transfers_;
+    wxSpinCtrl *max_transfer_rate_;
 
 public:
     PreferencesPageGeneralPanel(wxWindow *parent, wxConfigBase *config);
@@ -0,0 +1,116 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifdef __WXMSW__
+#include <winsock2.h>  // Several header files include windows.h, but winsock2.h needs to come first.
+#endif
+
+#include "src/prewarm.h"
+
+#include <chrono>  // NOLINT
+#include <condition_variable>  // NOLINT
+#include <future>  // NOLINT
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+#include <utility>
+
+#include "src/hostdesc.h"
+#include "src/sftpconnection.h"
+
+using std::async;
+using std::condition_variable;
+using std::future;
+using std::launch;
+using std::lock_guard;
+using std::make_unique;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+// OpenSSH drops connections that have not authenticated within 120 seconds by default (LoginGraceTime), and some
+// hosts are set up with far less, so a connection is only handed out well before then.
+#define PREWARM_MAX_AGE_SECS 60
+
+struct Prewarmed {
+    string key;  // HostDesc::ToString of the host.
+    steady_clock::time_point started_at;
+    future<unique_ptr<SftpConnection>> conn;
+};
+
+static mutex prewarmed_mutex;
+static Prewarmed prewarmed;
+static int discarding = 0;  // Threads of discardLocked still going. Guarded by prewarmed_mutex.
+static condition_variable discarded;
+
+// Waits for conn and disconnects it on a thread of its own. Must hold prewarmed_mutex.
+static void discardLocked() {
+    if (!prewarmed.conn.valid()) {
+        return;
+    }
+    discarding++;
+    thread([conn = std::move(prewarmed.conn)]() mutable {
+        try {
+            conn.get();  // Destroyed right away.
+        } catch (...) {
+            // Failed to connect, so nothing to disconnect.
+        }
+        lock_guard<mutex> lock(prewarmed_mutex);
+        discarding--;
+        discarded.notify_all();
+    }).detach();
+    prewarmed.key = "";
+}
+
+void PrewarmConnection(HostDesc host_desc) {
+    string key = host_desc.ToString();
+    lock_guard<mutex> lock(prewarmed_mutex);
+    if (prewarmed.conn.valid() && prewarmed.key == key
+        && steady_clock::now() - prewarmed.started_at < seconds(PREWARM_MAX_AGE_SECS)) {
+        return;  // Already on its way.
+    }
+    discardLocked();
+    prewarmed.key = key;
+    prewarmed.started_at = steady_clock::now();
+    prewarmed.conn = async(launch::async, [host_desc]() {
+        return make_unique<SftpConnection>(host_desc);
+    });
+}
+
+unique_ptr<SftpConnection> TakePrewarmedConnection(HostDesc host_desc) {
+    future<unique_ptr<SftpConnection>> conn;
+    {
+        lock_guard<mutex> lock(prewarmed_mutex);
+        if (!prewarmed.conn.valid() || prewarmed.key != host_desc.ToString()
+            || steady_clock::now() - prewarmed.started_at >= seconds(PREWARM_MAX_AGE_SECS)) {
+            discardLocked();
+            return nullptr;
+        }
+        conn = std::move(prewarmed.conn);
+        prewarmed.key = "";
+    }
+
+    try {
+        return conn.get();
+    } catch (ConnectionError) {
+        return nullptr;  // Connecting again reports the error, if it was not just a passing one.
+    }
+}
+
+void DiscardPrewarmedConnection() {
+    lock_guard<mutex> lock(prewarmed_mutex);
+    discardLocked();
+}
+
+bool StopPrewarming(int timeout_ms) {
+    unique_lock<mutex> lock(prewarmed_mutex);
+    discardLocked();
+    return discarded.wait_for(lock, milliseconds(timeout_ms), []() {
+        return discarding == 0;
+    });
+}
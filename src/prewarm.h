@@ -0,0 +1,32 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_PREWARM_H_
+#define SRC_PREWARM_H_
+
+#include <memory>
+
+#include "src/hostdesc.h"
+#include "src/sftpconnection.h"
+
+using std::unique_ptr;
+
+// Starts connecting to host_desc in the background, up to where the fingerprint is known, so that if the user goes on
+// to connect to it, the TCP connect and SSH handshake are already done by then. Nothing is sent that identifies or
+// authenticates the user. Only one host is kept warm at a time; starting another discards the previous one, on a
+// thread of its own, so neither that nor a connection attempt still under way holds up the caller.
+void PrewarmConnection(HostDesc host_desc);
+
+// Takes the connection to host_desc started by PrewarmConnection, waiting for it if it is still connecting. Returns
+// nullptr if there is none for that host, if it failed, or if it has been standing by for so long that the host may
+// already have given up waiting for us to authenticate.
+unique_ptr<SftpConnection> TakePrewarmedConnection(HostDesc host_desc);
+
+// Discards the connection started by PrewarmConnection, if any, the same way as when starting another.
+void DiscardPrewarmedConnection();
+
+// Discards the connection started by PrewarmConnection, if any, and waits up to timeout_ms for all those discarded so
+// far to be done connecting and disconnecting, as libssh2 must not be shut down under them. Returns false if some are
+// still going by then.
+bool StopPrewarming(int timeout_ms);
+
+#endif  // SRC_PREWARM_H_
@@ -0,0 +1,556 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/remoteindex.h"
+
+#include <wx/filefn.h>
+#include <wx/stdpaths.h>
+#include <wx/wx.h>
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef __WXOSX__
+
+#include <filesystem>
+
+#endif
+
+#include "src/direntry.h"
+#include "src/namefilter.h"
+#include "src/paths.h"
+#include "src/sftpconnection.h"
+#include "src/string.h"
+
+using std::deque;
+using std::function;
+using std::map;
+using std::min;
+using std::pair;
+using std::string;
+using std::string_view;
+using std::to_string;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+#ifndef __WXOSX__
+using std::filesystem::create_directories;
+#else
+#include "src/filesystem.osx.polyfills.h"
+#endif
+
+#define INDEX_MAGIC "FRIX"
+#define INDEX_VERSION 1
+#define FIND_BATCH_DIRS 200  // Changed directories listed per find command during incremental updates.
+
+static_assert(sizeof(IndexEntry) == 24, "IndexEntry is written to disk as is");
+
+static FILE *openFile(string path, bool write) {
+#ifdef __WXMSW__
+    return _wfopen(localPathUnicode(path).c_str(), write ? L"wb" : L"rb");
+#else
+    return fopen(path.c_str(), write ? "wb" : "rb");
+#endif
+}
+
+static bool parseUint(string_view s, uint64_t *out) {
+    if (s.empty()) {
+        return false;
+    }
+    uint64_t v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        v = v * 10 + (c - '0');
+    }
+    *out = v;
+    return true;
+}
+
+struct FindRecord {
+    char type;
+    uint64_t size;
+    uint64_t modified;
+    string_view path;
+};
+
+// Parses one record printed with -printf '%y %s %T@ <path>\0'. The path is last, as it can contain spaces.
+static bool parseFindRecord(string_view record, FindRecord *r) {
+    if (record.size() < 2 || record[1] != ' ') {
+        return false;
+    }
+    r->type = record[0];
+    size_t size_end = record.find(' ', 2);
+    if (size_end == string_view::npos || !parseUint(record.substr(2, size_end - 2), &r->size)) {
+        return false;
+    }
+    size_t time_end = record.find(' ', size_end + 1);
+    if (time_end == string_view::npos) {
+        return false;
+    }
+    auto t = record.substr(size_end + 1, time_end - size_end - 1);
+    if (!parseUint(t.substr(0, t.find('.')), &r->modified)) {  // Sub-second precision is not kept.
+        return false;
+    }
+    r->path = record.substr(time_end + 1);
+    return true;
+}
+
+// Splits the output of a command into null terminated records, also across chunks.
+class RecordSplitter {
+    string pending_;
+
+public:
+    void Feed(string_view chunk, function<void(string_view)> on_record) {
+        size_t start = 0;
+        if (!this->pending_.empty()) {
+            size_t end = chunk.find('\0');
+            if (end == string_view::npos) {
+                this->pending_.append(chunk.data(), chunk.size());
+                return;
+            }
+            this->pending_.append(chunk.data(), end);
+            on_record(this->pending_);
+            this->pending_.clear();
+            start = end + 1;
+        }
+        while (1) {
+            size_t end = chunk.find('\0', start);
+            if (end == string_view::npos) {
+                break;
+            }
+            on_record(chunk.substr(start, end - start));
+            start = end + 1;
+        }
+        this->pending_.append(chunk.data() + start, chunk.size() - start);
+    }
+};
+
+static int pathDepth(string_view rel_path) {
+    if (rel_path.empty()) {
+        return 0;
+    }
+    return std::count(rel_path.begin(), rel_path.end(), '/') + 1;
+}
+
+// Whether each line of find's stderr is about a path that could not be read, or was removed during the walk. These
+// are in English as find is run with LC_ALL=C.
+static bool onlyUnreadablePaths(const string &err_output) {
+    const string_view denied = ": Permission denied";
+    const string_view missing = ": No such file or directory";
+    auto ends_with = [](string_view line, string_view suffix) {
+        return line.size() >= suffix.size() && line.substr(line.size() - suffix.size()) == suffix;
+    };
+    size_t start = 0;
+    while (start < err_output.size()) {
+        size_t end = err_output.find('\n', start);
+        if (end == string::npos) {
+            end = err_output.size();
+        }
+        string_view line(err_output.data() + start, end - start);
+        if (!ends_with(line, denied) && !ends_with(line, missing)) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+void IndexDir::Add(string_view name, uint64_t size, uint64_t modified, bool is_dir) {
+    IndexEntry e;
+    memset(&e, 0, sizeof(e));  // Also the padding, as entries are written to disk as is.
+    e.size = size;
+    e.modified = modified;
+    e.name_offset = static_cast<uint32_t>(this->names.size());
+    e.name_length = static_cast<uint16_t>(min(name.size(), static_cast<size_t>(UINT16_MAX)));
+    e.is_dir = is_dir;
+    this->names.append(name.data(), e.name_length);
+    this->entries.push_back(e);
+}
+
+string_view IndexDir::Name(const IndexEntry &entry) const {
+    return string_view(this->names).substr(entry.name_offset, entry.name_length);
+}
+
+RemoteIndex::RemoteIndex(string root, int max_depth) : root_(normalize_path(root)), max_depth_(max_depth) {}
+
+string RemoteIndex::PathForHost(string host) {
+    auto dir = wxStandardPaths::Get().GetUserDir(wxStandardPaths::Dir_Cache).ToStdString(wxMBConvUTF8());
+    return normalize_path(dir + "/filesremote/" + sha256(host) + ".index");
+}
+
+const string &RemoteIndex::Root() const {
+    return this->root_;
+}
+
+int RemoteIndex::MaxDepth() const {
+    return this->max_depth_;
+}
+
+uint64_t RemoteIndex::BuiltAt() const {
+    return this->built_at_;
+}
+
+size_t RemoteIndex::Size() const {
+    return this->hits_.size();
+}
+
+string RemoteIndex::FullPath(const string &rel_path) const {
+    if (rel_path.empty()) {
+        return this->root_;
+    }
+    if (this->root_ == "/") {
+        return "/" + rel_path;
+    }
+    return this->root_ + "/" + rel_path;
+}
+
+bool RemoteIndex::Update(
+        SftpConnection *conn,
+        const RemoteIndex *prev,
+        function<bool(void)> cancelled,
+        function<void(size_t)> progress) {
+    if (prev && (prev->root_ != this->root_ || prev->max_depth_ != this->max_depth_)) {
+        prev = nullptr;
+    }
+
+    bool supported = true;
+    bool completed = this->UpdateViaFind(conn, prev, cancelled, progress, &supported);
+    if (!supported) {
+        // No GNU find on the host, so walk the tree over SFTP instead. This lists every directory every time.
+        this->dirs_.clear();
+        completed = this->UpdateViaSftp(conn, cancelled, progress);
+    }
+    if (!completed) {
+        return false;
+    }
+
+    this->built_at_ = time(NULL);
+    this->Finalize();
+    return true;
+}
+
+bool RemoteIndex::UpdateViaFind(
+        SftpConnection *conn,
+        const RemoteIndex *prev,
+        function<bool(void)> cancelled,
+        function<void(size_t)> progress,
+        bool *supported) {
+    size_t count = 0;
+    auto last_progress = steady_clock::now();
+    auto report = [&]() {
+        if (steady_clock::now() - last_progress > milliseconds(250)) {
+            progress(count);
+            last_progress = steady_clock::now();
+        }
+    };
+
+    auto run = [&](string cmd, function<void(string_view)> on_record) -> bool {
+        RecordSplitter splitter;
+        string err_output;
+        int status = conn->Exec(cmd, [&](string_view chunk) {
+            splitter.Feed(chunk, on_record);
+        }, &err_output, cancelled, true);
+        if (status > 1 || err_output.find("-printf") != string::npos) {
+            *supported = false;  // No find, or not GNU find, such as BSD or BusyBox find.
+        }
+        // Status 1 means some directories could not be read, for example due to permissions, and the rest is still
+        // good. But it is also what a failed sudo exits with, so anything else on stderr means the listing can not be
+        // trusted, and the tree is walked over SFTP instead.
+        if (status == 1 && !onlyUnreadablePaths(err_output)) {
+            *supported = false;
+        }
+        return status == 0 || status == 1;
+    };
+
+    auto depth = to_string(this->max_depth_);
+    auto prefix = this->root_ == "/" ? string("/") : this->root_ + "/";
+
+    // Find which directories changed since prev, by their modification times.
+    vector<string> changed;
+    bool full = true;
+    if (prev) {
+        map<string, uint64_t> dir_times;
+        string cmd = "env LC_ALL=C find -H " + ShellQuote(this->root_);
+        cmd += " -maxdepth " + to_string(this->max_depth_ - 1) + " -type d -printf '%T@ %P\\0'";
+        bool ok = run(cmd, [&](string_view record) {
+            size_t space = record.find(' ');
+            uint64_t modified;
+            if (space == string_view::npos) {
+                return;
+            }
+            auto t = record.substr(0, space);
+            if (!parseUint(t.substr(0, t.find('.')), &modified)) {
+                return;
+            }
+            dir_times[string(record.substr(space + 1))] = modified;
+        });
+        if (!ok || !*supported) {
+            return false;
+        }
+
+        for (auto &dir : dir_times) {
+            auto it = prev->dirs_.find(dir.first);
+            if (it != prev->dirs_.end() && it->second.modified == dir.second) {
+                this->dirs_[dir.first] = it->second;
+                count += it->second.entries.size();
+            } else {
+                this->dirs_[dir.first].modified = dir.second;
+                changed.push_back(dir.first);
+            }
+        }
+
+        // When most of the tree changed, a single full walk is cheaper than listing directories in batches.
+        full = changed.size() > dir_times.size() / 2;
+        if (full) {
+            this->dirs_.clear();
+            count = 0;
+        }
+    }
+
+    if (full) {
+        string cmd = "env LC_ALL=C find -H " + ShellQuote(this->root_) + " -maxdepth " + depth;
+        cmd += " -printf '%y %s %T@ %P\\0'";
+        auto last_dir = this->dirs_.end();
+        return run(cmd, [&](string_view record) {
+            FindRecord r;
+            if (!parseFindRecord(record, &r)) {
+                return;
+            }
+            if (r.path.empty()) {
+                this->dirs_[""].modified = r.modified;
+                return;
+            }
+
+            size_t slash = r.path.rfind('/');
+            auto parent = slash == string_view::npos ? string_view() : r.path.substr(0, slash);
+            auto name = slash == string_view::npos ? r.path : r.path.substr(slash + 1);
+            if (last_dir == this->dirs_.end() || last_dir->first != parent) {
+                last_dir = this->dirs_.emplace(string(parent), IndexDir()).first;
+            }
+            last_dir->second.Add(name, r.size, r.modified, r.type == 'd');
+
+            if (r.type == 'd' && pathDepth(r.path) < this->max_depth_) {
+                this->dirs_[string(r.path)].modified = r.modified;
+            }
+            count++;
+            report();
+        }) && *supported;
+    }
+
+    // Incremental: list only the changed directories.
+    for (size_t i = 0 ; i < changed.size() ; i += FIND_BATCH_DIRS) {
+        string cmd = "env LC_ALL=C find -H";
+        for (size_t j = i ; j < changed.size() && j < i + FIND_BATCH_DIRS ; ++j) {
+            cmd += " " + ShellQuote(this->FullPath(changed[j]));
+        }
+        cmd += " -mindepth 1 -maxdepth 1 -printf '%y %s %T@ %p\\0'";
+        bool ok = run(cmd, [&](string_view record) {
+            FindRecord r;
+            if (!parseFindRecord(record, &r)) {
+                return;
+            }
+            size_t slash = r.path.rfind('/');
+            if (slash == string_view::npos) {
+                return;
+            }
+            auto parent_path = r.path.substr(0, slash == 0 ? 1 : slash);
+            string parent;
+            if (parent_path != this->root_) {
+                if (parent_path.substr(0, prefix.size()) != prefix) {
+                    return;
+                }
+                parent = string(parent_path.substr(prefix.size()));
+            }
+            auto it = this->dirs_.find(parent);
+            if (it != this->dirs_.end()) {
+                it->second.Add(r.path.substr(slash + 1), r.size, r.modified, r.type == 'd');
+            }
+            count++;
+            report();
+        });
+        if (!ok || !*supported) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RemoteIndex::UpdateViaSftp(SftpConnection *conn, function<bool(void)> cancelled, function<void(size_t)> progress) {
+    size_t count = 0;
+    deque<pair<string, int>> queue{{"", 0}};
+    this->dirs_[""];
+    while (!queue.empty()) {
+        if (cancelled()) {
+            return false;
+        }
+
+        auto rel_path = queue.front().first;
+        int depth = queue.front().second;
+        queue.pop_front();
+
+        vector<DirEntry> entries;
+        try {
+            entries = conn->GetDir(this->FullPath(rel_path));
+        } catch (DirListFailedPermission) {
+            continue;
+        } catch (FileNotFound) {
+            continue;
+        }
+
+        auto &dir = this->dirs_[rel_path];
+        for (auto &e : entries) {
+            if (e.name_ == "..") {
+                continue;
+            }
+            // Symlinks are not followed, the same as with find, so links back up the tree do not loop.
+            bool is_dir = e.is_dir_ && !LIBSSH2_SFTP_S_ISLNK(e.mode_);
+            dir.Add(e.name_, e.size_, e.modified_, is_dir);
+            if (is_dir && depth + 1 < this->max_depth_) {
+                auto child = rel_path.empty() ? e.name_ : rel_path + "/" + e.name_;
+                this->dirs_[child].modified = e.modified_;
+                queue.emplace_back(child, depth + 1);
+            }
+        }
+        count += entries.size();
+        progress(count);
+    }
+    return true;
+}
+
+void RemoteIndex::Finalize() {
+    this->filter_.Clear();
+    this->hits_.clear();
+    for (auto &dir : this->dirs_) {
+        for (uint32_t i = 0 ; i < dir.second.entries.size() ; ++i) {
+            this->filter_.Add(dir.second.Name(dir.second.entries[i]));
+            this->hits_.emplace_back(&dir.first, i);
+        }
+    }
+}
+
+vector<IndexHit> RemoteIndex::Search(const string &query, size_t limit) const {
+    vector<IndexHit> hits;
+    if (query.empty()) {
+        return hits;
+    }
+
+    auto matches = this->filter_.Filter(query);
+    for (size_t i = 0 ; i < matches.size() && i < limit ; ++i) {
+        auto &hit = this->hits_[matches[i]];
+        auto &dir = this->dirs_.at(*hit.first);
+        auto &entry = dir.entries[hit.second];
+        auto name = string(dir.Name(entry));
+        auto path = hit.first->empty() ? name : *hit.first + "/" + name;
+        hits.push_back(IndexHit{this->FullPath(path), entry.size, entry.modified, entry.is_dir});
+    }
+    return hits;
+}
+
+bool RemoteIndex::Load(string file_path) {
+    FILE *f = openFile(file_path, false);
+    if (!f) {
+        return false;
+    }
+
+    auto read_u64 = [&](uint64_t *v) {
+        return fread(v, sizeof(*v), 1, f) == 1;
+    };
+    auto read_string = [&](string *s) {
+        uint64_t n;
+        if (!read_u64(&n) || n > UINT32_MAX) {
+            return false;
+        }
+        s->resize(n);
+        return n == 0 || fread(&(*s)[0], n, 1, f) == 1;
+    };
+
+    char magic[4];
+    uint64_t version, max_depth, dir_count;
+    bool ok = fread(magic, 4, 1, f) == 1 && memcmp(magic, INDEX_MAGIC, 4) == 0
+              && read_u64(&version) && version == INDEX_VERSION
+              && read_string(&this->root_)
+              && read_u64(&max_depth)
+              && read_u64(&this->built_at_)
+              && read_u64(&dir_count);
+    this->max_depth_ = static_cast<int>(max_depth);
+    this->dirs_.clear();
+    for (uint64_t i = 0 ; ok && i < dir_count ; ++i) {
+        string key;
+        IndexDir dir;
+        uint64_t entry_count;
+        ok = read_string(&key) && read_u64(&dir.modified) && read_string(&dir.names) && read_u64(&entry_count)
+             && entry_count <= dir.names.size() + 1;
+        if (!ok) {
+            break;
+        }
+        dir.entries.resize(entry_count);
+        ok = entry_count == 0 || fread(dir.entries.data(), sizeof(IndexEntry), entry_count, f) == entry_count;
+        for (auto &e : dir.entries) {
+            ok = ok && static_cast<uint64_t>(e.name_offset) + e.name_length <= dir.names.size();
+        }
+        this->dirs_[key] = std::move(dir);
+    }
+    fclose(f);
+
+    if (!ok) {
+        this->root_.clear();
+        this->max_depth_ = 0;
+        this->built_at_ = 0;
+        this->dirs_.clear();
+    }
+    this->Finalize();
+    return ok;
+}
+
+void RemoteIndex::Save(string file_path) const {
+    try {
+        create_directories(localPathUnicode(file_path.substr(0, file_path.rfind('/'))));
+    } catch (...) {
+        return;
+    }
+
+    string tmp_path = file_path + ".tmp";
+    FILE *f = openFile(tmp_path, true);
+    if (!f) {
+        return;
+    }
+
+    auto write_u64 = [&](uint64_t v) {
+        return fwrite(&v, sizeof(v), 1, f) == 1;
+    };
+    auto write_string = [&](const string &s) {
+        return write_u64(s.size()) && (s.empty() || fwrite(s.data(), s.size(), 1, f) == 1);
+    };
+
+    bool ok = fwrite(INDEX_MAGIC, 4, 1, f) == 1
+              && write_u64(INDEX_VERSION)
+              && write_string(this->root_)
+              && write_u64(this->max_depth_)
+              && write_u64(this->built_at_)
+              && write_u64(this->dirs_.size());
+    for (auto &dir : this->dirs_) {
+        auto &entries = dir.second.entries;
+        ok = ok && write_string(dir.first) && write_u64(dir.second.modified) && write_string(dir.second.names)
+             && write_u64(entries.size())
+             && (entries.empty() || fwrite(entries.data(), sizeof(IndexEntry), entries.size(), f) == entries.size());
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if (ok) {
+        wxRenameFile(wxString::FromUTF8(tmp_path), wxString::FromUTF8(file_path), true);
+    } else {
+        wxRemoveFile(wxString::FromUTF8(tmp_path));
+    }
+}
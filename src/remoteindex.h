@@ -0,0 +1,111 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_REMOTEINDEX_H_
+#define SRC_REMOTEINDEX_H_
+
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "src/namefilter.h"
+#include "src/sftpconnection.h"
+
+using std::function;
+using std::map;
+using std::pair;
+using std::string;
+using std::string_view;
+using std::vector;
+
+struct IndexEntry {
+    uint64_t size;
+    uint64_t modified;
+    uint32_t name_offset;  // Into the names of the IndexDir it belongs to.
+    uint16_t name_length;
+    bool is_dir;
+};
+
+// The entries of one indexed directory, with their names packed into a single string.
+struct IndexDir {
+    uint64_t modified = 0;  // Changes whenever entries are added, removed or renamed, which drives incremental updates.
+    string names;
+    vector<IndexEntry> entries;
+
+    void Add(string_view name, uint64_t size, uint64_t modified, bool is_dir);
+
+    string_view Name(const IndexEntry &entry) const;
+};
+
+struct IndexHit {
+    string path;
+    uint64_t size;
+    uint64_t modified;
+    bool is_dir;
+};
+
+// Index of the names, sizes and modification times of all files in a remote tree, down to a maximum depth, for
+// searching by name without going to the host.
+class RemoteIndex {
+    string root_;
+    int max_depth_ = 0;
+    uint64_t built_at_ = 0;
+    map<string, IndexDir> dirs_;  // Keyed by path relative to root_, with "" for root_ itself.
+    NameFilter filter_;  // Over the names of all entries of all dirs, in the same order as hits_.
+    vector<pair<const string *, uint32_t>> hits_;  // Key into dirs_ and index into its entries, of each name.
+
+public:
+    RemoteIndex() {}
+
+    RemoteIndex(string root, int max_depth);
+
+    RemoteIndex(const RemoteIndex &) = delete;  // hits_ points into dirs_.
+
+    RemoteIndex &operator=(const RemoteIndex &) = delete;
+
+    // Returns the path of the index file for the given host, in the user's cache dir.
+    static string PathForHost(string host);
+
+    const string &Root() const;
+
+    int MaxDepth() const;
+
+    uint64_t BuiltAt() const;
+
+    size_t Size() const;
+
+    // Walks the tree on the host. If prev is an index of the same root and depth, only directories whose modification
+    // time changed since are listed again. Note that this means sizes and times of files that were modified in place,
+    // without being replaced, can lag behind. Returns false if cancelled.
+    bool Update(
+            SftpConnection *conn,
+            const RemoteIndex *prev,
+            function<bool(void)> cancelled,
+            function<void(size_t)> progress);
+
+    // Same query syntax as the listing filter. See NameFilter::Filter.
+    vector<IndexHit> Search(const string &query, size_t limit) const;
+
+    // Reads an index saved by Save. Returns false, leaving the index empty, if the file is missing or unreadable.
+    bool Load(string file_path);
+
+    void Save(string file_path) const;
+
+private:
+    bool UpdateViaFind(
+            SftpConnection *conn,
+            const RemoteIndex *prev,
+            function<bool(void)> cancelled,
+            function<void(size_t)> progress,
+            bool *supported);
+
+    bool UpdateViaSftp(SftpConnection *conn, function<bool(void)> cancelled, function<void(size_t)> progress);
+
+    string FullPath(const string &rel_path) const;
+
+    void Finalize();
+};
+
+#endif  // SRC_REMOTEINDEX_H_
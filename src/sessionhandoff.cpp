@@ -0,0 +1,109 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/sessionhandoff.h"
+
+#include <wx/filename.h>
+#include <wx/ipc.h>
+#include <wx/log.h>
+#include <wx/stdpaths.h>
+#include <wx/wx.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "src/hostdesc.h"
+#include "src/paths.h"
+#include "src/string.h"
+
+using std::function;
+using std::map;
+using std::string;
+using std::unique_ptr;
+
+#define HANDOFF_TOPIC "open-window"
+
+// Named by a hash of the host, as the host itself could make too long a path for a socket.
+static wxString serviceFor(HostDesc host_desc) {
+    string id = sha256(host_desc.ToString()).substr(0, 16);
+#ifdef __WXMSW__
+    return wxString::FromUTF8("filesremote_" + id);
+#else
+    // Not in the temp dir, where other users could get in first.
+    auto dir = wxStandardPaths::Get().GetUserDataDir();
+    wxFileName::Mkdir(dir, 0700, wxPATH_MKDIR_FULL);
+    return wxString::FromUTF8(normalize_path(dir.ToStdString(wxMBConvUTF8()) + "/" + id + ".sock"));
+#endif
+}
+
+class HandoffConnection : public wxConnection {
+    function<void(void)> open_window_;
+
+public:
+    explicit HandoffConnection(function<void(void)> open_window) : open_window_(open_window) {}
+
+    bool OnExec(const wxString &topic, const wxString &data) override {
+        wxTheApp->CallAfter(this->open_window_);  // Rather than open a window from within the IPC handler.
+        return true;
+    }
+};
+
+class HandoffServer : public wxServer {
+    function<void(void)> open_window_;
+
+public:
+    explicit HandoffServer(function<void(void)> open_window) : open_window_(open_window) {}
+
+    wxConnectionBase *OnAcceptConnection(const wxString &topic) override {
+        if (topic != HANDOFF_TOPIC) {
+            return NULL;
+        }
+        return new HandoffConnection(this->open_window_);
+    }
+};
+
+static map<string, unique_ptr<HandoffServer>> servers;  // By HostDesc::ToString. Only used from the UI thread.
+
+// Returns nullptr if no instance answers for host_desc.
+static unique_ptr<wxConnectionBase> connectToOwner(HostDesc host_desc) {
+    wxLogNull no_log;  // There being no owner is the common case, rather than an error.
+    wxClient client;
+    return unique_ptr<wxConnectionBase>(client.MakeConnection("localhost", serviceFor(host_desc), HANDOFF_TOPIC));
+}
+
+bool RequestWindowFromOwner(HostDesc host_desc) {
+    auto conn = connectToOwner(host_desc);
+    if (!conn) {
+        return false;
+    }
+    bool ok = conn->Execute(wxString::FromUTF8(host_desc.ToString()));
+    conn->Disconnect();
+    return ok;
+}
+
+void ServeWindowRequests(HostDesc host_desc, function<void(void)> open_window) {
+    string key = host_desc.ToString();
+    if (servers.count(key)) {
+        return;
+    }
+    auto owner = connectToOwner(host_desc);
+    if (owner) {
+        owner->Disconnect();
+        return;  // Another instance connected first, and answers for the host.
+    }
+
+    wxLogNull no_log;  // Best effort. Other instances will connect to the host themselves if this fails.
+    auto service = serviceFor(host_desc);
+#ifndef __WXMSW__
+    wxRemoveFile(service);  // Left behind by an instance that did not exit cleanly, if any, as nothing answered on it.
+#endif
+    auto server = unique_ptr<HandoffServer>(new HandoffServer(open_window));
+    if (server->Create(service)) {
+        servers[key] = std::move(server);
+    }
+}
+
+void StopServingWindowRequests() {
+    servers.clear();
+}
@@ -0,0 +1,28 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_SESSIONHANDOFF_H_
+#define SRC_SESSIONHANDOFF_H_
+
+#include <functional>
+
+#include "src/hostdesc.h"
+
+using std::function;
+
+// Lets an instance that is about to connect to a host hand that over to another instance already connected to it,
+// which opens a new window instead, over the session it already has. Like the ControlMaster of OpenSSH, that saves the
+// handshake and authentication, but libssh2 can not hand channels of a session to another process, so it is the
+// window that moves rather than the channels. Goes over a Unix domain socket private to the user, or DDE on Windows.
+
+// Asks the instance connected to host_desc, if any, to open a new window on it. Returns true if it did, in which case
+// the caller need not connect.
+bool RequestWindowFromOwner(HostDesc host_desc);
+
+// Answers RequestWindowFromOwner for host_desc by calling open_window, from the UI thread. Does nothing if this or
+// another instance is already answering for host_desc. Must be called from the UI thread.
+void ServeWindowRequests(HostDesc host_desc, function<void(void)> open_window);
+
+// Stops answering for any host, such as on exit.
+void StopServingWindowRequests();
+
+#endif  // SRC_SESSIONHANDOFF_H_
@@ -0,0 +1,265 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/sessionmux.h"
+
+#ifdef __WXMSW__
+
+#include <winsock2.h>
+
+#else
+
+#include <poll.h>
+
+#endif
+
+#include <libssh2.h>
+
+#include <chrono>  // NOLINT
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/sftpconnection.h"
+
+using std::function;
+using std::string;
+using std::string_view;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+#define MUX_BUFLEN 65536
+#define MUX_POLL_MS 100  // How long to wait on the socket at a time, between checks for cancellation.
+#define MUX_TIMEOUT_MS (10 * 1000)  // Same as the timeout of the session in blocking mode.
+#define MUX_KEEPALIVE_SECS 5  // How often to check that the host is still there, while long running jobs are quiet.
+
+bool WaitForSession(LIBSSH2_SESSION *session, int sock, int timeout_ms) {
+    int directions = libssh2_session_block_directions(session);
+    if (directions == 0) {
+        return true;  // Not waiting on the socket at all.
+    }
+
+#ifdef __WXMSW__
+    WSAPOLLFD fd;
+#else
+    struct pollfd fd;
+#endif
+    fd.fd = sock;
+    fd.events = 0;
+    fd.revents = 0;
+    if (directions & LIBSSH2_SESSION_BLOCK_INBOUND) {
+        fd.events |= POLLIN;
+    }
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) {
+        fd.events |= POLLOUT;
+    }
+#ifdef __WXMSW__
+    int rc = WSAPoll(&fd, 1, timeout_ms);
+#else
+    int rc = poll(&fd, 1, timeout_ms);
+#endif
+    if (rc < 0) {
+        throw ConnectionError("poll failed");
+    }
+    return rc > 0;
+}
+
+bool SessionMux::Run(const vector<MuxJob *> &jobs, function<bool(void)> cancelled, bool long_running) {
+    this->opening_ = nullptr;
+    libssh2_session_set_blocking(this->session_, 0);
+    BlockingRestorer restorer(this->session_);
+
+    // The host answers keepalives even while the jobs are quiet, so anything but a dead connection is heard from
+    // within a keepalive interval and a round trip.
+    auto timeout = milliseconds(MUX_TIMEOUT_MS);
+    if (long_running) {
+        libssh2_keepalive_config(this->session_, 1, MUX_KEEPALIVE_SECS);
+        timeout += milliseconds(MUX_KEEPALIVE_SECS * 1000);
+    }
+
+    vector<bool> done(jobs.size(), false);
+    size_t remaining = jobs.size();
+    auto last_activity = steady_clock::now();
+    while (remaining > 0) {
+        for (size_t i = 0 ; i < jobs.size() ; ++i) {
+            if (!done[i] && jobs[i]->Step(this)) {
+                done[i] = true;
+                remaining--;
+                last_activity = steady_clock::now();
+            }
+        }
+        if (remaining == 0) {
+            break;
+        }
+        // Not while a channel is half open, as libssh2 would otherwise carry on with that the next time a channel is
+        // opened, whatever for.
+        if (cancelled && cancelled() && !this->opening_) {
+            return false;
+        }
+
+        if (libssh2_session_block_directions(this->session_) == 0) {
+            continue;  // Not waiting on the socket, so some job can get further right away.
+        }
+        bool ready = WaitForSession(this->session_, this->sock_, MUX_POLL_MS);
+        if (ready) {
+            last_activity = steady_clock::now();
+        } else if (steady_clock::now() - last_activity > timeout) {
+            throw ConnectionError("timed out waiting for the server");
+        } else if (long_running
+                   && !(libssh2_session_block_directions(this->session_) & LIBSSH2_SESSION_BLOCK_OUTBOUND)) {
+            // Not while a packet is half sent, which libssh2 would finish instead. Sends one only once the interval
+            // has passed since the last.
+            int next_secs;
+            if (libssh2_keepalive_send(this->session_, &next_secs) != 0) {
+                this->Fail("libssh2_keepalive_send");
+            }
+        }
+    }
+    return true;
+}
+
+bool SessionMux::TryOpen(const MuxJob *job) {
+    if (this->opening_ && this->opening_ != job) {
+        return false;
+    }
+    this->opening_ = job;
+    return true;
+}
+
+void SessionMux::DoneOpening(const MuxJob *job) {
+    if (this->opening_ == job) {
+        this->opening_ = nullptr;
+    }
+}
+
+void SessionMux::Fail(const string &what) const {
+    char *errmsg;
+    libssh2_session_last_error(this->session_, &errmsg, NULL, 0);
+    throw ConnectionError(what + " failed. " + string(errmsg));
+}
+
+MuxExecWorker::~MuxExecWorker() {
+    if (this->channel_) {
+        // Cancelled or failed part way. The session is in blocking mode again by now.
+        libssh2_channel_close(this->channel_);
+        libssh2_channel_free(this->channel_);
+    }
+}
+
+bool MuxExecWorker::Step(SessionMux *mux) {
+    char buf[MUX_BUFLEN];
+    while (1) {
+        switch (this->state_) {
+            case IDLE:
+                if (!this->queue_->returned.empty()) {
+                    this->current_ = this->queue_->returned.back();
+                    this->queue_->returned.pop_back();
+                } else if (this->queue_->next < this->queue_->cmds.size()) {
+                    this->current_ = this->queue_->next++;
+                } else {
+                    this->queue_->workers--;
+                    return true;
+                }
+                this->state_ = OPENING;
+                break;
+
+            case OPENING:
+                if (!mux->TryOpen(this)) {
+                    return false;
+                }
+                this->channel_ = libssh2_channel_open_session(mux->Session());
+                if (!this->channel_) {
+                    int err = libssh2_session_last_errno(mux->Session());
+                    if (err == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    mux->DoneOpening(this);
+                    if (err == LIBSSH2_ERROR_CHANNEL_FAILURE && this->queue_->workers > 1) {
+                        // Over the host's limit on channels, so the workers that did get one carry on without this one.
+                        this->queue_->returned.push_back(this->current_);
+                        this->queue_->workers--;
+                        return true;
+                    }
+                    if (err == LIBSSH2_ERROR_CHANNEL_FAILURE) {
+                        char *errmsg;
+                        libssh2_session_last_error(mux->Session(), &errmsg, NULL, 0);
+                        throw ChannelRefused("libssh2_channel_open_session failed. " + string(errmsg));
+                    }
+                    mux->Fail("libssh2_channel_open_session");
+                }
+                mux->DoneOpening(this);
+                this->state_ = STARTING;
+                break;
+
+            case STARTING: {
+                int rc = libssh2_channel_exec(this->channel_, this->queue_->cmds[this->current_].c_str());
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return false;
+                }
+                if (rc != 0) {
+                    mux->Fail("libssh2_channel_exec");
+                }
+                this->state_ = READING;
+                break;
+            }
+
+            case READING: {
+                // Both streams, as the command stalls once the window of the one not read from fills up.
+                ssize_t n;
+                while ((n = libssh2_channel_read(this->channel_, buf, MUX_BUFLEN)) > 0) {
+                    this->queue_->on_output(this->current_, string_view(buf, n));
+                }
+                if (n < 0 && n != LIBSSH2_ERROR_EAGAIN) {
+                    mux->Fail("libssh2_channel_read");
+                }
+                while ((n = libssh2_channel_read_stderr(this->channel_, buf, MUX_BUFLEN)) > 0) {
+                    this->queue_->err_outputs[this->current_].append(buf, n);
+                }
+                if (n < 0 && n != LIBSSH2_ERROR_EAGAIN) {
+                    mux->Fail("libssh2_channel_read_stderr");
+                }
+                if (!libssh2_channel_eof(this->channel_)) {
+                    return false;
+                }
+                this->state_ = CLOSING;
+                break;
+            }
+
+            case CLOSING: {
+                int rc = libssh2_channel_close(this->channel_);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return false;
+                }
+                if (rc != 0) {
+                    mux->Fail("libssh2_channel_close");
+                }
+                this->state_ = WAITING_CLOSED;
+                break;
+            }
+
+            case WAITING_CLOSED: {
+                int rc = libssh2_channel_wait_closed(this->channel_);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return false;
+                }
+                if (rc != 0) {
+                    mux->Fail("libssh2_channel_wait_closed");
+                }
+                this->queue_->statuses[this->current_] = libssh2_channel_get_exit_status(this->channel_);
+                this->state_ = FREEING;
+                break;
+            }
+
+            case FREEING: {
+                int rc = libssh2_channel_free(this->channel_);
+                if (rc == LIBSSH2_ERROR_EAGAIN) {
+                    return false;
+                }
+                this->channel_ = NULL;
+                this->state_ = IDLE;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,114 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_SESSIONMUX_H_
+#define SRC_SESSIONMUX_H_
+
+#include <libssh2.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::function;
+using std::string;
+using std::string_view;
+using std::vector;
+
+class SessionMux;
+
+// Puts a session back in blocking mode when it goes out of scope, as everything other than SessionMux::Run and the
+// like expects it to be.
+class BlockingRestorer {
+    LIBSSH2_SESSION *session_;
+
+public:
+    explicit BlockingRestorer(LIBSSH2_SESSION *session) : session_(session) {}
+
+    ~BlockingRestorer() {
+        libssh2_session_set_blocking(this->session_, 1);
+    }
+};
+
+// Waits up to timeout_ms for sock to be ready in the directions that session, in non-blocking mode, is waiting on.
+// Returns false if it timed out. Throws ConnectionError if poll fails.
+bool WaitForSession(LIBSSH2_SESSION *session, int sock, int timeout_ms);
+
+// An operation over a session in non-blocking mode, written as a state machine so that several of them can take turns
+// on the same session. See SessionMux.
+class MuxJob {
+public:
+    virtual ~MuxJob() = default;
+
+    // Advances as far as possible without blocking. Returns true once done, after which it is not called again.
+    // Throws ConnectionError if the session fails.
+    virtual bool Step(SessionMux *mux) = 0;
+};
+
+// Runs several MuxJobs at once over one SSH session, so they share its TCP connection and authentication rather than
+// waiting for each other's round trips. The session is switched to non-blocking mode while they run, and the jobs are
+// stepped in turn, waiting with poll on the socket whenever none of them can get further.
+class SessionMux {
+    LIBSSH2_SESSION *session_;
+    int sock_;
+    const MuxJob *opening_ = nullptr;
+
+public:
+    SessionMux(LIBSSH2_SESSION *session, int sock) : session_(session), sock_(sock) {}
+
+    // Returns false if cancelled before all of jobs were done. Jobs may be destroyed in any state afterwards, as the
+    // session is then back in blocking mode. Throws ConnectionError if the host goes quiet for MUX_TIMEOUT_MS, or if
+    // long_running is set, for jobs that can take long without a word, such as du over a large tree, only once the
+    // host stops answering keepalives.
+    bool Run(const vector<MuxJob *> &jobs, function<bool(void)> cancelled, bool long_running = false);
+
+    // libssh2 keeps the state of opening a channel in the session rather than in the channel, so only one job at a
+    // time can be doing that. A job calls TryOpen before each attempt, and DoneOpening once the channel is open.
+    bool TryOpen(const MuxJob *job);
+
+    void DoneOpening(const MuxJob *job);
+
+    LIBSSH2_SESSION *Session() const {
+        return this->session_;
+    }
+
+    // Throws ConnectionError with the last error of the session.
+    [[noreturn]] void Fail(const string &what) const;
+};
+
+// Runs commands one after the other over exec channels, taking the next one from the queue shared with the other
+// workers, until there are none left. Several of these over one session run that many commands concurrently. A worker
+// the host refuses a channel to leaves its command to the others, unless there are none, when it throws
+// ChannelRefused.
+class MuxExecWorker : public MuxJob {
+public:
+    struct Queue {
+        const vector<string> &cmds;
+        function<void(size_t, string_view)> on_output;  // Called with the index of the command and what it wrote.
+        vector<int> statuses;  // Exit statuses, by index of the command.
+        vector<string> err_outputs;
+        size_t next = 0;
+        size_t workers = 0;  // Workers still taking commands from the queue.
+        vector<size_t> returned;  // Commands given back by workers the host refused a channel to, to run first.
+    };
+
+    explicit MuxExecWorker(Queue *queue) : queue_(queue) {}
+
+    // Picks up the command at index of queue, already started on channel, which it then owns.
+    MuxExecWorker(Queue *queue, size_t index, LIBSSH2_CHANNEL *channel)
+            : queue_(queue), state_(READING), current_(index), channel_(channel) {}
+
+    ~MuxExecWorker() override;
+
+    bool Step(SessionMux *mux) override;
+
+private:
+    enum State { IDLE, OPENING, STARTING, READING, CLOSING, WAITING_CLOSED, FREEING };
+
+    Queue *queue_;
+    State state_ = IDLE;
+    size_t current_ = 0;
+    LIBSSH2_CHANNEL *channel_ = NULL;
+};
+
+#endif  // SRC_SESSIONMUX_H_
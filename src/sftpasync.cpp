@@ -0,0 +1,580 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/sftpasync.h"
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>  // NOLINT
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/paths.h"
+#include "src/sessionmux.h"
+#include "src/sftpconnection.h"
+
+using std::exception_ptr;
+using std::function;
+using std::future;
+using std::make_exception_ptr;
+using std::make_unique;
+using std::min;
+using std::nullopt;
+using std::optional;
+using std::string;
+using std::string_view;
+using std::unique_ptr;
+using std::vector;
+
+#define ASYNC_BUFLEN 4096
+#define ASYNC_READ_BUFLEN 65536
+
+// Fills in link_target_ and is_dir_ of a symlink, like listings have them. Links that are dangling or can not be
+// followed keep is_dir_ unset.
+class LinkResolver {
+    enum State { READLINK, STAT_TARGET };
+
+    State state_ = READLINK;
+
+public:
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux, const string &path, DirEntry *entry) {
+        if (this->state_ == READLINK) {
+            char buf[ASYNC_BUFLEN];
+            int rc = libssh2_sftp_readlink(sftp, path.c_str(), buf, ASYNC_BUFLEN);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                return true;  // Shown as a plain symlink.
+            }
+            if (rc < 0) {
+                mux->Fail("libssh2_sftp_readlink");
+            }
+            entry->link_target_ = string(buf, rc);
+            this->state_ = STAT_TARGET;
+        }
+
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+        int rc = libssh2_sftp_stat_ex(
+                sftp, path.c_str(), static_cast<unsigned int>(path.size()), LIBSSH2_SFTP_STAT, &attrs);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return false;
+        }
+        if (rc == 0) {
+            entry->is_dir_ = DirEntry(attrs).is_dir_;
+        } else if (rc != LIBSSH2_ERROR_SFTP_PROTOCOL) {
+            mux->Fail("libssh2_sftp_stat_ex");
+        }
+        return true;
+    }
+};
+
+class StatOp : public PromisedOp<optional<DirEntry>> {
+    string path_;
+    int stat_type_;
+    bool resolve_link_;
+    optional<DirEntry> entry_;
+    LinkResolver resolver_;
+
+public:
+    StatOp(string path, int stat_type, bool resolve_link)
+            : path_(path), stat_type_(stat_type), resolve_link_(resolve_link) {}
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        if (!this->entry_.has_value()) {
+            LIBSSH2_SFTP_ATTRIBUTES attrs;
+            int rc = libssh2_sftp_stat_ex(
+                    sftp, this->path_.c_str(), static_cast<unsigned int>(this->path_.size()), this->stat_type_,
+                    &attrs);
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return false;
+            }
+            if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                if (libssh2_sftp_last_error(sftp) == LIBSSH2_FX_PERMISSION_DENIED) {
+                    this->promise_.set_exception(make_exception_ptr(FailedPermission(this->path_)));
+                } else {
+                    this->promise_.set_value(nullopt);
+                }
+                return true;
+            }
+            if (rc != 0) {
+                mux->Fail("libssh2_sftp_stat_ex");
+            }
+            this->entry_ = DirEntry(attrs);
+            this->entry_->SetName(basename(this->path_));
+        }
+
+        if (this->resolve_link_ && LIBSSH2_SFTP_S_ISLNK(this->entry_->mode_)
+            && !this->resolver_.Step(sftp, mux, this->path_, &*this->entry_)) {
+            return false;
+        }
+        this->promise_.set_value(std::move(this->entry_));
+        return true;
+    }
+};
+
+class GetDirOp : public PromisedOp<vector<DirEntry>> {
+    enum State { OPENING, READING, CLOSING, RESOLVING };
+
+    string path_;
+    bool resolve_links_;
+    State state_ = OPENING;
+    LIBSSH2_SFTP_HANDLE *handle_ = NULL;
+    vector<DirEntry> files_;
+    size_t resolving_ = 0;  // Index into files_ of the next one to resolve, if a symlink.
+    LinkResolver resolver_;
+
+public:
+    GetDirOp(string path, bool resolve_links) : path_(path), resolve_links_(resolve_links) {}
+
+    ~GetDirOp() override {
+        if (this->handle_) {
+            libssh2_sftp_closedir(this->handle_);
+        }
+    }
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        // Buffers are reused for every entry. libssh2 null terminates what it writes, so no need to clear them.
+        char name[ASYNC_BUFLEN];
+        char line[ASYNC_BUFLEN];
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+        while (1) {
+            switch (this->state_) {
+                case OPENING:
+                    this->handle_ = libssh2_sftp_opendir(sftp, this->path_.c_str());
+                    if (!this->handle_) {
+                        int err = libssh2_session_last_errno(mux->Session());
+                        if (err == LIBSSH2_ERROR_EAGAIN) {
+                            return false;
+                        }
+                        if (err != LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                            mux->Fail("libssh2_sftp_opendir");
+                        }
+                        uint64_t sftp_err = libssh2_sftp_last_error(sftp);
+                        if (sftp_err == LIBSSH2_FX_PERMISSION_DENIED) {
+                            this->promise_.set_exception(make_exception_ptr(DirListFailedPermission(this->path_)));
+                        } else if (sftp_err == LIBSSH2_FX_NO_SUCH_PATH || sftp_err == LIBSSH2_FX_NO_SUCH_FILE
+                                   || sftp_err == LIBSSH2_FX_NO_MEDIA) {
+                            this->promise_.set_exception(make_exception_ptr(FileNotFound(this->path_)));
+                        } else {
+                            this->promise_.set_exception(make_exception_ptr(
+                                    ConnectionError("libssh2_sftp_opendir failed for " + this->path_)));
+                        }
+                        return true;
+                    }
+                    this->state_ = READING;
+                    break;
+
+                case READING: {
+                    int rc = libssh2_sftp_readdir_ex(this->handle_, name, sizeof(name), line, sizeof(line), &attrs);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    if (rc < 0) {
+                        mux->Fail("libssh2_sftp_readdir_ex");
+                    }
+                    if (rc == 0) {
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    if (rc == 1 && name[0] == '.') {
+                        break;
+                    }
+
+                    this->files_.emplace_back(attrs);
+                    auto &d = this->files_.back();
+                    d.SetName(string_view(name, rc));
+                    auto prev = this->files_.size() > 1 ? &this->files_[this->files_.size() - 2] : nullptr;
+                    d.ParseLongEntry(string_view(line, strnlen(line, sizeof(line))), prev);
+                    break;
+                }
+
+                case CLOSING: {
+                    int rc = libssh2_sftp_closedir(this->handle_);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    this->handle_ = NULL;
+                    if (this->files_.empty()) {
+                        // Not even "..", which happens when the directory can be opened but not read.
+                        this->promise_.set_exception(make_exception_ptr(DirListFailedPermission(this->path_)));
+                        return true;
+                    }
+                    this->state_ = RESOLVING;
+                    break;
+                }
+
+                case RESOLVING:
+                    for (; this->resolve_links_ && this->resolving_ < this->files_.size() ; ++this->resolving_) {
+                        auto &d = this->files_[this->resolving_];
+                        if (!LIBSSH2_SFTP_S_ISLNK(d.mode_)) {
+                            continue;
+                        }
+                        if (!this->resolver_.Step(sftp, mux, normalize_path(this->path_ + "/" + d.name_), &d)) {
+                            return false;
+                        }
+                        this->resolver_ = LinkResolver();
+                    }
+                    this->promise_.set_value(std::move(this->files_));
+                    return true;
+            }
+        }
+    }
+};
+
+class RenameOp : public PromisedOp<void> {
+    string old_path_;
+    string new_path_;
+
+public:
+    RenameOp(string old_path, string new_path) : old_path_(old_path), new_path_(new_path) {}
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        int rc = libssh2_sftp_rename(sftp, this->old_path_.c_str(), this->new_path_.c_str());
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return false;
+        }
+        if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+            uint64_t err = libssh2_sftp_last_error(sftp);
+            if (err == LIBSSH2_FX_PERMISSION_DENIED || err == LIBSSH2_FX_WRITE_PROTECT) {
+                this->promise_.set_exception(make_exception_ptr(FailedPermission(this->old_path_)));
+            } else {
+                this->promise_.set_exception(make_exception_ptr(UploadFailed(this->old_path_)));
+            }
+            return true;
+        }
+        if (rc != 0) {
+            mux->Fail("libssh2_sftp_rename");
+        }
+        this->promise_.set_value();
+        return true;
+    }
+};
+
+class MkdirOp : public PromisedOp<void> {
+    string path_;
+
+public:
+    explicit MkdirOp(string path) : path_(path) {}
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        int mode = LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
+                   LIBSSH2_SFTP_S_IXOTH;
+        int rc = libssh2_sftp_mkdir(sftp, this->path_.c_str(), mode);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return false;
+        }
+        if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+            uint64_t err = libssh2_sftp_last_error(sftp);
+            if (err == LIBSSH2_FX_PERMISSION_DENIED || err == LIBSSH2_FX_WRITE_PROTECT) {
+                this->promise_.set_exception(make_exception_ptr(FailedPermission(this->path_)));
+            } else {
+                this->promise_.set_exception(make_exception_ptr(UploadFailed(this->path_)));
+            }
+            return true;
+        }
+        if (rc != 0) {
+            mux->Fail("libssh2_sftp_mkdir");
+        }
+        this->promise_.set_value();
+        return true;
+    }
+};
+
+// Opens a file, reads or writes it, and closes it again. A failure after opening is held on to until the file is
+// closed, so the handle is not left open on the server.
+template<typename T>
+class FileOp : public PromisedOp<T> {
+protected:
+    enum State { OPENING, TRANSFERRING, CLOSING };
+
+    string path_;
+    State state_ = OPENING;
+    LIBSSH2_SFTP_HANDLE *handle_ = NULL;
+    exception_ptr error_;
+
+    explicit FileOp(string path) : path_(path) {}
+
+public:
+    ~FileOp() override {
+        if (this->handle_) {
+            libssh2_sftp_close_handle(this->handle_);
+        }
+    }
+
+protected:
+    // Returns false while it has to be called again, and true once closed.
+    bool Close() {
+        int rc = libssh2_sftp_close_handle(this->handle_);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return false;
+        }
+        this->handle_ = NULL;
+        return true;
+    }
+};
+
+class ReadFileOp : public FileOp<string> {
+    uint64_t max_bytes_;
+    string data_;
+
+public:
+    ReadFileOp(string path, uint64_t max_bytes) : FileOp(path), max_bytes_(max_bytes) {}
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        char buf[ASYNC_READ_BUFLEN];
+        while (1) {
+            switch (this->state_) {
+                case OPENING:
+                    this->handle_ = libssh2_sftp_open(sftp, this->path_.c_str(), LIBSSH2_FXF_READ, 0);
+                    if (!this->handle_) {
+                        int err = libssh2_session_last_errno(mux->Session());
+                        if (err == LIBSSH2_ERROR_EAGAIN) {
+                            return false;
+                        }
+                        if (err != LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                            mux->Fail("libssh2_sftp_open");
+                        }
+                        uint64_t sftp_err = libssh2_sftp_last_error(sftp);
+                        if (sftp_err == LIBSSH2_FX_PERMISSION_DENIED || sftp_err == LIBSSH2_FX_WRITE_PROTECT) {
+                            this->promise_.set_exception(make_exception_ptr(DownloadFailedPermission(this->path_)));
+                        } else {
+                            this->promise_.set_exception(make_exception_ptr(DownloadFailed(this->path_)));
+                        }
+                        return true;
+                    }
+                    this->state_ = TRANSFERRING;
+                    break;
+
+                case TRANSFERRING: {
+                    if (this->data_.size() >= this->max_bytes_) {
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    size_t len = min(static_cast<uint64_t>(ASYNC_READ_BUFLEN), this->max_bytes_ - this->data_.size());
+                    ssize_t rc = libssh2_sftp_read(this->handle_, buf, len);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                        this->error_ = make_exception_ptr(DownloadFailed(this->path_));
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    if (rc < 0) {
+                        mux->Fail("libssh2_sftp_read");
+                    }
+                    if (rc == 0) {
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    this->data_.append(buf, rc);
+                    break;
+                }
+
+                case CLOSING:
+                    if (!this->Close()) {
+                        return false;
+                    }
+                    if (this->error_) {
+                        this->promise_.set_exception(this->error_);
+                    } else {
+                        this->promise_.set_value(std::move(this->data_));
+                    }
+                    return true;
+            }
+        }
+    }
+};
+
+class WriteFileOp : public FileOp<void> {
+    string contents_;
+    size_t written_ = 0;
+
+public:
+    WriteFileOp(string path, string contents) : FileOp(path), contents_(contents) {}
+
+    bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) override {
+        while (1) {
+            switch (this->state_) {
+                case OPENING: {
+                    int mode = LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR | LIBSSH2_SFTP_S_IRGRP
+                               | LIBSSH2_SFTP_S_IROTH;
+                    this->handle_ = libssh2_sftp_open(
+                            sftp, this->path_.c_str(), LIBSSH2_FXF_WRITE | LIBSSH2_FXF_TRUNC | LIBSSH2_FXF_CREAT, mode);
+                    if (!this->handle_) {
+                        int err = libssh2_session_last_errno(mux->Session());
+                        if (err == LIBSSH2_ERROR_EAGAIN) {
+                            return false;
+                        }
+                        if (err != LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                            mux->Fail("libssh2_sftp_open");
+                        }
+                        this->promise_.set_exception(this->ErrorFor(libssh2_sftp_last_error(sftp)));
+                        return true;
+                    }
+                    this->state_ = TRANSFERRING;
+                    break;
+                }
+
+                case TRANSFERRING: {
+                    if (this->written_ >= this->contents_.size()) {
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    ssize_t rc = libssh2_sftp_write(
+                            this->handle_, this->contents_.data() + this->written_,
+                            this->contents_.size() - this->written_);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) {
+                        return false;
+                    }
+                    if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+                        this->error_ = this->ErrorFor(libssh2_sftp_last_error(sftp));
+                        this->state_ = CLOSING;
+                        break;
+                    }
+                    if (rc < 0) {
+                        mux->Fail("libssh2_sftp_write");
+                    }
+                    this->written_ += rc;
+                    break;
+                }
+
+                case CLOSING:
+                    if (!this->Close()) {
+                        return false;
+                    }
+                    if (this->error_) {
+                        this->promise_.set_exception(this->error_);
+                    } else {
+                        this->promise_.set_value();
+                    }
+                    return true;
+            }
+        }
+    }
+
+private:
+    exception_ptr ErrorFor(uint64_t sftp_err) {
+        if (sftp_err == LIBSSH2_FX_PERMISSION_DENIED || sftp_err == LIBSSH2_FX_WRITE_PROTECT) {
+            return make_exception_ptr(FailedPermission(this->path_));
+        }
+        if (sftp_err == LIBSSH2_FX_NO_SPACE_ON_FILESYSTEM) {
+            return make_exception_ptr(UploadFailedSpace(this->path_));
+        }
+        return make_exception_ptr(UploadFailed(this->path_));
+    }
+};
+
+// Takes submitted operations one at a time and runs them over its own SFTP session, until there are none left.
+class SftpOpWorker : public MuxJob {
+    SftpAsync *async_;
+    LIBSSH2_SFTP *sftp_;
+
+public:
+    unique_ptr<SftpOp> op_;  // The one in flight, if any.
+
+    SftpOpWorker(SftpAsync *async, LIBSSH2_SFTP *sftp) : async_(async), sftp_(sftp) {}
+
+    bool Step(SessionMux *mux) override {
+        while (1) {
+            if (!this->op_) {
+                if (this->async_->submitted_.empty() || (this->async_->cancelled_ && this->async_->cancelled_())) {
+                    return true;
+                }
+                this->op_ = std::move(this->async_->submitted_.front());
+                this->async_->submitted_.pop_front();
+            }
+            if (!this->op_->Step(this->sftp_, mux)) {
+                return false;
+            }
+            this->op_ = nullptr;
+        }
+    }
+};
+
+template<typename Op, typename... Args>
+auto SftpAsync::Submit(Args &&... args) {
+    auto op = make_unique<Op>(std::forward<Args>(args)...);
+    auto f = op->Future();
+    this->submitted_.push_back(std::move(op));
+    return f;
+}
+
+future<optional<DirEntry>> SftpAsync::Stat(string remote_path) {
+    return this->Submit<StatOp>(remote_path, LIBSSH2_SFTP_STAT, false);
+}
+
+future<optional<DirEntry>> SftpAsync::Lstat(string remote_path, bool resolve_link) {
+    return this->Submit<StatOp>(remote_path, LIBSSH2_SFTP_LSTAT, resolve_link);
+}
+
+future<vector<DirEntry>> SftpAsync::GetDir(string remote_path, bool resolve_links) {
+    return this->Submit<GetDirOp>(remote_path, resolve_links);
+}
+
+future<void> SftpAsync::Rename(string remote_old_path, string remote_new_path) {
+    this->conn_->InvalidateStatCache(remote_old_path);
+    this->conn_->InvalidateStatCache(remote_new_path);
+    return this->Submit<RenameOp>(remote_old_path, remote_new_path);
+}
+
+future<void> SftpAsync::Mkdir(string remote_path) {
+    this->conn_->InvalidateStatCache(remote_path);
+    return this->Submit<MkdirOp>(remote_path);
+}
+
+future<string> SftpAsync::ReadFile(string remote_path, uint64_t max_bytes) {
+    return this->Submit<ReadFileOp>(remote_path, max_bytes);
+}
+
+future<void> SftpAsync::WriteFile(string remote_path, string contents) {
+    this->conn_->InvalidateStatCache(remote_path);
+    return this->Submit<WriteFileOp>(remote_path, contents);
+}
+
+bool SftpAsync::Run(function<bool(void)> cancelled) {
+    if (this->submitted_.empty()) {
+        return true;
+    }
+    this->cancelled_ = cancelled;
+    vector<unique_ptr<SftpOpWorker>> workers;
+    vector<MuxJob *> jobs;
+    for (auto sftp : this->conn_->SftpPool()) {
+        workers.push_back(make_unique<SftpOpWorker>(this, sftp));
+        jobs.push_back(workers.back().get());
+    }
+
+    try {
+        // Cancellation is left to the workers, which only stop between operations.
+        SessionMux(this->conn_->session_, this->conn_->sock_).Run(jobs, nullptr);
+    } catch (...) {
+        auto e = std::current_exception();
+        for (auto &worker : workers) {
+            if (worker->op_) {
+                worker->op_->Abandon(e);
+            }
+        }
+        for (auto &op : this->submitted_) {
+            op->Abandon(e);
+        }
+        this->submitted_.clear();
+        throw;
+    }
+
+    bool completed = this->submitted_.empty();
+    for (auto &op : this->submitted_) {
+        op->Abandon(make_exception_ptr(OpCancelled()));
+    }
+    this->submitted_.clear();
+    return completed;
+}
@@ -0,0 +1,112 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_SFTPASYNC_H_
+#define SRC_SFTPASYNC_H_
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>  // NOLINT
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "src/direntry.h"
+#include "src/sessionmux.h"
+#include "src/sftpconnection.h"
+
+using std::deque;
+using std::exception;
+using std::exception_ptr;
+using std::function;
+using std::future;
+using std::optional;
+using std::promise;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// Result of an operation that was still waiting its turn when SftpAsync::Run was cancelled.
+class OpCancelled : public exception {
+};
+
+// One operation, as a state machine over an SFTP session in non-blocking mode. It may take several requests, such as
+// opening, reading and closing a file, but never has more than one in flight.
+class SftpOp {
+public:
+    virtual ~SftpOp() = default;
+
+    // Advances as far as possible without blocking. Returns true once done, with its result or exception set. Throws
+    // ConnectionError if the session fails.
+    virtual bool Step(LIBSSH2_SFTP *sftp, SessionMux *mux) = 0;
+
+    // Sets e as the result, for when the operation will not get to run to the end.
+    virtual void Abandon(exception_ptr e) = 0;
+};
+
+template<typename T>
+class PromisedOp : public SftpOp {
+protected:
+    promise<T> promise_;
+
+public:
+    future<T> Future() {
+        return this->promise_.get_future();
+    }
+
+    void Abandon(exception_ptr e) override {
+        this->promise_.set_exception(e);
+    }
+};
+
+// Asynchronous counterparts of the SFTP operations of SftpConnection. Each returns a future right away, and nothing is
+// sent until Run, which runs everything submitted since the previous Run, several at a time over the SFTP sessions of
+// SftpConnection::SftpPool. A caller with a batch of work can then submit all of it and wait once, rather than wait for
+// a round trip per operation. Futures are ready once Run returns, and throw the same exceptions as their synchronous
+// counterparts.
+class SftpAsync {
+    SftpConnection *conn_;
+    deque<unique_ptr<SftpOp>> submitted_;
+    function<bool(void)> cancelled_;
+
+public:
+    explicit SftpAsync(SftpConnection *conn) : conn_(conn) {}
+
+    future<optional<DirEntry>> Stat(string remote_path);
+
+    // Like listings and LstatMany, resolves where symlinks point if resolve_link is set, which takes two more round
+    // trips for them.
+    future<optional<DirEntry>> Lstat(string remote_path, bool resolve_link = false);
+
+    // Always lists over SFTP, with symlinks resolved unless resolve_links is cleared, which saves two round trips per
+    // symlink for callers that do not need to know where they point. Unlike SftpConnection::GetDir, large directories
+    // are not listed with find, as that would hold up a session for other operations.
+    future<vector<DirEntry>> GetDir(string remote_path, bool resolve_links = true);
+
+    future<void> Rename(string remote_old_path, string remote_new_path);
+
+    future<void> Mkdir(string remote_path);
+
+    // Opens remote_path and reads up to max_bytes of it into memory. For small files, such as for previews.
+    future<string> ReadFile(string remote_path, uint64_t max_bytes);
+
+    // Opens remote_path, creating or truncating it, and writes contents to it.
+    future<void> WriteFile(string remote_path, string contents);
+
+    // Returns false if cancelled. Operations that had not started by then fail with OpCancelled, while those that had
+    // are finished first, as libssh2 can not drop an SFTP request part way through. If the connection fails, what has
+    // not finished fails with the ConnectionError, which is also thrown from here.
+    bool Run(function<bool(void)> cancelled = nullptr);
+
+private:
+    friend class SftpOpWorker;
+
+    template<typename Op, typename... Args>
+    auto Submit(Args &&... args);
+};
+
+#endif  // SRC_SFTPASYNC_H_
@@ -10,7 +10,6 @@
 #else
 
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -25,10 +24,17 @@
 #include <utime.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <chrono>  // NOLINT
 #include <future>  // NOLINT
+#include <map>
+#include <memory>
+#include <mutex>  // NOLINT
 #include <optional>
 #include <regex>  // NOLINT
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #ifndef __WXOSX__
@@ -40,19 +46,39 @@
 #include "./version.h"
 #include "src/direntry.h"
 #include "src/hostdesc.h"
+#include "src/paths.h"
+#include "src/sessionmux.h"
+#include "src/sftpasync.h"
 #include "src/string.h"
+#include "src/tcpconnect.h"
 
 using std::exception;
 using std::function;
+using std::future;
+using std::lock_guard;
+using std::make_pair;
+using std::make_shared;
+using std::make_unique;
+using std::map;
+using std::max;
+using std::min;
+using std::mutex;
 using std::nullopt;
 using std::optional;
 using std::regex;
 using std::regex_replace;
 using std::regex_search;
+using std::shared_ptr;
 using std::string;
+using std::string_view;
 using std::stringstream;
 using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
+using std::weak_ptr;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::steady_clock;
 
 #ifndef __WXOSX__
@@ -64,6 +90,20 @@ using std::filesystem::exists;
 #define BUFLEN 4096
 #define LARGE_BUFLEN 65536
 
+// Directories whose own st_size is at least this are listed via find over an exec channel instead of SFTP readdir.
+// On most file systems the size of a directory grows with its number of entries, so this is roughly several thousand
+// entries, where the per-entry overhead of readdir packets and long names starts to dominate.
+#define EXEC_LISTING_MIN_DIR_SIZE (256 * 1024)
+
+#define STAT_CACHE_TTL_MS 3000  // Long enough to cover the stats of one user action, short enough to not go stale.
+#define STAT_CACHE_MAX_ENTRIES 1024
+#define STAT_MANY_EXEC_MIN_PATHS 8  // Fewer paths are quicker to stat one by one than to start find for.
+#define STAT_MANY_EXEC_BATCH 200  // Paths per find, to stay well within command line length limits.
+#define SESSION_TIMEOUT_MS (10 * 1000)  // For blocking calls. TODO(allan): higher timeout?
+#define STALL_TIMEOUT_MIN_MS 2000  // Quick to notice a dead connection, yet long enough for a busy host to answer.
+#define STALL_TIMEOUT_RTTS 4  // Round trips to allow for, where that is longer.
+#define SFTP_POOL_SIZE 3  // Extra SFTP sessions, so that with the main one, this many plus one requests are in flight.
+
 // RAII wrapper to ensure LIBSSH2_SFTP_HANDLE gets closed.
 class SftpHandle {
 public:
@@ -93,6 +133,36 @@ public:
     }
 };
 
+// Takes up to wanted of the spare channels of a session for as long as this is in scope.
+class SpareChannels {
+    shared_ptr<int> spare_;
+
+public:
+    const int taken_;
+
+    SpareChannels(shared_ptr<int> spare, int wanted) : spare_(spare), taken_(max(0, min(wanted, *spare))) {
+        *this->spare_ -= this->taken_;
+    }
+
+    ~SpareChannels() {
+        *this->spare_ += this->taken_;
+    }
+};
+
+// Sets the timeout of a session for as long as this is in scope, then puts it back to what it normally is.
+class SessionTimeout {
+    LIBSSH2_SESSION *session_;
+
+public:
+    SessionTimeout(LIBSSH2_SESSION *session, int timeout_ms) : session_(session) {
+        libssh2_session_set_timeout(this->session_, timeout_ms);
+    }
+
+    ~SessionTimeout() {
+        libssh2_session_set_timeout(this->session_, SESSION_TIMEOUT_MS);
+    }
+};
+
 // RAII wrapper to ensure FILE gets closed.
 class FileHandle {
 public:
@@ -107,54 +177,53 @@ public:
     }
 };
 
-SftpConnection::SftpConnection(HostDesc host_desc) {
-    this->host_desc_ = host_desc;
-
-    int rc;
+// With 64 bit offsets, which fseek does not take on Windows.
+static bool seekFile(FILE *f, uint64_t offset) {
+#ifdef __WXMSW__
+    return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, offset, SEEK_SET) == 0;
+#endif
+}
 
+static uint64_t fileSize(FILE *f) {
 #ifdef __WXMSW__
-    WSADATA wsadata;
-    rc = WSAStartup(MAKEWORD(2, 0), &wsadata);
-    if (rc != 0) {
-        throw ConnectionError("WSAStartup failed (" + to_string(rc) + ")");
-    }
+    _fseeki64(f, 0, SEEK_END);
+    uint64_t size = _ftelli64(f);
+#else
+    fseeko(f, 0, SEEK_END);
+    uint64_t size = ftello(f);
 #endif
+    seekFile(f, 0);
+    return size;
+}
 
-    rc = libssh2_init(-1);
-    if (rc != 0) {
-        throw ConnectionError("libssh2_init failed. " + this->GetLastErrorMsg());
+// Returns 0 if it could not be stat'ed.
+static uint64_t localModified(const string &local_path) {
+#ifdef __WXMSW__
+    struct _stat s;
+    if (_wstat(localPathUnicode(local_path).c_str(), &s) != 0) {
+        return 0;
     }
-
-    struct addrinfo *result;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;  // Allow IPv4 or IPv6.
-    hints.ai_socktype = SOCK_STREAM;
-
-    rc = getaddrinfo(this->host_desc_.host_.c_str(), to_string(this->host_desc_.port_).c_str(), &hints, &result);
-    if (rc != 0) {
-        throw ConnectionError("failed to resolve hostname " + this->host_desc_.host_);
+#else
+    struct stat s;
+    if (stat(local_path.c_str(), &s) != 0) {
+        return 0;
     }
+#endif
+    return s.st_mtime;
+}
 
-    struct addrinfo *rp;
-    for (rp = result ; rp != NULL ; rp = rp->ai_next) {
-        this->sock_ = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (this->sock_ == -1) {
-            continue;
-        }
-
-        if (connect(this->sock_, rp->ai_addr, rp->ai_addrlen) != -1) {
-            break;  // Success
-        }
+SftpConnection::SftpConnection(HostDesc host_desc) {
+    this->host_desc_ = host_desc;
+    this->session_mutex_ = make_shared<recursive_mutex>();
+    this->spare_channels_ = make_shared<int>(SESSION_SPARE_CHANNELS);
 
-        close(this->sock_);
-    }
+    int rc;
 
-    freeaddrinfo(result);
-    if (rp == NULL) {
-        throw ConnectionError(
-                "could not connect to " + this->host_desc_.host_ + " on port " + to_string(this->host_desc_.port_));
-    }
+    // Winsock and libssh2 are initialized once for the process, in FilesRemoteApp::OnInit, as connections are made
+    // and destroyed from several threads at once, and libssh2_init and libssh2_exit are not thread safe.
+    this->sock_ = ConnectTcp(this->host_desc_.host_, this->host_desc_.port_);
 
     this->session_ = libssh2_session_init();
     if (!this->session_) {
@@ -162,7 +231,7 @@ SftpConnection::SftpConnection(HostDesc host_desc) {
     }
 
     libssh2_session_set_blocking(this->session_, 1);
-    libssh2_session_set_timeout(this->session_, 10 * 1000);  // TODO(allan): higher timeout?
+    libssh2_session_set_timeout(this->session_, SESSION_TIMEOUT_MS);
     libssh2_session_banner_set(this->session_, "SSH-2.0-FilesRemote_" PROJECT_VERSION);
 
     rc = libssh2_session_handshake(this->session_, this->sock_);
@@ -198,7 +267,62 @@ SftpConnection::SftpConnection(HostDesc host_desc) {
     }
 }
 
+SftpConnection::SftpConnection(shared_ptr<SftpConnection> master) {
+    this->master_ = master;
+    this->session_mutex_ = master->session_mutex_;
+    this->spare_channels_ = master->spare_channels_;
+
+    lock_guard<recursive_mutex> lock(*this->session_mutex_);
+    this->host_desc_ = master->host_desc_;
+    this->fingerprint_ = master->fingerprint_;
+    this->exec_listing_supported_ = master->exec_listing_supported_;
+    this->rtt_ms_ = master->rtt_ms_;
+    this->session_ = master->session_;
+    this->sock_ = master->sock_;
+    this->userauth_list = master->userauth_list;
+    this->SftpSubsystemInit();
+}
+
+SessionLock SftpConnection::LockSession() {
+    return SessionLock{this->session_mutex_, unique_lock<recursive_mutex>(*this->session_mutex_)};
+}
+
+// Connections given to SftpConnection::Share, by HostDesc::ToString. Weak, so that a session ends once the last window
+// using it is closed.
+static mutex shared_mutex;
+static map<string, weak_ptr<SftpConnection>> shared_connections;
+
+void SftpConnection::Share(shared_ptr<SftpConnection> conn) {
+    lock_guard<mutex> lock(shared_mutex);
+    shared_connections[conn->host_desc_.ToString()] = conn;
+}
+
+shared_ptr<SftpConnection> SftpConnection::Shared(HostDesc host_desc) {
+    lock_guard<mutex> lock(shared_mutex);
+    auto it = shared_connections.find(host_desc.ToString());
+    if (it == shared_connections.end()) {
+        return nullptr;
+    }
+    return it->second.lock();
+}
+
+void SftpConnection::Unshare() {
+    lock_guard<mutex> lock(shared_mutex);
+    for (auto it = shared_connections.begin() ; it != shared_connections.end() ;) {
+        auto conn = it->second.lock();
+        if (!conn || conn.get() == this || conn == this->master_) {
+            it = shared_connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
 SftpConnection::~SftpConnection() {
+    // Whichever thread lets go of a connection last destroys it, which need not be the one that last used it.
+    lock_guard<recursive_mutex> lock(*this->session_mutex_);
+
+    this->ExecBackgroundStop();
     this->SudoExit();
     if (this->sudo_channel_) {
         libssh2_channel_send_eof(this->sudo_channel_);
@@ -208,10 +332,16 @@ SftpConnection::~SftpConnection() {
         libssh2_channel_free(this->sudo_channel_);
     }
 
+    this->ReleaseSftpPool();
+
     if (this->sftp_session_) {
         libssh2_sftp_shutdown(this->sftp_session_);
     }
 
+    if (this->master_) {
+        return;  // The session stays open for the master, which ends it once it is no longer needed.
+    }
+
     if (this->session_) {
         libssh2_session_disconnect(this->session_, "normal shutdown");
         libssh2_session_free(this->session_);
@@ -224,13 +354,39 @@ SftpConnection::~SftpConnection() {
         close(this->sock_);
 #endif
     }
+}
 
-    libssh2_exit();
+vector<DirEntry> SftpConnection::GetDir(string path, DirEntry *dir_entry) {
+    return *this->GetDirIfChanged(path, nullptr, dir_entry);
 }
 
-vector<DirEntry> SftpConnection::GetDir(string path) {
+optional<vector<DirEntry>> SftpConnection::GetDirIfChanged(string path, const DirEntry *known, DirEntry *dir_entry) {
     int rc;
 
+    // A failed stat is left for opendir below to report.
+    LIBSSH2_SFTP_ATTRIBUTES dir_attrs;
+    rc = libssh2_sftp_stat(this->sftp_session_, path.c_str(), &dir_attrs);
+    if (rc == 0) {
+        DirEntry current(dir_attrs);
+        if (known && current.modified_ == known->modified_ && current.size_ == known->size_
+            && current.mode_ == known->mode_) {
+            return nullopt;
+        }
+        if (dir_entry) {
+            *dir_entry = current;
+        }
+    } else if (dir_entry) {
+        *dir_entry = DirEntry();
+    }
+
+    if (this->exec_listing_supported_ && rc == 0 && (dir_attrs.flags & LIBSSH2_SFTP_ATTR_SIZE)
+        && dir_attrs.filesize >= EXEC_LISTING_MIN_DIR_SIZE) {
+        auto files = this->GetDirExec(path);
+        if (files.has_value()) {
+            return *files;
+        }
+    }
+
     auto sftp_handle_ = SftpHandle(libssh2_sftp_opendir(this->sftp_session_, path.c_str()));
     if (!sftp_handle_.handle_) {
         if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
@@ -247,14 +403,13 @@ vector<DirEntry> SftpConnection::GetDir(string path) {
         throw ConnectionError("libssh2_sftp_opendir failed. " + this->GetLastErrorMsg());
     }
 
+    // Buffers are reused for every entry. libssh2 null terminates what it writes, so no need to clear them.
+    char name[BUFLEN];
+    char line[BUFLEN];
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
     auto files = vector<DirEntry>();
     while (1) {
-        LIBSSH2_SFTP_ATTRIBUTES attrs;
-        char name[BUFLEN];
-        char line[BUFLEN];
-        memset(name, 0, BUFLEN);
-        memset(line, 0, BUFLEN);
-
         rc = libssh2_sftp_readdir_ex(sftp_handle_.handle_, name, sizeof(name), line, sizeof(line), &attrs);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             continue;
@@ -266,57 +421,339 @@ vector<DirEntry> SftpConnection::GetDir(string path) {
             throw ConnectionError("libssh2_sftp_readdir_ex failed. " + this->GetLastErrorMsg());
         }
 
-        auto d = DirEntry(attrs);
-
-        d.name_ = string(name);
-        if (d.name_ == ".") {
+        if (rc == 1 && name[0] == '.') {
             continue;
         }
 
-        // Extract user, group and mode string from the free text line.
-        stringstream s(line);
-        string segment;
-        vector<string> parts;
-        int field_num = 0;
-        while (getline(s, segment, ' ')) {
-            if (segment.empty()) {
-                continue;
-            }
+        files.emplace_back(attrs);
+        auto &d = files.back();
+        d.SetName(string_view(name, rc));
+        auto prev = files.size() > 1 ? &files[files.size() - 2] : nullptr;
+        d.ParseLongEntry(string_view(line, strnlen(line, sizeof(line))), prev);
+    }
 
-            if (field_num == 0) {
-                if (segment.length() != 10) {
-                    // Free text line was in an unexpected format.
-                    break;
-                }
-                d.mode_str_ = string(segment);
-            }
+    if (files.size() == 0) {
+        throw DirListFailedPermission(path);
+    }
 
-            if (field_num == 2) {
-                d.owner_ = string(segment);
-            }
+    this->ResolveLinks(path, &files);
+    return files;
+}
 
-            if (field_num == 3) {
-                d.group_ = string(segment);
-            }
+// Parses one record of the output of the find commands in GetDirExec and LstatManyExec, which looks like
+// "l d 777 12 1600000000.1234567890 user1 group1 file.txt", followed by the symlink target as a separate field. The
+// name is last, as it is the only field that can contain spaces. The second field is the type of what a symlink points
+// to, which is also what decides is_dir_. prev_owner and prev_group are those of the record before, if any, for
+// InternString.
+static bool parseFindRecord(
+        string_view record,
+        string_view link_target,
+        DirEntry *d,
+        const string *prev_owner,
+        const string *prev_group) {
+    string_view fields[7];
+    size_t i = 0;
+    for (int field_num = 0 ; field_num < 7 ; ++field_num) {
+        size_t end = record.find(' ', i);
+        if (end == string_view::npos) {
+            return false;
+        }
+        fields[field_num] = record.substr(i, end - i);
+        i = end + 1;
+    }
+    auto name = record.substr(i);
+    if (fields[0].size() != 1 || fields[1].size() != 1 || name.empty()) {
+        return false;
+    }
 
-            field_num++;
+    uint32_t type;
+    switch (fields[0][0]) {
+        case 'f': type = LIBSSH2_SFTP_S_IFREG; break;
+        case 'd': type = LIBSSH2_SFTP_S_IFDIR; break;
+        case 'l': type = LIBSSH2_SFTP_S_IFLNK; break;
+        case 'c': type = LIBSSH2_SFTP_S_IFCHR; break;
+        case 'b': type = LIBSSH2_SFTP_S_IFBLK; break;
+        case 'p': type = LIBSSH2_SFTP_S_IFIFO; break;
+        case 's': type = LIBSSH2_SFTP_S_IFSOCK; break;
+        default: type = 0;
+    }
+
+    uint32_t perm = 0;
+    for (char c : fields[2]) {
+        if (c < '0' || c > '7') {
+            return false;
         }
+        perm = perm * 8 + (c - '0');
+    }
 
-        files.push_back(d);
+    uint64_t size = 0;
+    for (char c : fields[3]) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        size = size * 10 + (c - '0');
     }
 
-    if (files.size() == 0) {
-        throw DirListFailedPermission(path);
+    uint64_t modified = 0;
+    for (char c : fields[4]) {
+        if (c == '.') {
+            break;  // Sub-second precision is not shown anywhere.
+        }
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        modified = modified * 10 + (c - '0');
+    }
+
+    d->SetName(name);
+    d->mode_ = type | perm;
+    d->is_dir_ = fields[1][0] == 'd';
+    d->link_target_.assign(link_target.data(), link_target.size());
+    d->size_ = size;
+    d->modified_ = modified;
+    d->owner_ = InternString(fields[5], prev_owner);
+    d->group_ = InternString(fields[6], prev_group);
+    return true;
+}
+
+// Splits the output of those find commands into records as it arrives. Each record is two fields terminated by null
+// chars, as names and link targets can contain any other char, including newlines.
+class FindRecordParser {
+    string pending_;
+    // Of the previous record. Kept here rather than pointing into the entries parsed so far, which may have moved
+    // since.
+    const string *prev_owner_ = nullptr;
+    const string *prev_group_ = nullptr;
+
+public:
+    bool malformed_ = false;
+
+    void Feed(string_view output, function<void(DirEntry &&)> on_entry) {
+        this->pending_.append(output.data(), output.size());
+        string_view pending(this->pending_);
+        size_t start = 0;
+        while (1) {
+            size_t record_end = pending.find('\0', start);
+            size_t link_end = record_end == string_view::npos ? record_end : pending.find('\0', record_end + 1);
+            if (link_end == string_view::npos) {
+                break;
+            }
+            DirEntry d;
+            auto record = pending.substr(start, record_end - start);
+            auto link_target = pending.substr(record_end + 1, link_end - record_end - 1);
+            if (parseFindRecord(record, link_target, &d, this->prev_owner_, this->prev_group_)) {
+                this->prev_owner_ = d.owner_;
+                this->prev_group_ = d.group_;
+                on_entry(std::move(d));
+            } else {
+                this->malformed_ = true;
+            }
+            start = link_end + 1;
+        }
+        this->pending_.erase(0, start);
     }
 
+    // Whether the output ended in the middle of a record.
+    bool Incomplete() const {
+        return !this->pending_.empty();
+    }
+};
+
+// Lists a directory by running GNU find over an exec channel, which streams one compact record per entry instead of
+// the SFTP readdir packets with their preformatted long names. Returns nullopt if the listing could not be done this
+// way, in which case the caller should fall back to SFTP.
+optional<vector<DirEntry>> SftpConnection::GetDirExec(string path) {
+    string cmd = "find " + ShellQuote(path) + " -mindepth 1 -maxdepth 1 -printf '%y %Y %m %s %T@ %u %g %f\\0%l\\0'";
+
+    auto files = vector<DirEntry>();
+    FindRecordParser parser;
+    string err_output;
+    int status;
+    try {
+        status = this->Exec(cmd, [&](string_view output) {
+            parser.Feed(output, [&](DirEntry &&d) {
+                files.push_back(std::move(d));
+            });
+        }, &err_output);
+    } catch (ChannelRefused) {
+        return nullopt;  // Over SFTP instead, which needs no channel of its own.
+    }
+
+    if (status == 127 || err_output.find("-printf") != string::npos) {
+        // No find, or one without -printf, such as BSD or BusyBox find. No point in trying again on this host.
+        this->exec_listing_supported_ = false;
+        return nullopt;
+    }
+    if (status != 0 || parser.malformed_ || parser.Incomplete()) {
+        // For example permission denied. Let the SFTP listing surface the error as usual.
+        return nullopt;
+    }
+
+    // SFTP listings include a parent dir entry, which is handy for navigation, so keep that consistent.
+    DirEntry parent_dir_entry;
+    parent_dir_entry.SetName("..");
+    parent_dir_entry.mode_ = LIBSSH2_SFTP_S_IFDIR;
+    parent_dir_entry.is_dir_ = true;
+    files.push_back(parent_dir_entry);
+
     return files;
 }
 
+int SftpConnection::Exec(
+        string cmd,
+        function<void(string_view)> on_output,
+        string *err_output,
+        function<bool(void)> cancelled,
+        bool long_running) {
+    // Started blocking, as the sudo password is passed along the way, and then waited on without blocking, so that
+    // waiting can be cancelled at any point.
+    vector<string> cmds{cmd};
+    MuxExecWorker::Queue queue{cmds, [&](size_t, string_view output) {
+        on_output(output);
+    }, vector<int>{-1}, vector<string>(1), 1, 1};
+    MuxExecWorker worker(&queue, 0, this->ExecStart(cmd));
+    if (!SessionMux(this->session_, this->sock_).Run({&worker}, cancelled, long_running)) {
+        return -1;  // Channel gets closed by the worker, which ends the command.
+    }
+    err_output->append(queue.err_outputs[0]);
+    return queue.statuses[0];
+}
+
+optional<vector<ExecResult>> SftpConnection::ExecMany(
+        const vector<string> &cmds,
+        function<void(size_t, string_view)> on_output,
+        function<bool(void)> cancelled,
+        bool long_running) {
+    vector<ExecResult> results(cmds.size());
+    if (this->sudo_ || cmds.size() == 1) {
+        // Under sudo, each command waits for its password prompt to be answered, which is done blocking.
+        for (size_t i = 0 ; i < cmds.size() ; ++i) {
+            results[i].status = this->Exec(cmds[i], [&](string_view output) {
+                on_output(i, output);
+            }, &results[i].err_output, cancelled, long_running);
+            if (results[i].status == -1) {
+                return nullopt;
+            }
+        }
+        return results;
+    }
+
+    // Any channels past the first come out of the spare ones of the session, which other connections onto it share.
+    SpareChannels spare(this->spare_channels_, static_cast<int>(min<size_t>(cmds.size(), EXEC_MANY_CHANNELS)) - 1);
+    MuxExecWorker::Queue queue{cmds, on_output, vector<int>(cmds.size(), -1), vector<string>(cmds.size())};
+    vector<unique_ptr<MuxExecWorker>> workers;
+    vector<MuxJob *> jobs;
+    for (int i = 0 ; i < 1 + spare.taken_ ; ++i) {
+        workers.push_back(make_unique<MuxExecWorker>(&queue));
+        jobs.push_back(workers.back().get());
+    }
+    queue.workers = workers.size();
+    if (!SessionMux(this->session_, this->sock_).Run(jobs, cancelled, long_running)) {
+        return nullopt;
+    }
+    for (size_t i = 0 ; i < cmds.size() ; ++i) {
+        results[i] = ExecResult{queue.statuses[i], queue.err_outputs[i]};
+    }
+    return results;
+}
+
+void SftpConnection::ExecBackgroundStart(string cmd) {
+    this->ExecBackgroundStop();
+    this->background_channel_ = this->ExecStart(cmd);
+}
+
+optional<string> SftpConnection::ExecBackgroundPoll() {
+    if (!this->background_channel_) {
+        return nullopt;
+    }
+
+    // Only for the duration of this read, so nothing else ever sees the session in non-blocking mode.
+    string output;
+    char buf[BUFLEN];
+    ssize_t n;
+    libssh2_session_set_blocking(this->session_, 0);
+    while ((n = libssh2_channel_read(this->background_channel_, buf, BUFLEN)) > 0) {
+        output.append(buf, n);
+    }
+    libssh2_session_set_blocking(this->session_, 1);
+
+    if (n == LIBSSH2_ERROR_EAGAIN || (n == 0 && !libssh2_channel_eof(this->background_channel_))) {
+        return output;
+    }
+    if (n < 0) {
+        throw ConnectionError("libssh2_channel_read failed. " + this->GetLastErrorMsg());
+    }
+
+    // The command exited. Whatever it wrote last is of no use without what would have followed.
+    this->ExecBackgroundStop();
+    return nullopt;
+}
+
+void SftpConnection::ExecBackgroundStop() {
+    if (this->background_channel_) {
+        // Not waiting for the command to exit, which for a monitor like inotifywait only happens once it next tries
+        // to write to the closed channel.
+        libssh2_channel_close(this->background_channel_);
+        libssh2_channel_free(this->background_channel_);
+        this->background_channel_ = NULL;
+    }
+}
+
+void SftpConnection::ReleaseSftpPool() {
+    for (auto sftp : this->sftp_pool_) {
+        libssh2_sftp_shutdown(sftp);
+    }
+    *this->spare_channels_ += static_cast<int>(this->sftp_pool_.size());
+    this->sftp_pool_.clear();
+    this->sftp_pool_full_ = false;  // What the server refused before may be free by the time the pool is next needed.
+}
+
+LIBSSH2_CHANNEL *SftpConnection::ExecStart(const string &cmd) {
+    int rc;
+
+    // Workaround for for edge case of the sudo password changing after the sudo elevation started.
+    this->VerifySudoStillValid();
+
+    ChannelHandle channel(libssh2_channel_open_session(this->session_));
+    if (!channel.channel_) {
+        this->ChannelOpenFailed("libssh2_channel_open_session");
+    }
+
+    if (this->sudo_) {
+        rc = libssh2_channel_exec(channel.channel_, ("sudo -p password: -S " + cmd).c_str());
+        if (rc != 0) {
+            throw ConnectionError("libssh2_channel_exec failed. " + this->GetLastErrorMsg());
+        }
+
+        if (this->sudo_passwd_.IsOk()) {
+            this->SendSudoPasswd(channel.channel_);
+        }
+    } else {
+        rc = libssh2_channel_exec(channel.channel_, cmd.c_str());
+        if (rc != 0) {
+            throw ConnectionError("libssh2_channel_exec failed. " + this->GetLastErrorMsg());
+        }
+    }
+
+    auto started = channel.channel_;
+    channel.channel_ = NULL;  // Now owned by the caller.
+    return started;
+}
+
+void SftpConnection::ChannelOpenFailed(const string &what) {
+    if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_CHANNEL_FAILURE) {
+        throw ChannelRefused(what + " failed. " + this->GetLastErrorMsg());
+    }
+    throw ConnectionError(what + " failed. " + this->GetLastErrorMsg());
+}
+
 bool SftpConnection::DownloadFile(
         string remote_src_path,
         string local_dst_path,
         function<bool(void)> cancelled,
-        function<void(string, uint64_t, uint64_t, uint64_t)> progress) {
+        function<void(uint64_t, uint64_t)> progress,
+        TransferPoint *point) {
+    SessionTimeout timeout(this->session_, this->StallTimeoutMs());
     auto sftp_handle_ = SftpHandle(
             libssh2_sftp_open(
                     this->sftp_session_,
@@ -341,16 +778,42 @@ bool SftpConnection::DownloadFile(
     }
     DirEntry entry(attrs);
 
+    uint64_t offset = 0;
+    if (point && point->source_modified == entry.modified_ && point->offset <= entry.size_) {
+        offset = point->offset;
+    }
+    if (point) {
+        point->offset = offset;
+        point->source_modified = entry.modified_;
+    }
+
     {  // Scoping for local_file_handle_
+        // Keeping what an earlier attempt got, if carrying on from that.
+        auto local_file_handle_ = FileHandle(NULL);
+        if (offset > 0) {
+#ifdef __WXMSW__
+            local_file_handle_.handle_ = _wfopen(localPathUnicode(local_dst_path).c_str(), L"r+b");
+#else
+            local_file_handle_.handle_ = fopen(local_dst_path.c_str(), "r+b");
+#endif
+            if (local_file_handle_.handle_) {
+                offset = min(offset, fileSize(local_file_handle_.handle_));
+                seekFile(local_file_handle_.handle_, offset);
+            } else {
+                offset = 0;
+            }
+        }
+        if (!local_file_handle_.handle_) {
 #ifdef __WXMSW__
-        auto local_file_handle_ = FileHandle(_wfopen(localPathUnicode(local_dst_path).c_str(), L"wb"));
+            local_file_handle_.handle_ = _wfopen(localPathUnicode(local_dst_path).c_str(), L"wb");
 #else
-        auto local_file_handle_ = FileHandle(fopen(local_dst_path.c_str(), "wb"));
+            local_file_handle_.handle_ = fopen(local_dst_path.c_str(), "wb");
 #endif
+        }
         // TODO(allan): error handling for fopen.
+        libssh2_sftp_seek64(sftp_handle_.handle_, offset);
 
-        uint64_t received = 0, prev_received = 0;
-        auto start_time = steady_clock::now();
+        uint64_t received = offset;
 
         char buf[LARGE_BUFLEN];
         while (1) {
@@ -362,6 +825,9 @@ bool SftpConnection::DownloadFile(
                 fwrite(buf, 1, rc, local_file_handle_.handle_);
                 // TODO(allan): error handling for fwrite.
                 received += rc;
+                if (point) {
+                    point->offset = received;
+                }
             } else if (rc == 0) {
                 break;
             } else {
@@ -371,16 +837,8 @@ bool SftpConnection::DownloadFile(
                 throw ConnectionError("libssh2_sftp_read failed. " + this->GetLastErrorMsg());
             }
 
-            auto now = steady_clock::now();
-            auto d = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
-            if (d > 500) {
-                if (progress) {
-                    uint64_t bytes_per_sec = static_cast<uint64_t>((static_cast<float>(received - prev_received)) /
-                                                                   (static_cast<float>(d) / 1000.0));
-                    progress(remote_src_path, received, entry.size_, bytes_per_sec);
-                }
-                start_time = now;
-                prev_received = received;
+            if (progress) {
+                progress(received, entry.size_);
             }
         }
     }
@@ -409,13 +867,31 @@ bool SftpConnection::UploadFile(
         string local_src_path,
         string remote_dst_path,
         function<bool(void)> cancelled,
-        function<void(string, uint64_t, uint64_t, uint64_t)> progress) {
+        function<void(uint64_t, uint64_t)> progress,
+        TransferPoint *point) {
+    SessionTimeout timeout(this->session_, this->StallTimeoutMs());
+    this->InvalidateStatCache(remote_dst_path);
+
+    // What the host has of the file is what it acknowledged of an earlier attempt, if carrying on from that.
+    uint64_t modified = localModified(local_src_path);
+    uint64_t offset = 0;
+    if (point && point->offset > 0 && point->source_modified == modified) {
+        auto remote_entry = this->Lstat(remote_dst_path);
+        if (remote_entry.has_value()) {
+            offset = min(point->offset, remote_entry->size_);
+        }
+    }
+    if (point) {
+        point->offset = offset;
+        point->source_modified = modified;
+    }
+
     int mode = LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR | LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IROTH;
     auto sftp_openfile_handle_ = SftpHandle(
             libssh2_sftp_open(
                     this->sftp_session_,
                     remote_dst_path.c_str(),
-                    LIBSSH2_FXF_WRITE | LIBSSH2_FXF_TRUNC | LIBSSH2_FXF_CREAT,
+                    LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | (offset > 0 ? 0 : LIBSSH2_FXF_TRUNC),
                     mode));
     if (!sftp_openfile_handle_.handle_) {
         if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
@@ -438,13 +914,12 @@ bool SftpConnection::UploadFile(
 #endif
     // TODO(allan): error handling for fopen.
 
-    fseek(local_file_handle_.handle_, 0, SEEK_END);
-    uint64_t file_len = ftell(local_file_handle_.handle_);
-    fseek(local_file_handle_.handle_, 0, SEEK_SET);
-
-    auto start_time = steady_clock::now();
+    uint64_t file_len = fileSize(local_file_handle_.handle_);
+    offset = min(offset, file_len);
+    seekFile(local_file_handle_.handle_, offset);
+    libssh2_sftp_seek64(sftp_openfile_handle_.handle_, offset);
 
-    uint64_t sent = 0, prev_sent = 0;
+    uint64_t sent = offset;
     char buf[LARGE_BUFLEN];
     while (1) {
         if (cancelled && cancelled()) {
@@ -455,7 +930,7 @@ bool SftpConnection::UploadFile(
             int nremain = rc;
             char *p = buf;
             while (nremain) {
-                rc = libssh2_sftp_write(sftp_openfile_handle_.handle_, buf, nremain);
+                rc = libssh2_sftp_write(sftp_openfile_handle_.handle_, p, nremain);
                 if (rc < 0) {
                     if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
                         uint64_t err = libssh2_sftp_last_error(this->sftp_session_);
@@ -471,23 +946,17 @@ bool SftpConnection::UploadFile(
                 sent += rc;
                 p += rc;
                 nremain -= rc;
+                if (point) {
+                    point->offset = sent;
+                }
             }
         } else {
             // TODO(allan): error handling for fread.
             break;
         }
 
-        auto now = steady_clock::now();
-        auto d = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
-        if (d > 500) {
-            if (progress) {
-                uint64_t bytes_per_sec = static_cast<uint64_t>((static_cast<float>(sent - prev_sent)) /
-                                                               (static_cast<float>(d) / 1000.0));
-
-                progress(remote_dst_path, sent, file_len, bytes_per_sec);
-            }
-            start_time = now;
-            prev_sent = sent;
+        if (progress) {
+            progress(sent, file_len);
         }
     }
 
@@ -495,17 +964,102 @@ bool SftpConnection::UploadFile(
 }
 
 optional<DirEntry> SftpConnection::Stat(string remote_path) {
-    auto sftp_handle_ = SftpHandle(
-            libssh2_sftp_open(
-                    this->sftp_session_,
-                    remote_path.c_str(),
-                    0,
-                    0));
+    return this->StatEx(remote_path, LIBSSH2_SFTP_STAT);
+}
 
-    if (!sftp_handle_.handle_) {
+optional<DirEntry> SftpConnection::Lstat(string remote_path) {
+    return this->StatEx(remote_path, LIBSSH2_SFTP_LSTAT);
+}
+
+optional<DirEntry> SftpConnection::LstatWithNames(string remote_path) {
+    if (this->exec_listing_supported_) {
+        vector<optional<DirEntry>> entries(1);
+        if (this->LstatManyExec({remote_path}, &entries)) {
+            return entries[0];
+        }
+    }
+    return this->Lstat(remote_path);
+}
+
+optional<DirEntry> SftpConnection::StatCached(string remote_path) {
+    auto now = steady_clock::now();
+    auto it = this->stat_cache_.find(remote_path);
+    if (it != this->stat_cache_.end() && now - it->second.first < milliseconds(STAT_CACHE_TTL_MS)) {
+        return it->second.second;
+    }
+
+    auto entry = this->Stat(remote_path);
+    if (entry.has_value()) {
+        if (this->stat_cache_.size() >= STAT_CACHE_MAX_ENTRIES) {
+            this->stat_cache_.clear();  // Everything in it is about to expire anyway.
+        }
+        this->stat_cache_[remote_path] = make_pair(now, *entry);
+    } else if (it != this->stat_cache_.end()) {
+        this->stat_cache_.erase(it);
+    }
+    return entry;
+}
+
+vector<optional<DirEntry>> SftpConnection::LstatMany(const vector<string> &remote_paths) {
+    vector<optional<DirEntry>> entries(remote_paths.size());
+    if (this->exec_listing_supported_ && remote_paths.size() >= STAT_MANY_EXEC_MIN_PATHS) {
+        if (this->LstatManyExec(remote_paths, &entries)) {
+            return entries;
+        }
+    }
+
+    // Several at a time over SFTP, rather than waiting for each before sending the next.
+    SftpAsync async(this);
+    vector<future<optional<DirEntry>>> futures;
+    for (auto &path : remote_paths) {
+        futures.push_back(async.Lstat(path, true));
+    }
+    async.Run();
+    for (size_t i = 0 ; i < remote_paths.size() ; ++i) {
+        entries[i] = futures[i].get();  // Throws FailedPermission like Lstat does.
+    }
+    return entries;
+}
+
+void SftpConnection::ResolveLinks(const string &dir, vector<DirEntry> *entries) {
+    vector<DirEntry *> links;
+    vector<string> paths;
+    for (auto &e : *entries) {
+        if (LIBSSH2_SFTP_S_ISLNK(e.mode_) && e.link_target_.empty()) {
+            links.push_back(&e);
+            paths.push_back(normalize_path(dir + "/" + e.name_));
+        }
+    }
+    if (paths.empty()) {
+        return;
+    }
+
+    vector<optional<DirEntry>> resolved;
+    try {
+        resolved = this->LstatMany(paths);
+    } catch (FailedPermission) {
+        return;  // The directory can be listed, but not looked into. Shown as plain symlinks.
+    }
+    for (size_t i = 0 ; i < paths.size() ; ++i) {
+        if (resolved[i].has_value() && LIBSSH2_SFTP_S_ISLNK(resolved[i]->mode_)) {
+            links[i]->link_target_ = resolved[i]->link_target_;
+            links[i]->is_dir_ = resolved[i]->is_dir_;
+        }
+    }
+}
+
+optional<DirEntry> SftpConnection::StatEx(const string &remote_path, int stat_type) {
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc = libssh2_sftp_stat_ex(
+            this->sftp_session_,
+            remote_path.c_str(),
+            static_cast<unsigned int>(remote_path.size()),
+            stat_type,
+            &attrs);
+    if (rc != 0) {
         if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
             uint64_t err = libssh2_sftp_last_error(this->sftp_session_);
-            if (err == LIBSSH2_FX_PERMISSION_DENIED || err == LIBSSH2_FX_WRITE_PROTECT) {
+            if (err == LIBSSH2_FX_PERMISSION_DENIED) {
                 throw FailedPermission(remote_path);
             }
             return nullopt;
@@ -513,16 +1067,120 @@ optional<DirEntry> SftpConnection::Stat(string remote_path) {
         throw ConnectionError(this->GetLastErrorMsg());
     }
 
-    LIBSSH2_SFTP_ATTRIBUTES attrs;
-    if (libssh2_sftp_fstat(sftp_handle_.handle_, &attrs) != 0) {
-        throw ConnectionError(this->GetLastErrorMsg());
-    }
-
     DirEntry entry(attrs);
     return entry;
 }
 
+void SftpConnection::InvalidateStatCache(const string &remote_path) {
+    // Whatever is below remote_path if it is a dir, and its parent dir, whose modification time changes with it.
+    this->stat_cache_.erase(normalize_path(remote_path + "/.."));
+    auto it = this->stat_cache_.lower_bound(remote_path);
+    while (it != this->stat_cache_.end() && it->first.compare(0, remote_path.size(), remote_path) == 0) {
+        if (it->first.size() == remote_path.size() || it->first[remote_path.size()] == '/') {
+            it = this->stat_cache_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Whether every line find wrote to stderr, in the C locale, is about a path that does not exist.
+static bool onlyMissingPaths(const string &err_output) {
+    const string_view missing = ": No such file or directory";
+    size_t start = 0;
+    while (start < err_output.size()) {
+        size_t end = err_output.find('\n', start);
+        if (end == string::npos) {
+            end = err_output.size();
+        }
+        string_view line(err_output.data() + start, end - start);
+        if (line.size() < missing.size() || line.substr(line.size() - missing.size()) != missing) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// Stats remote_paths with find over exec channels, a batch of them per find, which takes a round trip per batch rather
+// than one per path. Returns false if this could not be done, in which case the caller should fall back to SFTP.
+bool SftpConnection::LstatManyExec(const vector<string> &remote_paths, vector<optional<DirEntry>> *entries) {
+    // Same record format as in GetDirExec, but with the path as given rather than just the name, to match them up.
+    vector<string> cmds;
+    for (size_t begin = 0 ; begin < remote_paths.size() ; begin += STAT_MANY_EXEC_BATCH) {
+        // In the C locale, so that its messages can be told apart. Through env, as sudo may not pass on variables.
+        string cmd = "env LC_ALL=C find";
+        for (size_t i = begin ; i < std::min(remote_paths.size(), begin + STAT_MANY_EXEC_BATCH) ; ++i) {
+            cmd += " " + ShellQuote(remote_paths[i]);
+        }
+        cmds.push_back(cmd + " -maxdepth 0 -printf '%y %Y %m %s %T@ %u %g %p\\0%l\\0'");
+    }
+
+    map<string, DirEntry> found;
+    vector<FindRecordParser> parsers(cmds.size());
+    optional<vector<ExecResult>> results;
+    try {
+        results = this->ExecMany(cmds, [&](size_t i, string_view output) {
+            parsers[i].Feed(output, [&](DirEntry &&d) {
+                found[d.name_] = std::move(d);
+            });
+        });
+    } catch (ChannelRefused) {
+        return false;
+    }
+
+    if (!results.has_value()) {
+        return false;
+    }
+    for (size_t i = 0 ; i < cmds.size() ; ++i) {
+        auto &r = (*results)[i];
+        if (r.status == 127 || r.err_output.find("-printf") != string::npos) {
+            this->exec_listing_supported_ = false;
+            return false;
+        }
+        // Status 1 with nothing but missing paths on stderr still answers every path. Anything else, such as
+        // permission denied, or sudo failing, which also exits with 1, is left for SFTP to report.
+        if ((r.status != 0 && (r.status != 1 || !onlyMissingPaths(r.err_output))) || parsers[i].malformed_
+            || parsers[i].Incomplete()) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0 ; i < remote_paths.size() ; ++i) {
+        auto it = found.find(remote_paths[i]);
+        if (it != found.end()) {
+            it->second.SetName(basename(remote_paths[i]));
+            (*entries)[i] = it->second;
+        } else {
+            (*entries)[i] = nullopt;
+        }
+    }
+    return true;
+}
+
+vector<LIBSSH2_SFTP *> SftpConnection::SftpPool() {
+    if (this->sudo_) {
+        return {this->sftp_session_};
+    }
+    while (!this->sftp_pool_full_ && this->sftp_pool_.size() < SFTP_POOL_SIZE && *this->spare_channels_ > 0) {
+        auto sftp = libssh2_sftp_init(this->session_);
+        if (!sftp) {
+            // Most likely over the server's limit on channels per connection, which is fine, just slower.
+            this->sftp_pool_full_ = true;
+            break;
+        }
+        this->sftp_pool_.push_back(sftp);
+        (*this->spare_channels_)--;
+    }
+
+    vector<LIBSSH2_SFTP *> pool{this->sftp_session_};
+    pool.insert(pool.end(), this->sftp_pool_.begin(), this->sftp_pool_.end());
+    return pool;
+}
+
 void SftpConnection::Rename(string remote_old_path, string remote_new_path) {
+    this->InvalidateStatCache(remote_old_path);
+    this->InvalidateStatCache(remote_new_path);
     int rc = libssh2_sftp_rename(this->sftp_session_, remote_old_path.c_str(), remote_new_path.c_str());
     if (rc != 0) {
         if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
@@ -537,9 +1195,10 @@ void SftpConnection::Rename(string remote_old_path, string remote_new_path) {
 }
 
 void SftpConnection::Delete(string remote_path) {
-    int rc;
+    this->InvalidateStatCache(remote_path);
 
-    auto entry = this->Stat(remote_path);
+    int rc;
+    auto entry = this->Lstat(remote_path);  // A symlink to a dir is removed like a file.
     if (entry.has_value() && !entry->is_dir_) {  // Single files are easiest to just do via the SFTP channel.
         rc = libssh2_sftp_unlink(this->sftp_session_, remote_path.c_str());
         if (rc != 0) {
@@ -604,6 +1263,7 @@ void SftpConnection::Delete(string remote_path) {
 }
 
 void SftpConnection::Mkdir(string remote_path) {
+    this->InvalidateStatCache(remote_path);
     int mode = LIBSSH2_SFTP_S_IRWXU | LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IXGRP | LIBSSH2_SFTP_S_IROTH |
                LIBSSH2_SFTP_S_IXOTH;
     int rc = libssh2_sftp_mkdir(this->sftp_session_, remote_path.c_str(), mode);
@@ -619,7 +1279,30 @@ void SftpConnection::Mkdir(string remote_path) {
     }
 }
 
+void SftpConnection::Chmod(string remote_path, uint32_t mode) {
+    this->InvalidateStatCache(remote_path);
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.flags = LIBSSH2_SFTP_ATTR_PERMISSIONS;
+    attrs.permissions = mode;
+    int rc = libssh2_sftp_setstat(this->sftp_session_, remote_path.c_str(), &attrs);
+    if (rc != 0) {
+        if (libssh2_session_last_errno(this->session_) == LIBSSH2_ERROR_SFTP_PROTOCOL) {
+            uint64_t err = libssh2_sftp_last_error(this->sftp_session_);
+            if (err == LIBSSH2_FX_PERMISSION_DENIED || err == LIBSSH2_FX_WRITE_PROTECT) {
+                throw FailedPermission(remote_path.c_str());
+            }
+            if (err == LIBSSH2_FX_NO_SUCH_PATH || err == LIBSSH2_FX_NO_SUCH_FILE) {
+                throw FileNotFound(remote_path);
+            }
+            throw UploadFailed(remote_path.c_str());
+        }
+        throw ConnectionError(this->GetLastErrorMsg());
+    }
+}
+
 void SftpConnection::Mkfile(string remote_path) {
+    this->InvalidateStatCache(remote_path);
     int mode = LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR | LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IROTH;
     auto sftp_openfile_handle_ = SftpHandle(
             libssh2_sftp_open(
@@ -653,8 +1336,12 @@ string SftpConnection::RealPath(string remote_path) {
     return string(buf, rc);
 }
 
-static char *kbd_callback_passwd = NULL;
-static int kbd_callback_passwd_len = 0;
+// The password for kbd_callback to answer with. Passed through the abstract pointer of the session, rather than a
+// global, as connections to different hosts may be authenticating on different threads at once.
+struct KbdCallbackPasswd {
+    const char *data;
+    size_t size;
+};
 
 static void kbd_callback(
         const char *name,
@@ -670,8 +1357,11 @@ static void kbd_callback(
         return;
     }
 
-    responses[0].text = kbd_callback_passwd;
-    responses[0].length = kbd_callback_passwd_len;
+    // libssh2 documentation says it will free this memory, so a copy for each response.
+    auto passwd = reinterpret_cast<const KbdCallbackPasswd *>(*abstract);
+    responses[0].text = reinterpret_cast<char *>(malloc(passwd->size));
+    memcpy(responses[0].text, passwd->data, passwd->size);
+    responses[0].length = passwd->size;
 }
 
 bool SftpConnection::PasswordAuth(wxSecretValue passwd) {
@@ -690,16 +1380,13 @@ bool SftpConnection::PasswordAuth(wxSecretValue passwd) {
             throw ConnectionError("libssh2_userauth_password failed. " + this->GetLastErrorMsg());
         }
     } else if (regex_search(this->userauth_list, regex("(^|,)keyboard-interactive($|,)"))) {
-        // libssh2 documentation says it will free this memory.
-        kbd_callback_passwd = reinterpret_cast<char *>(malloc(passwd.GetSize()));
-        memcpy(kbd_callback_passwd, p, passwd.GetSize());
-        kbd_callback_passwd_len = passwd.GetSize();
+        KbdCallbackPasswd kbd_passwd{p, passwd.GetSize()};
+        *libssh2_session_abstract(this->session_) = &kbd_passwd;
         int rc = libssh2_userauth_keyboard_interactive(
                 this->session_,
                 this->host_desc_.username_.c_str(),
                 &kbd_callback);
-        kbd_callback_passwd = NULL;
-        kbd_callback_passwd_len = 0;
+        *libssh2_session_abstract(this->session_) = NULL;
         if (rc == LIBSSH2_ERROR_AUTHENTICATION_FAILED) {
             return false;
         } else if (rc) {
@@ -772,19 +1459,41 @@ bool SftpConnection::KeyAuth() {
     return false;
 }
 
-void SftpConnection::SendKeepAlive() {
-    // The actual libssh2_keepalive_send doesn't really seem to work, so doing this instead as a workaround.
-    try {
-        this->RealPath(".");
-    } catch (ConnectionError) {
-        throw ConnectionError("keep-alive failed");
+void SftpConnection::Heartbeat() {
+    // Not in blocking mode, where waiting is up to the session timeout.
+    int stall_timeout_ms = this->StallTimeoutMs();
+    auto started = steady_clock::now();
+    libssh2_session_set_blocking(this->session_, 0);
+    BlockingRestorer restorer(this->session_);
+
+    // The root is there on any host, and anyone can stat it.
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    int rc;
+    while ((rc = libssh2_sftp_stat_ex(this->sftp_session_, "/", 1, LIBSSH2_SFTP_STAT, &attrs))
+           == LIBSSH2_ERROR_EAGAIN) {
+        auto waited = duration_cast<milliseconds>(steady_clock::now() - started).count();
+        if (waited >= stall_timeout_ms
+            || !WaitForSession(this->session_, this->sock_, static_cast<int>(stall_timeout_ms - waited))) {
+            throw ConnectionError("no response from the host in " + to_string(stall_timeout_ms) + " ms");
+        }
     }
+    if (rc < 0 && libssh2_session_last_errno(this->session_) != LIBSSH2_ERROR_SFTP_PROTOCOL) {
+        throw ConnectionError("heartbeat failed. " + this->GetLastErrorMsg());
+    }
+
+    // Smoothed the way TCP does it (RFC 6298), so that one slow response does not move it much.
+    int64_t rtt_ms = duration_cast<milliseconds>(steady_clock::now() - started).count();
+    this->rtt_ms_ = this->rtt_ms_ ? (this->rtt_ms_ * 7 + rtt_ms) / 8 : rtt_ms;
+}
+
+int SftpConnection::StallTimeoutMs() {
+    return static_cast<int>(max<int64_t>(STALL_TIMEOUT_MIN_MS, this->rtt_ms_ * STALL_TIMEOUT_RTTS));
 }
 
 void SftpConnection::SftpSubsystemInit() {
     this->sftp_session_ = libssh2_sftp_init(this->session_);
     if (!this->sftp_session_) {
-        throw ConnectionError("libssh2_sftp_init failed. " + this->GetLastErrorMsg());
+        this->ChannelOpenFailed("libssh2_sftp_init");
     }
 
     this->home_dir_ = this->RealPath(".");
@@ -801,6 +1510,7 @@ void SftpConnection::SudoEnter(bool needs_passwd_again) {
     if (this->sudo_) {
         return;
     }
+    this->stat_cache_.clear();  // What is visible changes with the privileges.
 
     // Recreating the channel too many times causes the connection to drop, so reuse existing channel instead.
     if (this->sudo_channel_ != NULL) {
@@ -814,7 +1524,7 @@ void SftpConnection::SudoEnter(bool needs_passwd_again) {
 
     LIBSSH2_CHANNEL *channel = libssh2_channel_open_session(this->session_);
     if (!channel) {
-        throw ConnectionError("libssh2_channel_open_session failed. " + this->GetLastErrorMsg());
+        this->ChannelOpenFailed("libssh2_channel_open_session");
     }
 
     auto sftp_server_paths = vector<string>{
@@ -884,6 +1594,7 @@ void SftpConnection::SudoExit() {
     if (!this->sudo_) {
         return;
     }
+    this->stat_cache_.clear();
 
     // Replace with orig channel.
     void **pp = reinterpret_cast<void **>(this->sftp_session_);  // First member of struct LIBSSH2_SFTP is channel.
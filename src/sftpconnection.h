@@ -5,9 +5,15 @@
 
 #include <wx/secretstore.h>
 
+#include <chrono>  // NOLINT
 #include <future>  // NOLINT
+#include <map>
+#include <memory>
+#include <mutex>  // NOLINT
 #include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include "src/direntry.h"
@@ -16,9 +22,16 @@
 
 using std::exception;
 using std::function;
+using std::map;
 using std::optional;
+using std::pair;
+using std::recursive_mutex;
+using std::shared_ptr;
 using std::string;
+using std::string_view;
+using std::unique_lock;
 using std::vector;
+using std::chrono::steady_clock;
 
 class DownloadFailed : public exception {
 public:
@@ -84,6 +97,13 @@ public:
     explicit ConnectionError(string msg) : msg_(msg) {}
 };
 
+// The host refused to open another channel on a session that is otherwise fine, most likely as it is at its limit on
+// channels per connection, such as MaxSessions of OpenSSH. Where that makes no difference, caught as ConnectionError.
+class ChannelRefused : public ConnectionError {
+public:
+    explicit ChannelRefused(string msg) : ConnectionError(msg) {}
+};
+
 class SudoFailed : public exception {
 public:
     string msg_;
@@ -92,6 +112,29 @@ public:
 };
 
 
+#define EXEC_MANY_CHANNELS 3  // Commands ExecMany runs at once. Servers commonly allow 10 channels per connection.
+
+// Channels that the connections onto one session may open between them for SftpPool and ExecMany, on top of the few
+// each keeps open, so that a couple of windows on the host stay within the usual limit of 10.
+#define SESSION_SPARE_CHANNELS 3
+
+struct ExecResult {
+    int status;
+    string err_output;
+};
+
+// How far a transfer got, so that it can carry on from there after the connection failed, rather than start over.
+struct TransferPoint {
+    uint64_t offset = 0;  // Bytes read from the source and acknowledged as written to the destination.
+    uint64_t source_modified = 0;  // Of the source when the transfer started, to tell if it changed since. 0 if not.
+};
+
+// Holds the lock on a session that may be shared between connections. See SftpConnection::LockSession.
+struct SessionLock {
+    shared_ptr<recursive_mutex> mutex;
+    unique_lock<recursive_mutex> lock;
+};
+
 class SftpConnection {
 private:
     LIBSSH2_SESSION *session_ = NULL;
@@ -101,6 +144,15 @@ private:
     char *userauth_list = NULL;
     LIBSSH2_CHANNEL *sudo_channel_ = NULL;
     LIBSSH2_CHANNEL *non_sudo_channel_ = NULL;
+    bool exec_listing_supported_ = true;  // Cleared once the host turns out not to have a find supporting -printf.
+    LIBSSH2_CHANNEL *background_channel_ = NULL;
+    vector<LIBSSH2_SFTP *> sftp_pool_;  // Extra SFTP sessions, for requests in flight at once. See SftpPool.
+    bool sftp_pool_full_ = false;  // Set once the server refuses to open more, until the pool is released.
+    shared_ptr<int> spare_channels_;  // What is left of SESSION_SPARE_CHANNELS. Shared like session_mutex_.
+    map<string, pair<steady_clock::time_point, DirEntry>> stat_cache_;  // For StatCached. Keyed by path.
+    shared_ptr<SftpConnection> master_;  // Whose session this is, if opened onto that of another connection.
+    shared_ptr<recursive_mutex> session_mutex_;  // Shared with master_ and other connections onto the same session.
+    int64_t rtt_ms_ = 0;  // Smoothed round trip time, as measured by Heartbeat. 0 until then.
 
 public:
     string home_dir_ = "";
@@ -110,22 +162,71 @@ public:
 
     explicit SftpConnection(HostDesc host_desc);
 
-    vector<DirEntry> GetDir(string path);
+    // Opens a connection onto the session of master, which is already authenticated, with SFTP and exec channels of
+    // its own, so that sudo and background commands are separate. Takes milliseconds rather than a handshake, and needs
+    // no password. Throws ConnectionError if the session of master has failed.
+    explicit SftpConnection(shared_ptr<SftpConnection> master);
+
+    // Connections onto the same session may be used from different threads, but libssh2 only allows one at a time, so
+    // everything other than constructing and destroying must hold this. Reentrant.
+    SessionLock LockSession();
+
+    // Makes conn, authenticated by now, the one that connections to the same host made afterwards in this process open
+    // onto, rather than connecting afresh.
+    static void Share(shared_ptr<SftpConnection> conn);
+
+    // The connection to host_desc last given to Share, if it is still around.
+    static shared_ptr<SftpConnection> Shared(HostDesc host_desc);
+
+    // Stops sharing the session of this connection, such as once it has failed.
+    void Unshare();
+
+    // If dir_entry is given, it is set to the attributes of path itself, as of just before listing it, or to an
+    // empty DirEntry if those could not be retrieved.
+    vector<DirEntry> GetDir(string path, DirEntry *dir_entry = nullptr);
+
+    // Like GetDir, but returns nullopt without listing if the modification time, size and mode of path are still those
+    // in known. Note that modification times only have a resolution of seconds over SFTP, so this misses changes made
+    // within the same second as the listing that known came from.
+    optional<vector<DirEntry>> GetDirIfChanged(string path, const DirEntry *known, DirEntry *dir_entry);
 
+    // Calls progress with the bytes done and total after every chunk, so it should be cheap, like storing to an atomic.
+    // If point is given, it is kept up to date, and if it is from an earlier attempt at the same download, that
+    // carries on from where it got to, unless the remote file changed since. Gives up on the connection if the host
+    // stops responding for StallTimeoutMs, rather than waiting for the session timeout.
     bool DownloadFile(
             string remote_src_path,
             string local_dst_path,
             function<bool(void)> cancelled,
-            function<void(string, uint64_t, uint64_t, uint64_t)> progress);
+            function<void(uint64_t, uint64_t)> progress,
+            TransferPoint *point = nullptr);
 
+    // Calls progress and uses point like DownloadFile does. Carrying on goes from what the host has of the file.
     bool UploadFile(
             string local_src_path,
             string remote_dst_path,
             function<bool(void)> cancelled,
-            function<void(string, uint64_t, uint64_t, uint64_t)> progress);
+            function<void(uint64_t, uint64_t)> progress,
+            TransferPoint *point = nullptr);
 
+    // Follows symlinks. Returns nullopt if remote_path does not exist.
     optional<DirEntry> Stat(string remote_path);
 
+    // Describes symlinks themselves, like the entries of a listing do.
+    optional<DirEntry> Lstat(string remote_path);
+
+    // Like Lstat, but with the owner and group names a listing shows, which SFTP stat does not give, where the host
+    // allows getting them. For an entry to add to a listing.
+    optional<DirEntry> LstatWithNames(string remote_path);
+
+    // Like Stat, but may answer from the results of the past few seconds. Our own changes are always reflected, but
+    // changes made by others can take that long to show. For checks right before acting on a path.
+    optional<DirEntry> StatCached(string remote_path);
+
+    // Lstat of each of remote_paths, in a single round trip where the host allows. Names of the entries are set, and
+    // symlinks are resolved like in listings.
+    vector<optional<DirEntry>> LstatMany(const vector<string> &remote_paths);
+
     ~SftpConnection();
 
     void Rename(string remote_old_path, string remote_new_path);
@@ -136,6 +237,13 @@ public:
 
     void Mkfile(string remote_path);
 
+    // Sets the permission bits of remote_path, following symlinks.
+    void Chmod(string remote_path, uint32_t mode);
+
+    // Forgets what StatCached knows about remote_path and what is under it. For changes made other than through the
+    // methods here, such as by commands run with Exec.
+    void InvalidateStatCache(const string &remote_path);
+
     string RealPath(string remote_path);
 
     bool PasswordAuth(wxSecretValue passwd);
@@ -144,7 +252,14 @@ public:
 
     bool KeyAuth();
 
-    void SendKeepAlive();
+    // Makes about the smallest request there is and waits for the response, to tell a stalled connection from an idle
+    // one sooner than the session timeout would. Updates the round trip time, and throws ConnectionError if there is no
+    // response within StallTimeoutMs.
+    void Heartbeat();
+
+    // How long to go without hearing from the host before giving up on the connection. A couple of seconds, or more
+    // if round trips take that long.
+    int StallTimeoutMs();
 
     bool CheckSudoInstalled();
 
@@ -158,12 +273,71 @@ public:
 
     void SudoExit();
 
+    // Runs cmd over a new exec channel, as root if in sudo mode, passing stdout to on_output as it arrives. Returns the
+    // exit status of the command, with anything it wrote to stderr in err_output, or -1 if it was cancelled, which is
+    // checked for while waiting on the command too. Set long_running for commands that can go quiet for longer than
+    // the session timeout, such as du or rm over a large tree, which are then waited on for as long as the host is
+    // still there. See SessionMux::Run.
+    int Exec(
+            string cmd,
+            function<void(string_view)> on_output,
+            string *err_output,
+            function<bool(void)> cancelled = nullptr,
+            bool long_running = false);
+
+    // Runs each of cmds like Exec, up to EXEC_MANY_CHANNELS of them at once over separate exec channels of this
+    // session, rather than each waiting for the one before it to finish. Fewer if the session has fewer channels to
+    // spare, or the host refuses to open more, down to one at a time. on_output gets the index of the command along
+    // with its output. Returns the exit status and stderr output of each, or nullopt if cancelled.
+    optional<vector<ExecResult>> ExecMany(
+            const vector<string> &cmds,
+            function<void(size_t, string_view)> on_output,
+            function<bool(void)> cancelled = nullptr,
+            bool long_running = false);
+
+    // Starts cmd over an exec channel that stays open, as root if in sudo mode, replacing any previous background
+    // command. Meant for long running monitors, whose output is picked up with ExecBackgroundPoll in between other
+    // operations.
+    void ExecBackgroundStart(string cmd);
+
+    // Returns what the background command wrote to stdout since the last call, without waiting for more. Returns
+    // nullopt once the command has exited, or if none was started.
+    optional<string> ExecBackgroundPoll();
+
+    void ExecBackgroundStop();
+
+    // Closes the extra SFTP sessions that SftpPool opened, so that their channels are there for other connections onto
+    // the same session. For when idle.
+    void ReleaseSftpPool();
+
 private:
     string GetLastErrorMsg();
 
     void SendSudoPasswd(LIBSSH2_CHANNEL *channel);
 
     void VerifySudoStillValid();
+
+    // Opens an exec channel running cmd, and passes it the sudo password if needed. The caller owns the channel.
+    LIBSSH2_CHANNEL *ExecStart(const string &cmd);
+
+    // Throws ChannelRefused if the host refused to open a channel, or ConnectionError if opening it failed otherwise.
+    [[noreturn]] void ChannelOpenFailed(const string &what);
+
+    optional<vector<DirEntry>> GetDirExec(string path);
+
+    optional<DirEntry> StatEx(const string &remote_path, int stat_type);
+
+    // Fills in link_target_ and is_dir_ of the symlinks among entries, the listing of dir. Listings made with find
+    // already have these, so this is only needed for listings made over SFTP.
+    void ResolveLinks(const string &dir, vector<DirEntry> *entries);
+
+    bool LstatManyExec(const vector<string> &remote_paths, vector<optional<DirEntry>> *entries);
+
+    // The main SFTP session along with extra ones, opening more up to a few if the server allows, and the session has
+    // channels to spare. Only the main one in sudo mode, as the others do not run as root.
+    vector<LIBSSH2_SFTP *> SftpPool();
+
+    friend class SftpAsync;
 };
 
 #endif  // SRC_SFTPCONNECTION_H_
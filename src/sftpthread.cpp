@@ -9,26 +9,46 @@
 #include <wx/secretstore.h>
 #include <wx/wx.h>
 
+#include <atomic>
 #include <chrono>  // NOLINT
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT
 #include <variant>
 #include <vector>
 
+#include "src/batchjob.h"
 #include "src/channel.h"
 #include "src/direntry.h"
+#include "src/dirsize.h"
+#include "src/dirwatcher.h"
 #include "src/hostdesc.h"
+#include "src/paths.h"
+#include "src/prewarm.h"
+#include "src/remoteindex.h"
 #include "src/sftpconnection.h"
+#include "src/transferscheduler.h"
 
+using std::atomic;
+using std::thread;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::get_if;
+using std::make_shared;
 using std::make_unique;
+using std::map;
+using std::nullopt;
+using std::optional;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::variant;
 using std::vector;
 
+#define HEARTBEAT_INTERVAL_SECS 5  // While idle. Plus the stall timeout, how long a dead connection goes unnoticed.
+
 template<typename T>
 static void respondToUIThread(wxEvtHandler *response_dest, int id, const T &payload) {
     wxThreadEvent event(wxEVT_THREAD, id);
@@ -41,53 +61,308 @@ static void respondToUIThread(wxEvtHandler *response_dest, int id) {
     wxQueueEvent(response_dest, event.Clone());
 }
 
-void sftpThreadFunc(
-        wxEvtHandler *response_dest,
-        shared_ptr<Channel<threadFuncVariant>> cmd_channel,
-        shared_ptr<Channel<bool>> cancellation_channel) {
-    unique_ptr<SftpConnection> sftp_connection;
+shared_ptr<JobHandle> JobOf(const threadFuncVariant &cmd) {
+    if (auto m = get_if<SftpThreadCmdDownload>(&cmd)) {
+        return m->handle;
+    }
+    if (auto m = get_if<SftpThreadCmdUpload>(&cmd)) {
+        return m->handle;
+    }
+    if (auto m = get_if<SftpThreadCmdUploadOverwrite>(&cmd)) {
+        return m->handle;
+    }
+    if (auto m = get_if<SftpThreadCmdIndex>(&cmd)) {
+        return m->handle;
+    }
+    if (auto m = get_if<SftpThreadCmdDirSizes>(&cmd)) {
+        return m->handle;
+    }
+    if (auto m = get_if<SftpThreadCmdBatch>(&cmd)) {
+        return m->handle;
+    }
+    return nullptr;
+}
+
+static bool isTransfer(const threadFuncVariant &cmd) {
+    return get_if<SftpThreadCmdDownload>(&cmd) || get_if<SftpThreadCmdUpload>(&cmd)
+           || get_if<SftpThreadCmdUploadOverwrite>(&cmd);
+}
+
+// Commands that change nothing on the host, so that doing them over after the connection failed half way is harmless.
+// Not computing directory sizes, which can take long enough that starting over after every reconnect never gets done.
+static bool isRereadable(const threadFuncVariant &cmd) {
+    return get_if<SftpThreadCmdGetDir>(&cmd) || get_if<SftpThreadCmdGoTo>(&cmd) || get_if<SftpThreadCmdIndex>(&cmd);
+}
+
+// Commands of the UI connecting, which reports on its own when they fail.
+static bool isConnecting(const threadFuncVariant &cmd) {
+    return get_if<SftpThreadCmdConnect>(&cmd) || get_if<SftpThreadCmdFingerprintApproved>(&cmd)
+           || get_if<SftpThreadCmdPassword>(&cmd);
+}
+
+// Tells the UI thread when the sftp thread is done with a job, however it ended, so it can be taken off the list of
+// jobs that can be cancelled.
+class JobDoneNotifier {
+    wxEvtHandler *response_dest_;
+
+public:
+    shared_ptr<JobHandle> handle_;
+
+    explicit JobDoneNotifier(wxEvtHandler *response_dest) : response_dest_(response_dest) {}
 
-    auto cancel = [&] {
-        auto r = cancellation_channel->TryGet();
-        return r.has_value() && r;
+    ~JobDoneNotifier() {
+        if (this->handle_) {
+            respondToUIThread(this->response_dest_, ID_SFTP_THREAD_RESPONSE_JOB_DONE,
+                              SftpThreadResponseJobDone{this->handle_->id_});
+        }
+    }
+};
+
+void sftpThreadFunc(wxEvtHandler *response_dest, shared_ptr<Channel<threadFuncVariant>> cmd_channel) {
+    shared_ptr<SftpConnection> sftp_connection;  // Shared with the sftp threads of other windows on the host.
+    unique_ptr<DirWatcher> dir_watcher;  // Declared after sftp_connection, as it must be destroyed first.
+    auto last_heartbeat = steady_clock::now();
+    wxSecretValue passwd;  // That authenticated us, if it took one, for reconnecting without asking again.
+    bool sudo = false;  // Whether the UI asked for sudo, which it asks for again after reconnecting.
+
+    // Transfers cut short by the connection failing, to run again once reconnected, carrying on from where each got
+    // to rather than failing. Their jobs are not done until then.
+    vector<threadFuncVariant> interrupted;
+    map<uint64_t, TransferPoint> resume_points;  // By job id.
+    TransferPoint point;  // Of the transfer running, if any.
+
+    // Once reconnected with the privileges they were started with.
+    auto resume_interrupted = [&]() {
+        for (auto &c : interrupted) {
+            cmd_channel->Put(std::move(c));
+        }
+        interrupted.clear();
     };
 
-    auto upload_progress = [&](string remote_path, uint64_t bytes_done, uint64_t bytes_total, uint64_t bytes_per_sec) {
-        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_UPLOAD_PROGRESS,
-                          SftpThreadResponseProgress{remote_path, bytes_done, bytes_total, bytes_per_sec});
+    // Connects to the host of sftp_connection afresh, without the UI, as long as nothing is needed from the user for
+    // that: the fingerprint of the host is the one approved before, and the agent, a key or the password from before
+    // still lets us in. Returns nullptr otherwise. Throws ConnectionError if connecting fails.
+    auto connect_afresh = [&]() -> shared_ptr<SftpConnection> {
+        auto conn = make_shared<SftpConnection>(sftp_connection->host_desc_);
+        if (conn->fingerprint_ != sftp_connection->fingerprint_) {
+            return nullptr;
+        }
+        if (!conn->AgentAuth() && !conn->KeyAuth() && !(passwd.IsOk() && conn->PasswordAuth(passwd))) {
+            return nullptr;
+        }
+        return conn;
     };
 
-    auto download_progress = [&](string remote_path, uint64_t bytes_done, uint64_t bytes_total,
-                                 uint64_t bytes_per_sec) {
-        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DOWNLOAD_PROGRESS,
-                          SftpThreadResponseProgress{remote_path, bytes_done, bytes_total, bytes_per_sec});
+    // Reconnects after the connection failed, without the UI, like connect_afresh. Returns false if that is not
+    // possible, leaving it to the UI.
+    auto reconnect = [&]() -> bool {
+        auto host_desc = sftp_connection->host_desc_;
+        try {
+            auto shared = SftpConnection::Shared(host_desc);  // Another window may have reconnected already.
+            if (shared) {
+                sftp_connection = make_shared<SftpConnection>(shared);
+                return true;
+            }
+        } catch (ConnectionError) {
+            // Failed too. Carry on connecting afresh.
+        }
+
+        try {
+            auto conn = connect_afresh();
+            if (!conn) {
+                return false;
+            }
+            SftpConnection::Share(conn);
+            sftp_connection = conn;
+            return true;
+        } catch (ConnectionError) {
+            return false;
+        }
     };
 
-    while (1) {
-        auto cmd_opt = cmd_channel->Get(seconds(15));
+    // Indexing runs on a connection of its own, on a thread of its own, so that browsing and transfers carry on
+    // meanwhile. Only one at a time; starting another stops the one before, as its index would be superseded anyway.
+    thread index_worker;
+    shared_ptr<atomic<bool>> index_stop;
+    // Waits for the worker without holding session_lock, which the other windows on the host may be waiting on.
+    auto stop_index_worker = [&](SessionLock *session_lock) {
+        if (index_worker.joinable()) {
+            index_stop->store(true);
+            bool locked = session_lock->lock.owns_lock();
+            if (locked) {
+                session_lock->lock.unlock();
+            }
+            index_worker.join();
+            if (locked) {
+                session_lock->lock.lock();
+            }
+        }
+    };
+
+    // A connection for indexing, set up like the one of the window, including sudo. Returns nullptr if that can not
+    // be done without the user.
+    auto index_connection = [&]() -> shared_ptr<SftpConnection> {
+        try {
+            auto conn = connect_afresh();
+            if (conn && sudo) {
+                conn->sudo_passwd_ = sftp_connection->sudo_passwd_;
+                if (conn->CheckSudoNeedsPasswd()) {
+                    conn->VerifySudoPasswd();
+                }
+                conn->SudoEnter(conn->CheckSudoNeedsPasswd());
+            }
+            return conn;
+        } catch (ConnectionError) {
+            return nullptr;
+        } catch (SudoFailed) {
+            return nullptr;
+        }
+    };
+
+    // So the listing can be patched with the entry for remote_path, rather than retrieved again.
+    auto stat_entry = [&](string remote_path) -> optional<DirEntry> {
+        try {
+            auto entry = sftp_connection->LstatWithNames(remote_path);
+            if (entry.has_value()) {
+                entry->SetName(basename(remote_path));
+            }
+            return entry;
+        } catch (FailedPermission) {
+            return nullopt;  // There, but not readable.
+        }
+    };
+
+    // Describes the change from removing removed_path, if not empty, and adding or updating added_path, if not empty.
+    auto changed = [&](string removed_path, string added_path) {
+        SftpThreadResponseChanged r;
+        auto &path = added_path.empty() ? removed_path : added_path;
+        r.dir = normalize_path(path + "/..");
+        if (!removed_path.empty()) {
+            if (normalize_path(removed_path + "/..") != r.dir) {
+                r.dir = "";  // Moved to another dir.
+                return r;
+            }
+            r.patch.removed.push_back(basename(removed_path));
+        }
+        if (!added_path.empty()) {
+            auto entry = stat_entry(added_path);
+            if (!entry.has_value()) {
+                r.dir = "";
+                return r;
+            }
+            r.patch.updated.push_back(*entry);
+        }
+        return r;
+    };
 
-        // Too early to have received any real cancellations, so remove any old ones there may be.
-        cancellation_channel->Clear();
+    while (1) {
+        // While watching a dir, wake up often enough to pass its changes on promptly.
+        auto cmd_opt = cmd_channel->Get(dir_watcher ? milliseconds(250) : seconds(HEARTBEAT_INTERVAL_SECS));
+        // The sftp threads of other windows on the host may be using the same session.
+        auto session_lock = sftp_connection ? sftp_connection->LockSession() : SessionLock();
 
         threadFuncVariant cmd;
+        JobDoneNotifier job_done(response_dest);
+        point = TransferPoint();
         try {
             if (cmd_opt.has_value()) {
-                cmd = *cmd_opt;
-            } else if (!sftp_connection->home_dir_.empty()) {
-                sftp_connection->SendKeepAlive();
+                cmd = std::move(*cmd_opt);
+            } else if (sftp_connection && !sftp_connection->home_dir_.empty()) {
+                if (dir_watcher) {
+                    auto patch = dir_watcher->Poll();
+                    if (patch.has_value()) {
+                        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DIR_PATCH,
+                                          SftpThreadResponseDirPatch{dir_watcher->Dir(), *patch});
+                    }
+                }
+                if (steady_clock::now() - last_heartbeat >= seconds(HEARTBEAT_INTERVAL_SECS)) {
+                    sftp_connection->Heartbeat();
+                    last_heartbeat = steady_clock::now();
+                }
+                sftp_connection->ReleaseSftpPool();  // For the other windows on the host, while this one has no use.
                 continue;
             } else {
                 continue;
             }
 
+            job_done.handle_ = JobOf(cmd);
+            auto handle = job_done.handle_;
+            auto cancel = [handle] {
+                return handle && handle->Cancelled();
+            };
+            // Stores progress where the UI thread samples it, rather than sending it an event for every chunk.
+            auto bytes_progress = [handle](uint64_t bytes_done, uint64_t bytes_total) {
+                if (handle) {
+                    handle->SetBytes(bytes_done, bytes_total);
+                }
+            };
+            if (cancel()) {
+                // Cancelled while still waiting its turn, so not started at all.
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                continue;
+            }
+            // Waits for the budget for transfers, shared with the windows on other hosts too. Other windows on this
+            // host can use the session meanwhile. Returns nullptr if cancelled while waiting.
+            auto acquire_slot = [&]() {
+                bool locked = session_lock.lock.owns_lock();
+                if (locked) {
+                    session_lock.lock.unlock();
+                }
+                auto slot = AcquireTransferSlot(sftp_connection->host_desc_.ToString(), cancel);
+                if (locked) {
+                    session_lock.lock.lock();
+                }
+                return slot;
+            };
+            // Reports progress like bytes_progress, and keeps the transfer within the bandwidth budget.
+            auto throttled_progress = [bytes_progress](TransferSlot *slot) {
+                return [bytes_progress, slot](uint64_t bytes_done, uint64_t bytes_total) {
+                    bytes_progress(bytes_done, bytes_total);
+                    slot->Throttle(bytes_done);
+                };
+            };
+            if (handle && resume_points.count(handle->id_)) {
+                point = resume_points[handle->id_];
+                resume_points.erase(handle->id_);
+            }
+
             if (get_if<SftpThreadCmdShutdown>(&cmd)) {
-                return;  // Destructor of sftp_connection will be called.
+                stop_index_worker(&session_lock);  // Before the window it reports to goes away.
+                dir_watcher = nullptr;  // While still holding session_lock.
+                return;  // Destructor of sftp_connection will be called, unless other windows still use it.
             }
 
             if (get_if<SftpThreadCmdConnect>(&cmd)) {
                 auto m = get_if<SftpThreadCmdConnect>(&cmd);
 
-                sftp_connection = make_unique<SftpConnection>(m->host_desc);
+                dir_watcher = nullptr;
+                if (session_lock.lock) {
+                    session_lock.lock.unlock();  // Rather than hold up other windows while connecting.
+                }
+
+                // Another window is already connected to the host, so no need for a handshake or authentication.
+                auto shared = SftpConnection::Shared(m->host_desc);
+                if (shared) {
+                    try {
+                        sftp_connection = make_shared<SftpConnection>(shared);
+                        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CONNECTED,
+                                          SftpThreadResponseConnected{sftp_connection->home_dir_});
+                        if (!sudo) {
+                            resume_interrupted();
+                        }
+                        continue;
+                    } catch (ChannelRefused) {
+                        // Its session is fine, but has no channels left for another window, so one of our own.
+                    } catch (ConnectionError) {
+                        shared->Unshare();  // Its session has failed, so connect afresh instead.
+                    }
+                }
+
+                shared_ptr<SftpConnection> conn = TakePrewarmedConnection(m->host_desc);
+                if (!conn) {
+                    conn = make_shared<SftpConnection>(m->host_desc);
+                }
+                sftp_connection = conn;  // Only once connected, so it is never left null by a failed attempt.
 
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_NEED_FINGERPRINT_APPROVAL,
                                   SftpThreadResponseNeedFingerprintApproval{sftp_connection->fingerprint_});
@@ -112,8 +387,12 @@ void sftpThreadFunc(
                     continue;
                 }
 
+                SftpConnection::Share(sftp_connection);
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CONNECTED,
                                   SftpThreadResponseConnected{sftp_connection->home_dir_});
+                if (!sudo) {
+                    resume_interrupted();
+                }
                 continue;
             }
 
@@ -123,17 +402,41 @@ void sftpThreadFunc(
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_ERROR_AUTH);
                     continue;
                 }
+                passwd = m->password;
 
+                SftpConnection::Share(sftp_connection);
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CONNECTED,
                                   SftpThreadResponseConnected{sftp_connection->home_dir_});
+                if (!sudo) {
+                    resume_interrupted();
+                }
                 continue;
             }
 
+            if (!sftp_connection) {
+                // The UI sent it before finding out that connecting failed. Transfers wait for it to reconnect.
+                throw ConnectionError("not connected");
+            }
+
             if (get_if<SftpThreadCmdGetDir>(&cmd)) {
                 auto m = get_if<SftpThreadCmdGetDir>(&cmd);
-                auto dir_list = sftp_connection->GetDir(m->dir);
+                // Watching starts before listing, so nothing that changes in between is missed.
+                if (!m->watch) {
+                    dir_watcher = nullptr;
+                } else if (!dir_watcher || dir_watcher->Dir() != m->dir) {
+                    dir_watcher = nullptr;  // Stops the old watch first, which would otherwise stop the new one.
+                    dir_watcher = make_unique<DirWatcher>(sftp_connection.get(), m->dir);
+                }
+                DirEntry dir_entry;
+                auto dir_list = sftp_connection->GetDirIfChanged(
+                        m->dir, m->shown.has_value() ? &*m->shown : nullptr, &dir_entry);
+                if (!dir_list.has_value()) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DIR_UNCHANGED,
+                                      SftpThreadResponseDirUnchanged{m->dir});
+                    continue;
+                }
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_GET_DIR,
-                                  SftpThreadResponseGetDir{m->dir, dir_list});
+                                  SftpThreadResponseGetDir{m->dir, *dir_list, dir_entry});
                 continue;
             }
 
@@ -141,7 +444,7 @@ void sftpThreadFunc(
                 auto m = get_if<SftpThreadCmdDownload>(&cmd);
 
                 // If it turns out to be a dir, it's probably because it's a symlink.
-                auto dir_entry = sftp_connection->Stat(m->remote_path);
+                auto dir_entry = sftp_connection->StatCached(m->remote_path);
                 if (dir_entry.has_value() && LIBSSH2_SFTP_S_ISDIR(dir_entry->mode_)) {
                     auto real_path = sftp_connection->RealPath(m->remote_path);
                     respondToUIThread(
@@ -151,11 +454,17 @@ void sftpThreadFunc(
                     continue;
                 }
 
+                auto slot = acquire_slot();
+                if (!slot) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                    continue;
+                }
                 bool completed = sftp_connection->DownloadFile(
                         m->remote_path,
                         m->local_path,
                         cancel,
-                        download_progress);
+                        throttled_progress(slot.get()),
+                        &point);
                 if (completed) {
                     respondToUIThread(
                             response_dest,
@@ -169,14 +478,20 @@ void sftpThreadFunc(
 
             if (get_if<SftpThreadCmdUploadOverwrite>(&cmd)) {
                 auto m = get_if<SftpThreadCmdUploadOverwrite>(&cmd);
+                auto slot = acquire_slot();
+                if (!slot) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                    continue;
+                }
                 bool completed = sftp_connection->UploadFile(
                         m->local_path,
                         m->remote_path,
                         cancel,
-                        upload_progress);
+                        throttled_progress(slot.get()),
+                        &point);
                 if (completed) {
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_UPLOAD,
-                                      SftpThreadResponseUpload{m->remote_path});
+                                      SftpThreadResponseUpload{m->remote_path, stat_entry(m->remote_path)});
                 } else {
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
                 }
@@ -186,7 +501,7 @@ void sftpThreadFunc(
             if (get_if<SftpThreadCmdUpload>(&cmd)) {
                 auto m = get_if<SftpThreadCmdUpload>(&cmd);
 
-                auto dir_entry = sftp_connection->Stat(m->remote_path);
+                auto dir_entry = sftp_connection->StatCached(m->remote_path);
                 if (dir_entry.has_value()) {
                     if (dir_entry->is_dir_) {
                         respondToUIThread(
@@ -203,14 +518,20 @@ void sftpThreadFunc(
                     continue;
                 }
 
+                auto slot = acquire_slot();
+                if (!slot) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                    continue;
+                }
                 bool completed = sftp_connection->UploadFile(
                         m->local_path,
                         m->remote_path,
                         cancel,
-                        upload_progress);
+                        throttled_progress(slot.get()),
+                        &point);
                 if (completed) {
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_UPLOAD,
-                                      SftpThreadResponseUpload{m->remote_path});
+                                      SftpThreadResponseUpload{m->remote_path, stat_entry(m->remote_path)});
                 } else {
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
                 }
@@ -220,35 +541,39 @@ void sftpThreadFunc(
             if (get_if<SftpThreadCmdRename>(&cmd)) {
                 auto m = get_if<SftpThreadCmdRename>(&cmd);
                 sftp_connection->Rename(m->remote_old_path, m->remote_new_path);
-                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS);
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS,
+                                  changed(m->remote_old_path, m->remote_new_path));
                 continue;
             }
 
             if (get_if<SftpThreadCmdDelete>(&cmd)) {
                 auto m = get_if<SftpThreadCmdDelete>(&cmd);
                 sftp_connection->Delete(m->remote_path);
-                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DELETE_SUCCEEDED);
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DELETE_SUCCEEDED,
+                                  changed(m->remote_path, ""));
                 continue;
             }
 
             if (get_if<SftpThreadCmdMkdir>(&cmd)) {
                 auto m = get_if<SftpThreadCmdMkdir>(&cmd);
                 sftp_connection->Mkdir(m->remote_path);
-                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS);
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS,
+                                  changed("", m->remote_path));
                 continue;
             }
 
             if (get_if<SftpThreadCmdMkfile>(&cmd)) {
                 auto m = get_if<SftpThreadCmdMkfile>(&cmd);
                 sftp_connection->Mkfile(m->remote_path);
-                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS);
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUCCESS,
+                                  changed("", m->remote_path));
                 continue;
             }
 
             if (get_if<SftpThreadCmdGoTo>(&cmd)) {
                 auto m = get_if<SftpThreadCmdGoTo>(&cmd);
 
-                auto dir_entry = sftp_connection->Stat(m->remote_path);
+                auto dir_entry = sftp_connection->StatCached(m->remote_path);
                 if (!dir_entry.has_value()) {
                     respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_FILE_NOT_FOUND,
                                       SftpThreadResponseFileError{m->remote_path, cmd});
@@ -262,6 +587,7 @@ void sftpThreadFunc(
 
             if (get_if<SftpThreadCmdSudo>(&cmd)) {
                 auto m = get_if<SftpThreadCmdSudo>(&cmd);
+                dir_watcher = nullptr;  // Restarted with the new privileges by the refresh that follows.
                 sftp_connection->sudo_passwd_ = m->password;
 
                 if (!sftp_connection->CheckSudoInstalled()) {
@@ -283,14 +609,115 @@ void sftpThreadFunc(
                 bool needs_passwd_again = sftp_connection->CheckSudoNeedsPasswd();
 
                 sftp_connection->SudoEnter(needs_passwd_again);
+                sudo = true;
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUDO_SUCCEEDED);
+                resume_interrupted();
                 continue;
             }
 
             if (get_if<SftpThreadCmdSudoExit>(&cmd)) {
+                dir_watcher = nullptr;
                 sftp_connection->SudoExit();
                 sftp_connection->sudo_passwd_ = wxSecretValue();
+                sudo = false;
                 respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUDO_EXIT_SUCCEEDED);
+                resume_interrupted();
+                continue;
+            }
+
+            if (get_if<SftpThreadCmdIndex>(&cmd)) {
+                auto m = get_if<SftpThreadCmdIndex>(&cmd);
+                stop_index_worker(&session_lock);
+                bool locked = session_lock.lock.owns_lock();
+                if (locked) {
+                    session_lock.lock.unlock();  // Rather than hold up other windows on the host while connecting.
+                }
+                auto conn = index_connection();
+                if (locked) {
+                    session_lock.lock.lock();
+                }
+                if (conn) {
+                    index_stop = make_shared<atomic<bool>>(false);
+                    index_worker = thread([response_dest, conn, m = *m, stop = index_stop]() {
+                        JobDoneNotifier worker_job_done(response_dest);
+                        worker_job_done.handle_ = m.handle;
+                        try {
+                            auto index = make_shared<RemoteIndex>(m.root, m.max_depth);
+                            bool completed = index->Update(conn.get(), m.prev.get(), [&]() {
+                                return stop->load() || (m.handle && m.handle->Cancelled());
+                            }, [&](size_t entries) {
+                                if (m.handle) {
+                                    m.handle->SetItems(entries, 0);
+                                }
+                            });
+                            if (completed) {
+                                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_INDEX,
+                                                  SftpThreadResponseIndex{index});
+                            }
+                        } catch (ConnectionError e) {
+                            respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_INDEX_FAILED,
+                                              SftpThreadResponseError{e.msg_});
+                        } catch (...) {
+                            respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_INDEX_FAILED,
+                                              SftpThreadResponseError{"could not list " + m.root});
+                        }
+                    });
+                    job_done.handle_ = nullptr;  // Done once the worker is.
+                    continue;
+                }
+
+                // Otherwise here, which holds up everything else until done, but works wherever the UI connected.
+                auto index = make_shared<RemoteIndex>(m->root, m->max_depth);
+                bool completed = index->Update(sftp_connection.get(), m->prev.get(), cancel, [&](size_t entries) {
+                    if (handle) {
+                        handle->SetItems(entries, 0);
+                    }
+                });
+                if (completed) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_INDEX, SftpThreadResponseIndex{index});
+                } else {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                }
+                continue;
+            }
+
+            if (get_if<SftpThreadCmdDirSizes>(&cmd)) {
+                auto m = get_if<SftpThreadCmdDirSizes>(&cmd);
+                bool completed = ComputeDirSizes(sftp_connection.get(), m->dir, m->names, cancel,
+                                                 [&](const string &name, uint64_t bytes, bool complete) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DIR_SIZE,
+                                      SftpThreadResponseDirSize{m->dir, name, bytes, complete});
+                });
+                if (completed) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_DIR_SIZES,
+                                      SftpThreadResponseDirSizes{m->dir});
+                } else {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                }
+                continue;
+            }
+
+            if (get_if<SftpThreadCmdBatch>(&cmd)) {
+                auto m = get_if<SftpThreadCmdBatch>(&cmd);
+                auto slot = acquire_slot();
+                if (!slot) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                    continue;
+                }
+                BatchResult result;
+                bool completed = RunBatchJob(sftp_connection.get(), m->job, cancel, [&](const BatchProgress &p) {
+                    if (handle) {
+                        handle->SetItems(p.items_done, p.items_total);
+                        handle->SetBytes(p.bytes_done, p.bytes_total);
+                    }
+                    slot->Throttle(p.bytes_done);
+                }, &result);
+                if (completed) {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_BATCH,
+                                      SftpThreadResponseBatch{m->job, result});
+                } else {
+                    respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                }
                 continue;
             }
         } catch (DownloadFailed e) {
@@ -320,10 +747,64 @@ void sftpThreadFunc(
         } catch (SudoFailed e) {
             respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_SUDO_FAILED,
                               SftpThreadResponseError{e.msg_});
+            sudo = false;  // Not elevated after all, so carry on without.
+            resume_interrupted();
+        } catch (ChannelRefused e) {
+            // Nothing wrong with the connection, so no reconnecting, which would not get more channels anyway.
+            respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CHANNEL_REFUSED,
+                              SftpThreadResponseError{e.msg_});
         } catch (ConnectionError e) {
+            dir_watcher = nullptr;
+            bool queued = false;
+            if (job_done.handle_ && isTransfer(cmd) && !job_done.handle_->Cancelled()) {
+                // Not done yet, but carried on from where it got to once reconnected.
+                resume_points[job_done.handle_->id_] = point;
+                if (auto m = get_if<SftpThreadCmdUpload>(&cmd); m && point.source_modified != 0) {
+                    // What it already uploaded would otherwise be taken for a file to confirm overwriting.
+                    cmd = SftpThreadCmdUploadOverwrite{m->local_path, m->remote_path, m->handle};
+                }
+                interrupted.push_back(std::move(cmd));
+                job_done.handle_ = nullptr;
+                queued = true;
+            }
+            if (!sftp_connection) {
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_ERROR_CONNECTION,
+                                  SftpThreadResponseError{e.msg_});
+                continue;
+            }
+            sftp_connection->Unshare();
+            if (session_lock.lock) {
+                session_lock.lock.unlock();  // Of the failed session, which other windows may be waiting on.
+            }
+
+            // Only once it was connected, and not while the UI is connecting again, as then it is the UI that says so.
+            bool connecting = cmd_opt.has_value() && isConnecting(cmd);
+            if (!connecting && !sftp_connection->home_dir_.empty() && reconnect()) {
+                respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CONNECTED,
+                                  SftpThreadResponseConnected{sftp_connection->home_dir_});
+                if (cmd_opt.has_value() && !queued) {
+                    if (job_done.handle_ && job_done.handle_->Cancelled()) {
+                        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_CANCELLED);
+                    } else if (isRereadable(cmd)) {
+                        interrupted.push_back(std::move(cmd));  // Only reads, so no harm in doing it over.
+                        job_done.handle_ = nullptr;
+                    } else {
+                        // May or may not have taken effect on the host, so it is up to the user to try it again.
+                        respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_INTERRUPTED,
+                                          SftpThreadResponseInterrupted{e.msg_, cmd});
+                    }
+                }
+                if (!sudo) {
+                    resume_interrupted();  // Otherwise once the UI has elevated again.
+                }
+                continue;
+            }
+            // Rather than heartbeat a connection known to have failed. The UI connects again.
+            sftp_connection = nullptr;
             respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_ERROR_CONNECTION,
                               SftpThreadResponseError{e.msg_});
         } catch (exception e) {
+            dir_watcher = nullptr;
             respondToUIThread(response_dest, ID_SFTP_THREAD_RESPONSE_ERROR_CONNECTION,
                               SftpThreadResponseError{e.what()});
         }
@@ -11,15 +11,21 @@
 #include <wx/wx.h>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <variant>
 #include <vector>
 
+#include "src/batchjob.h"
 #include "src/channel.h"
 #include "src/direntry.h"
+#include "src/dirwatcher.h"
 #include "src/hostdesc.h"
 #include "src/ids.h"
+#include "src/jobhandle.h"
+#include "src/remoteindex.h"
 
+using std::optional;
 using std::shared_ptr;
 using std::string;
 using std::variant;
@@ -49,11 +55,30 @@ struct SftpThreadCmdShutdown {
 
 struct SftpThreadCmdGetDir {
     string dir;
+    bool watch = false;  // Keep following changes to dir afterwards, until the next GetDir.
+    optional<DirEntry> shown;  // Attributes of dir as of the listing already shown. Only listed again if they changed.
 };
 
 struct SftpThreadResponseGetDir {
     string dir;
     vector<DirEntry> dir_list;
+    DirEntry dir_entry;  // Attributes of dir itself.
+};
+
+struct SftpThreadResponseDirUnchanged {
+    string dir;
+};
+
+struct SftpThreadResponseDirPatch {
+    string dir;
+    DirPatch patch;
+};
+
+// How a command of our own changed the entries of dir, so the listing can be patched rather than retrieved again. An
+// empty dir means the change could not be described that way.
+struct SftpThreadResponseChanged {
+    string dir;
+    DirPatch patch;
 };
 
 struct SftpThreadResponseError {
@@ -63,15 +88,18 @@ struct SftpThreadResponseError {
 struct SftpThreadCmdUpload {
     string local_path;
     string remote_path;
+    shared_ptr<JobHandle> handle;
 };
 
 struct SftpThreadCmdUploadOverwrite {
     string local_path;
     string remote_path;
+    shared_ptr<JobHandle> handle;
 };
 
 struct SftpThreadResponseUpload {
     string remote_path;
+    optional<DirEntry> entry;  // The uploaded file as it is now on the host, if it could be stat'ed.
 };
 
 struct SftpThreadResponseConfirmOverwrite {
@@ -83,6 +111,7 @@ struct SftpThreadCmdDownload {
     string local_path;
     string remote_path;
     bool open_in_editor;
+    shared_ptr<JobHandle> handle;
 };
 
 struct SftpThreadResponseDownload {
@@ -126,13 +155,6 @@ struct SftpThreadResponseFollowSymlinkDir {
     string real_path;
 };
 
-struct SftpThreadResponseProgress {
-    string remote_path;
-    uint64_t bytes_done;
-    uint64_t bytes_total;
-    uint64_t bytes_per_sec;
-};
-
 struct SftpThreadCmdSudo {
     wxSecretValue password;
 };
@@ -140,6 +162,44 @@ struct SftpThreadCmdSudo {
 struct SftpThreadCmdSudoExit {
 };
 
+struct SftpThreadCmdIndex {
+    string root;
+    int max_depth;
+    shared_ptr<const RemoteIndex> prev;  // Previous index, if any, to only relist directories that changed since.
+    shared_ptr<JobHandle> handle;
+};
+
+struct SftpThreadResponseIndex {
+    shared_ptr<RemoteIndex> index;
+};
+
+struct SftpThreadCmdDirSizes {
+    string dir;
+    vector<string> names;  // Subdirectories of dir to compute the sizes of.
+    shared_ptr<JobHandle> handle;
+};
+
+struct SftpThreadResponseDirSize {
+    string dir;
+    string name;
+    uint64_t bytes;
+    bool complete;  // Otherwise a running total, with more to come.
+};
+
+struct SftpThreadResponseDirSizes {
+    string dir;
+};
+
+struct SftpThreadCmdBatch {
+    BatchJob job;
+    shared_ptr<JobHandle> handle;
+};
+
+struct SftpThreadResponseBatch {
+    BatchJob job;
+    BatchResult result;
+};
+
 // It would be much more elegant to use std::any, but it is unavailable in MacOS 10.13.
 typedef variant<
         SftpThreadCmdShutdown,
@@ -156,7 +216,10 @@ typedef variant<
         SftpThreadCmdMkfile,
         SftpThreadCmdGoTo,
         SftpThreadCmdSudo,
-        SftpThreadCmdSudoExit
+        SftpThreadCmdSudoExit,
+        SftpThreadCmdIndex,
+        SftpThreadCmdDirSizes,
+        SftpThreadCmdBatch
 > threadFuncVariant;
 
 struct SftpThreadResponseFileError {
@@ -164,15 +227,25 @@ struct SftpThreadResponseFileError {
     threadFuncVariant cmd;
 };
 
+// For a command cut short by the connection failing, which may or may not have taken effect, once reconnected.
+struct SftpThreadResponseInterrupted {
+    string error;
+    threadFuncVariant cmd;
+};
+
 struct SftpThreadResponseDeleteError {
     string remote_path;
     string err;
     threadFuncVariant cmd;
 };
 
-void sftpThreadFunc(
-        wxEvtHandler *response_dest,
-        shared_ptr<Channel<threadFuncVariant>> cmd_channel,
-        shared_ptr<Channel<bool>> cancellation_channel);
+struct SftpThreadResponseJobDone {
+    uint64_t job_id;
+};
+
+// The handle of the job cmd is part of, for the commands that can be cancelled. Otherwise null.
+shared_ptr<JobHandle> JobOf(const threadFuncVariant &cmd);
+
+void sftpThreadFunc(wxEvtHandler *response_dest, shared_ptr<Channel<threadFuncVariant>> cmd_channel);
 
 #endif  // SRC_SFTPTHREAD_H_
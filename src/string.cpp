@@ -54,6 +54,19 @@ string PrettifySentence(string s) {
     return s;
 }
 
+string ShellQuote(const string &s) {
+    string quoted = "'";
+    for (char c : s) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    quoted += "'";
+    return quoted;
+}
+
 #ifdef __WXMSW__
 
 wstring localPathUnicode(string local_path) {
@@ -14,6 +14,9 @@ string encodeBase64(const unsigned char *input, int n);
 
 string PrettifySentence(string s);
 
+// Quotes s for use as a single argument in a POSIX shell command line.
+string ShellQuote(const string &s);
+
 #ifdef __WXMSW__
 
 wstring localPathUnicode(string local_path);
@@ -0,0 +1,264 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/tcpconnect.h"
+
+#ifdef __WXMSW__
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cstring>
+#include <map>
+#include <mutex>  // NOLINT
+#include <string>
+#include <vector>
+
+#include "src/sftpconnection.h"
+
+using std::lock_guard;
+using std::map;
+using std::min;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::vector;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+#define CONNECT_ATTEMPT_DELAY_MS 250  // Between starting attempts. What RFC 8305 recommends.
+#define CONNECT_TIMEOUT_MS (10 * 1000)  // For all attempts together. Same as the timeout of the session.
+#define RESOLVED_TTL_SECS 300  // getaddrinfo does not tell the TTL of the records, so a guess on the short side.
+
+#ifdef __WXMSW__
+typedef WSAPOLLFD PollFd;
+#else
+typedef struct pollfd PollFd;
+#endif
+
+struct ResolvedAddress {
+    sockaddr_storage addr;
+    socklen_t len;
+    int family;
+};
+
+struct Resolved {
+    steady_clock::time_point at;
+    vector<ResolvedAddress> addresses;
+};
+
+// By "host:port". Shared by the connections of all windows, which each connect from their own thread.
+static mutex resolved_mutex;
+static map<string, Resolved> resolved_cache;
+
+static void closeSocket(int sock) {
+#ifdef __WXMSW__
+    closesocket(sock);
+#else
+    close(sock);
+#endif
+}
+
+static void setNonBlocking(int sock, bool non_blocking) {
+#ifdef __WXMSW__
+    u_long mode = non_blocking ? 1 : 0;
+    ioctlsocket(sock, FIONBIO, &mode);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
+}
+
+static bool connectInProgress() {
+#ifdef __WXMSW__
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+static int pollSockets(PollFd *fds, size_t n, int timeout_ms) {
+#ifdef __WXMSW__
+    return WSAPoll(fds, static_cast<ULONG>(n), timeout_ms);
+#else
+    return poll(fds, n, timeout_ms);
+#endif
+}
+
+// Alternates between address families, starting with the one getaddrinfo put first, which follows the preferences of
+// the system. Otherwise the order within each family is kept.
+static vector<ResolvedAddress> interleaveFamilies(const vector<ResolvedAddress> &addresses) {
+    vector<ResolvedAddress> first, other;
+    for (auto &a : addresses) {
+        (a.family == addresses[0].family ? first : other).push_back(a);
+    }
+    vector<ResolvedAddress> result;
+    for (size_t i = 0 ; i < first.size() || i < other.size() ; ++i) {
+        if (i < first.size()) {
+            result.push_back(first[i]);
+        }
+        if (i < other.size()) {
+            result.push_back(other[i]);
+        }
+    }
+    return result;
+}
+
+static vector<ResolvedAddress> resolve(const string &host, int port, bool *cached) {
+    string key = host + ":" + to_string(port);
+    {
+        lock_guard<mutex> lock(resolved_mutex);
+        auto it = resolved_cache.find(key);
+        if (it != resolved_cache.end() && steady_clock::now() - it->second.at < seconds(RESOLVED_TTL_SECS)) {
+            *cached = true;
+            return it->second.addresses;
+        }
+    }
+    *cached = false;
+
+    struct addrinfo *result;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;  // Allow IPv4 or IPv6.
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &result);
+    if (rc != 0) {
+        throw ConnectionError("failed to resolve hostname " + host);
+    }
+    vector<ResolvedAddress> addresses;
+    for (struct addrinfo *rp = result ; rp != NULL ; rp = rp->ai_next) {
+        ResolvedAddress a;
+        memset(&a.addr, 0, sizeof(a.addr));
+        memcpy(&a.addr, rp->ai_addr, rp->ai_addrlen);
+        a.len = static_cast<socklen_t>(rp->ai_addrlen);
+        a.family = rp->ai_family;
+        addresses.push_back(a);
+    }
+    freeaddrinfo(result);
+    if (addresses.empty()) {
+        throw ConnectionError("failed to resolve hostname " + host);
+    }
+
+    addresses = interleaveFamilies(addresses);
+    lock_guard<mutex> lock(resolved_mutex);
+    resolved_cache[key] = Resolved{steady_clock::now(), addresses};
+    return addresses;
+}
+
+static void forgetResolved(const string &host, int port) {
+    lock_guard<mutex> lock(resolved_mutex);
+    resolved_cache.erase(host + ":" + to_string(port));
+}
+
+// Starts an attempt for each of addresses in turn, CONNECT_ATTEMPT_DELAY_MS apart, or right away once the ones before
+// have all failed, and returns the socket of the first to connect. Returns -1 if none did.
+static int race(const vector<ResolvedAddress> &addresses) {
+    vector<PollFd> pending;
+    auto close_pending = [&]() {
+        for (auto &p : pending) {
+            closeSocket(static_cast<int>(p.fd));
+        }
+    };
+
+    size_t next = 0;
+    auto deadline = steady_clock::now() + milliseconds(CONNECT_TIMEOUT_MS);
+    auto next_start = steady_clock::now();
+    while (1) {
+        auto now = steady_clock::now();
+        if (next < addresses.size() && (now >= next_start || pending.empty())) {
+            auto &a = addresses[next++];
+            next_start = now + milliseconds(CONNECT_ATTEMPT_DELAY_MS);
+            int sock = static_cast<int>(socket(a.family, SOCK_STREAM, IPPROTO_TCP));
+            if (sock == -1) {
+                continue;
+            }
+            setNonBlocking(sock, true);
+            if (connect(sock, reinterpret_cast<const sockaddr *>(&a.addr), a.len) == 0) {
+                close_pending();
+                setNonBlocking(sock, false);
+                return sock;
+            }
+            if (!connectInProgress()) {
+                closeSocket(sock);
+                next_start = now;
+                continue;
+            }
+            PollFd p;
+            p.fd = sock;
+            p.events = POLLOUT;
+            p.revents = 0;
+            pending.push_back(p);
+            continue;
+        }
+        if (pending.empty() || now >= deadline) {
+            close_pending();
+            return -1;
+        }
+
+        auto wait = deadline - now;
+        if (next < addresses.size()) {
+            wait = min(wait, next_start - now);
+        }
+        int rc = pollSockets(pending.data(), pending.size(),
+                             static_cast<int>(duration_cast<milliseconds>(wait).count()));
+        if (rc < 0) {
+#ifndef __WXMSW__
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            close_pending();
+            return -1;
+        }
+
+        for (size_t i = 0 ; i < pending.size() ;) {
+            if (pending[i].revents == 0) {
+                ++i;
+                continue;
+            }
+            int sock = static_cast<int>(pending[i].fd);
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&err), &len);
+            pending.erase(pending.begin() + i);
+            if (err == 0) {
+                close_pending();
+                setNonBlocking(sock, false);
+                return sock;
+            }
+            closeSocket(sock);
+            next_start = steady_clock::now();  // No reason to hold off the next one any longer.
+        }
+    }
+}
+
+int ConnectTcp(const string &host, int port) {
+    bool cached;
+    auto addresses = resolve(host, port, &cached);
+    int sock = race(addresses);
+    if (sock == -1 && cached) {
+        // The host may have moved to other addresses since they were cached.
+        forgetResolved(host, port);
+        sock = race(resolve(host, port, &cached));
+    }
+    if (sock == -1) {
+        throw ConnectionError("could not connect to " + host + " on port " + to_string(port));
+    }
+    return sock;
+}
@@ -0,0 +1,19 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_TCPCONNECT_H_
+#define SRC_TCPCONNECT_H_
+
+#include <string>
+
+using std::string;
+
+// Connects to host on port and returns the connected socket, in blocking mode. Throws ConnectionError if the host can
+// not be resolved or none of its addresses can be connected to.
+//
+// Addresses are tried the "Happy Eyeballs" way (RFC 8305): alternating between IPv6 and IPv4, each attempt started a
+// moment after the one before rather than once it has failed, and the first to connect wins. A dead route over one
+// family then only delays the connection by that moment, rather than by a full TCP timeout. Resolved addresses are
+// cached for a few minutes, so reconnecting after a drop does not wait for DNS again.
+int ConnectTcp(const string &host, int port);
+
+#endif  // SRC_TCPCONNECT_H_
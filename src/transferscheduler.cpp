@@ -0,0 +1,124 @@
+// Copyright 2024 Allan Riordan Boll
+
+#include "src/transferscheduler.h"
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <condition_variable>  // NOLINT
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+
+using std::condition_variable;
+using std::function;
+using std::lock_guard;
+using std::make_unique;
+using std::map;
+using std::max;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::this_thread::sleep_for;
+
+#define THROTTLE_BURST_MS 250  // How far transfers may catch up on time the budget went unused.
+#define CANCEL_POLL_MS 100  // How often waiting transfers check if they were cancelled.
+
+// Shared by the sftp threads of all windows.
+static mutex scheduler_mutex;
+static condition_variable scheduler_cv;
+static int max_concurrent = MAX_CONCURRENT_TRANSFERS_DEFAULT;
+static uint64_t max_bytes_per_sec = 0;
+static int running = 0;
+static map<string, int> running_by_host;
+static map<uint64_t, string> waiting;  // Hosts of the transfers waiting to start, by when they started waiting.
+static uint64_t next_ticket = 1;
+static steady_clock::time_point budget_free_at;  // When the bandwidth budget has room for more.
+
+// The waiting transfer to start next, or 0 if none may start yet. Must hold scheduler_mutex.
+static uint64_t nextToStart() {
+    if (running >= max_concurrent) {
+        return 0;
+    }
+    uint64_t ticket = 0;
+    int fewest = 0;
+    for (auto &w : waiting) {  // In the order they started waiting, so that it goes first among equals.
+        auto it = running_by_host.find(w.second);
+        int n = it == running_by_host.end() ? 0 : it->second;
+        if (!ticket || n < fewest) {
+            ticket = w.first;
+            fewest = n;
+        }
+    }
+    return ticket;
+}
+
+unique_ptr<TransferSlot> AcquireTransferSlot(string host, function<bool(void)> cancelled) {
+    unique_lock<mutex> lock(scheduler_mutex);
+    uint64_t ticket = next_ticket++;
+    waiting[ticket] = host;
+    while (nextToStart() != ticket) {
+        if (cancelled && cancelled()) {
+            waiting.erase(ticket);
+            scheduler_cv.notify_all();  // Someone else may be next now.
+            return nullptr;
+        }
+        scheduler_cv.wait_for(lock, milliseconds(CANCEL_POLL_MS));
+    }
+    waiting.erase(ticket);
+    ++running;
+    ++running_by_host[host];
+    scheduler_cv.notify_all();  // The next in line may start too, if there is room.
+    return make_unique<TransferSlot>(host);
+}
+
+TransferSlot::~TransferSlot() {
+    lock_guard<mutex> lock(scheduler_mutex);
+    --running;
+    if (--running_by_host[this->host_] <= 0) {
+        running_by_host.erase(this->host_);
+    }
+    scheduler_cv.notify_all();
+}
+
+void TransferSlot::Throttle(uint64_t bytes_done) {
+    if (!this->started_ || bytes_done < this->bytes_done_) {
+        // Counting from here, as what a transfer carried on from was done before it got the slot.
+        this->started_ = true;
+        this->bytes_done_ = bytes_done;
+        return;
+    }
+    uint64_t bytes = bytes_done - this->bytes_done_;
+    this->bytes_done_ = bytes_done;
+
+    steady_clock::duration wait;
+    {
+        lock_guard<mutex> lock(scheduler_mutex);
+        if (!max_bytes_per_sec || !bytes) {
+            return;
+        }
+        // Each chunk books its share of the budget after the chunks of other transfers booked before it, so that they
+        // take turns.
+        auto now = steady_clock::now();
+        budget_free_at = max(budget_free_at, now - milliseconds(THROTTLE_BURST_MS))
+                         + microseconds(bytes * 1000000 / max_bytes_per_sec);
+        wait = budget_free_at - now;
+    }
+    if (wait > steady_clock::duration::zero()) {
+        sleep_for(wait);
+    }
+}
+
+void SetTransferLimits(int concurrent, uint64_t bytes_per_sec) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    max_concurrent = max(concurrent, 1);
+    max_bytes_per_sec = bytes_per_sec;
+    scheduler_cv.notify_all();  // There may be room for more now.
+}
@@ -0,0 +1,43 @@
+// Copyright 2024 Allan Riordan Boll
+
+#ifndef SRC_TRANSFERSCHEDULER_H_
+#define SRC_TRANSFERSCHEDULER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+using std::function;
+using std::string;
+using std::unique_ptr;
+
+#define MAX_CONCURRENT_TRANSFERS_DEFAULT 4  // Enough to fill most links, without making each transfer crawl.
+
+// Schedules the transfers of all windows in the process, whichever host each is on, within one budget: how many may
+// run at once, and how many bytes per second they may move together. When a transfer ends, the next to start is one
+// for the host with the fewest transfers running, so that a long queue for one host does not hold up the others.
+
+// Permission for one transfer to run. Held for as long as it runs.
+class TransferSlot {
+    string host_;
+    bool started_ = false;
+    uint64_t bytes_done_ = 0;  // As of the previous Throttle.
+
+public:
+    explicit TransferSlot(string host) : host_(host) {}
+
+    ~TransferSlot();
+
+    // Waits for as long as it takes to stay within the bandwidth budget, given that bytes_done bytes of the transfer
+    // are done so far.
+    void Throttle(uint64_t bytes_done);
+};
+
+// Waits until a transfer for host, such as its HostDesc::ToString, may start. Returns nullptr if cancelled returns
+// true before then.
+unique_ptr<TransferSlot> AcquireTransferSlot(string host, function<bool(void)> cancelled);
+
+// Sets the budget. 0 bytes per second means no limit. Transfers already running carry on, and count against it.
+void SetTransferLimits(int concurrent, uint64_t bytes_per_sec);
+
+#endif  // SRC_TRANSFERSCHEDULER_H_